@@ -159,8 +159,23 @@ enum
      * enumerates domains recommended for registration.
      */
 
-    kDNSServiceFlagsLongLivedQuery      = 0x100
+    kDNSServiceFlagsLongLivedQuery      = 0x100,
     /* Flag for creating a long-lived unicast query for the DNSServiceQueryRecord call. */
+
+    kDNSServiceFlagsShareConnection     = 0x4000
+    /* For efficiency, clients that perform many concurrent operations may want to use a
+     * single Unix Domain Socket connection with the background daemon, instead of having a
+     * separate connection for each independent operation. To use this mode, clients first
+     * call DNSServiceCreateConnection(&MainRef) to initialize the main DNSServiceRef.
+     * For each subsequent operation that is to share that same connection, the client copies
+     * the MainRef, and then passes the address of that copy, setting the ShareConnection flag
+     * to tell the library that this DNSServiceRef is not a typical uninitialized DNSServiceRef;
+     * it's a copy of an existing DNSServiceRef whose connection information should be reused.
+     * Only the MainRef's socket is readable, DNSServiceProcessResult() must be called on the
+     * MainRef to deliver the results of every operation sharing its connection.
+     * Deallocating a subordinate DNSServiceRef (from any thread, or from its own callback)
+     * terminates just that operation; deallocating the MainRef terminates all of them.
+     */
     };
 
 /* possible error code values */
@@ -1093,6 +1108,94 @@ void DNSServiceReconfirmRecord
     );
 
 
+/* DNSServiceGetAddrInfo
+ *
+ * Queries for the IP address of a hostname by using either Multicast or Unicast DNS.
+ * Only present in newer daemons, check for it with have_func() before use.
+ *
+ * DNSServiceGetAddrInfoReply() parameters:
+ *
+ * sdRef:           The DNSServiceRef initialized by DNSServiceGetAddrInfo().
+ *
+ * flags:           Possible values are kDNSServiceFlagsMoreComing and
+ *                  kDNSServiceFlagsAdd.
+ *
+ * interfaceIndex:  The interface to which the answers pertain.
+ *
+ * errorCode:       Will be kDNSServiceErr_NoError on success, otherwise will
+ *                  indicate the failure that occurred.  Other parameters are
+ *                  undefined if errorCode is nonzero.
+ *
+ * hostname:        The fully qualified domain name of the host to be queried for.
+ *
+ * address:         IPv4 or IPv6 address.
+ *
+ * ttl:             If the client wishes to cache the result for performance reasons,
+ *                  the TTL indicates how long the client may legitimately hold onto
+ *                  this result, in seconds.
+ *
+ * context:         The context pointer that was passed to the callout.
+ *
+ */
+
+struct sockaddr;
+
+typedef uint32_t DNSServiceProtocol;
+
+enum
+    {
+    kDNSServiceProtocol_IPv4 = 0x01,
+    kDNSServiceProtocol_IPv6 = 0x02
+    /* Pass zero (or both) to DNSServiceGetAddrInfo() for both address families. */
+    };
+
+typedef void (*DNSServiceGetAddrInfoReply)
+    (
+    DNSServiceRef                    sdRef,
+    DNSServiceFlags                  flags,
+    uint32_t                         interfaceIndex,
+    DNSServiceErrorType              errorCode,
+    const char                       *hostname,
+    const struct sockaddr            *address,
+    uint32_t                         ttl,
+    void                             *context
+    );
+
+/* DNSServiceGetAddrInfo() Parameters:
+ *
+ * sdRef:           A pointer to an uninitialized DNSServiceRef, or a copy of a
+ *                  connection's ref when kDNSServiceFlagsShareConnection is set.
+ *
+ * flags:           kDNSServiceFlagsShareConnection, kDNSServiceFlagsLongLivedQuery.
+ *
+ * interfaceIndex:  The interface on which to issue the query, 0 for all interfaces.
+ *
+ * protocol:        kDNSServiceProtocol_IPv4, kDNSServiceProtocol_IPv6 or both.
+ *
+ * hostname:        The fully qualified domain name of the host to be queried for.
+ *
+ * callBack:        The function to be called when the query succeeds or fails asynchronously.
+ *
+ * context:         An application context pointer which is passed to the callback function
+ *                  (may be NULL).
+ *
+ * return value:    Returns kDNSServiceErr_NoError on success (any subsequent, asynchronous
+ *                  errors are delivered to the callback), otherwise returns an error code indicating
+ *                  the error that occurred.
+ */
+
+DNSServiceErrorType DNSServiceGetAddrInfo
+    (
+    DNSServiceRef                    *sdRef,
+    DNSServiceFlags                  flags,
+    uint32_t                         interfaceIndex,
+    DNSServiceProtocol               protocol,
+    const char                       *hostname,
+    DNSServiceGetAddrInfoReply       callBack,
+    void                             *context   /* may be NULL */
+    );
+
+
 /*********************************************************************************************
  *
  *  General Utility Functions
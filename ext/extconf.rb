@@ -25,7 +25,12 @@ def abort( msg )
 	exit 1
 end
 
-unless RUBY_PLATFORM.include? "darwin"
+# --enable-dnssd-stub links the stand-in daemon of rdnssd_stub.c instead
+# of the real client library, for testing and measuring without one
+stub = enable_config("dnssd-stub", false)
+if stub
+  $defs.push("-DDNSSD_STUB")
+elsif not RUBY_PLATFORM.include? "darwin"
   have_library( "mdns", "DNSServiceRefSockFD" ) or
     abort( "can't find rendezvous library" )
 end
@@ -37,6 +42,40 @@ have_header( "dns_sd.h" ) or
 	abort( "can't find the rendezvous client headers" )
 
 check_for_funcs("htons", "ntohs", "if_indextoname", "if_nametoindex")
+# interface names are looked up in a table, kept current by netlink on linux
+have_func("if_nameindex", "net/if.h")
+have_header("linux/rtnetlink.h")
+# newer daemons only, DNSSD.resolve_addresses() queries A and AAAA records without it
+if stub
+  $defs.push("-DHAVE_DNSSERVICEGETADDRINFO")
+else
+  have_func("DNSServiceGetAddrInfo", "dns_sd.h")
+end
+
+# one event loop thread for all services, see rdnssd_loop.c
+have_header("sys/epoll.h")
+have_func("rb_errinfo")
+# ruby 1.9 and later, included by ruby.h
+have_header("ruby/st.h")
+have_func("rb_str_set_len")
+# the strings of replies are interned, in ruby's own table where there is one
+have_func("rb_enc_interned_str", "ruby/encoding.h")
+# replies are read without holding the GVL where possible
+have_header("pthread.h") or abort("can't find pthread.h")
+have_library("pthread", "pthread_mutex_lock")
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl")
+# static probes for tracers, see DNSSD_PROBE in rdnssd.h
+if enable_config("dnssd-probes", true)
+	have_header("sys/sdt.h")
+end
+# the methods that touch no shared state can be called from any Ractor
+have_header("ruby/ractor.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+# monotonic deadlines for DNSSD.resolve_sync and DNSSD.browse_for
+if have_func("clock_gettime", "time.h") or have_library("rt", "clock_gettime", "time.h")
+	$defs.push("-DHAVE_CLOCK_GETTIME") unless $defs.include?("-DHAVE_CLOCK_GETTIME")
+end
 
 create_makefile("rdnssd")
 
@@ -10,6 +10,7 @@
 
 #include "rdnssd.h"
 #include <assert.h>
+#include <stdio.h>
 
 VALUE mDNSSD;
 static VALUE eDNSSDError;
@@ -34,31 +35,87 @@ dnssd_errors_store(VALUE error, int num)
 	dnssd_errors[num - DNSSD_ERROR_START] = error;
 }
 
-void
-dnssd_check_error_code(DNSServiceErrorType e)
+VALUE
+dnssd_error_new(DNSServiceErrorType e)
 {
 	int num = (int)e;
-	if (num) {
-		if(DNSSD_ERROR_START <= num && num < DNSSD_ERROR_END) {
-			rb_raise(dnssd_errors[num - DNSSD_ERROR_START], "DNSSD operation failed with error code: %i", num);
-		} else {
-			rb_raise(eDNSSDUnknownError, "DNSSD operation failed with unrecognized error code: %i", num);
-		}
+	char msg[80];
+	if(DNSSD_ERROR_START <= num && num < DNSSD_ERROR_END) {
+		snprintf(msg, sizeof(msg), "DNSSD operation failed with error code: %i", num);
+		return rb_exc_new2(dnssd_errors[num - DNSSD_ERROR_START], msg);
+	} else {
+		snprintf(msg, sizeof(msg), "DNSSD operation failed with unrecognized error code: %i", num);
+		return rb_exc_new2(eDNSSDUnknownError, msg);
 	}
 }
 
+void
+dnssd_check_error_code(DNSServiceErrorType e)
+{
+	if (e) rb_exc_raise(dnssd_error_new(e));
+}
+
 void
 dnssd_instantiation_error(const char *what)
 {
 	rb_raise(rb_eRuntimeError, "cannot instantiate %s, use DNSSD browse(), resolve() or register() instead", what);
 }
 
+static int
+dnssd_options_key_i(VALUE key, VALUE value, VALUE is_options)
+{
+	if (SYMBOL_P(key)) return ST_CONTINUE;
+	*(int *)is_options = 0;
+	return ST_STOP;
+}
+
+VALUE
+dnssd_extract_options(int *argc, VALUE *argv)
+{
+	VALUE options;
+	int is_options = 1;
+	if (*argc == 0) return Qnil;
+
+	/* text records are Hashes too, options are a plain Hash keyed by Symbols */
+	options = argv[*argc - 1];
+	if (TYPE(options) != T_HASH || rb_obj_class(options) != rb_cHash ||
+			RHASH_SIZE(options) == 0)
+		return Qnil;
+	rb_hash_foreach(options, dnssd_options_key_i, (VALUE)&is_options);
+	if (!is_options) return Qnil;
+
+	--*argc;
+	return options;
+}
+
+VALUE
+dnssd_option(VALUE options, const char *name)
+{
+	if (NIL_P(options)) return Qnil;
+	return rb_hash_aref(options, ID2SYM(rb_intern(name)));
+}
+
 /*
  * Document-module: DNSSD
  * DNSSD is a wrapper for Apple's DNS Service Discovery library.
  * The methods DNSSD.browse(), DNSSD.register(), and DNSSD.resolve()
  * provide the basic API for making your applications DNS Service
  * Discovery aware.
+ *
+ * Services can be started in any Ractor.  Each Ractor has an event
+ * loop thread, a DNSSD.connection and shared subscriptions of its own,
+ * the blocks of a service are called in the Ractor that started it:
+ *
+ *    workers = %w[_http._tcp _ipp._tcp].map do |type|
+ *      Ractor.new(type) do |type|
+ *        DNSSD.browse_for(type).map { |reply| reply.name }
+ *      end
+ *    end
+ *
+ * DNSSD::ResolveCache and the DNSSD::Stub are the main Ractor's.  The
+ * flags of a reply and its strings are shareable, as is a frozen
+ * DNSSD::LazyTextRecord, so replies can be sent to other Ractors to be
+ * taken apart.
  */
 
 static void
@@ -138,6 +195,13 @@ Init_DNSSD(void)
 void Init_DNSSD_Service(void);
 void Init_DNSSD_TextRecord(void);
 void Init_DNSSD_Replies(void);
+void Init_DNSSD_Loop(void);
+void Init_DNSSD_RecordSet(void);
+void Init_DNSSD_Interfaces(void);
+void Init_DNSSD_ResolveCache(void);
+#ifdef DNSSD_STUB
+void Init_DNSSD_Stub(void);
+#endif
 
 void
 Init_rdnssd(void)
@@ -147,5 +211,12 @@ Init_rdnssd(void)
 	Init_DNSSD_Service();
 	Init_DNSSD_TextRecord();
 	Init_DNSSD_Replies();
+	Init_DNSSD_Loop();
+	Init_DNSSD_RecordSet();
+	Init_DNSSD_Interfaces();
+	Init_DNSSD_ResolveCache();
+#ifdef DNSSD_STUB
+	Init_DNSSD_Stub();
+#endif
 }
 
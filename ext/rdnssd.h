@@ -8,22 +8,358 @@
 
 #include <ruby.h>
 #include <dns_sd.h>
+#include <pthread.h>
+
+#ifndef HAVE_RUBY_ST_H
+	/* ruby 1.8, for rb_hash_foreach() */
+	#include <st.h>
+#endif
+
+#ifndef RSTRING_PTR
+	/* ruby 1.8.5 and earlier */
+	#define RSTRING_PTR(s) (RSTRING(s)->ptr)
+	#define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif
+
+#ifndef HAVE_RB_STR_SET_LEN
+	/* ruby 1.8.6 and earlier */
+	#define rb_str_set_len(s, l) (RSTRING(s)->len = (l))
+#endif
+
+#ifndef RARRAY_LEN
+	#define RARRAY_PTR(a) (RARRAY(a)->ptr)
+	#define RARRAY_LEN(a) (RARRAY(a)->len)
+#endif
+
+#ifndef RHASH_SIZE
+	#define RHASH_SIZE(h) (RHASH(h)->tbl->num_entries)
+#endif
+
+#ifndef HAVE_RB_ERRINFO
+	/* ruby 1.8 */
+	#define rb_errinfo() ruby_errinfo
+	#define rb_set_errinfo(e) (ruby_errinfo = (e))
+#endif
+
+#ifdef HAVE_RUBY_RACTOR_H
+	/* ruby 3.0 and later */
+	#include <ruby/ractor.h>
+#else
+	/* no Ractors to share with */
+	#define rb_ractor_make_shareable(obj) rb_obj_freeze(obj)
+#endif
+
+#ifndef HAVE_RB_EXT_RACTOR_SAFE
+	#define rb_ext_ractor_safe(flag) ((void)0)
+#endif
+
+/*
+ * Static probes (USDT) on the path of a reply, from the socket of a
+ * service to its block, for bpftrace, perf, dtrace or systemtap.  Each
+ * is a nop until a tracer attaches to it, and compiles to nothing
+ * without sys/sdt.h (or with extconf.rb --disable-dnssd-probes).
+ * Provider rdnssd:
+ *
+ * service__start(service, operation, name)::  an operation was started
+ * service__stop(service, operation)::         it was stopped
+ * socket__readable(service, operation, fd)::  replies wait in its socket
+ * process__entry(service, operation)::        DNSServiceProcessResult() called
+ * process__return(service, operation, error)::  and returned
+ * reply__built(service, operation, name)::    a reply object was made, _name_
+ *                                             is the full name of a resolve or
+ *                                             record reply, the instance name
+ *                                             of a browse or register reply
+ * block__entry(service, operation, count)::   its block was called with
+ *                                             _count_ replies (see :batch)
+ * block__return(service, operation, count)::  and returned
+ *
+ * _service_ is the address of the dnssd_service_t, _operation_ a string
+ * such as "browse".  For instance the time from a readable socket to
+ * the block:
+ *
+ *    bpftrace -e 'usdt:./rdnssd.so:rdnssd:socket__readable { @t[arg0] = nsecs }
+ *      usdt:./rdnssd.so:rdnssd:block__entry /@t[arg0]/ {
+ *        @us[str(arg1)] = hist((nsecs - @t[arg0]) / 1000); delete(@t[arg0]) }'
+ */
+#ifdef HAVE_SYS_SDT_H
+	#include <sys/sdt.h>
+	#define DNSSD_PROBE2(name, a, b) DTRACE_PROBE2(rdnssd, name, a, b)
+	#define DNSSD_PROBE3(name, a, b, c) DTRACE_PROBE3(rdnssd, name, a, b, c)
+#else
+	#define DNSSD_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+	#define DNSSD_PROBE3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
 
 extern VALUE mDNSSD;
 
+struct dnssd_reply;
+
+/* a FIFO of replies, see rdnssd_loop.c */
+typedef struct dnssd_queue {
+	struct dnssd_reply *head;
+	struct dnssd_reply *tail;
+} dnssd_queue_t;
+
+/* what a full dnssd_ring_t does with the next reply */
+enum {
+	DNSSD_OVERFLOW_DROP_OLDEST,
+	DNSSD_OVERFLOW_COALESCE,	/* replaces a reply about the same name */
+	DNSSD_OVERFLOW_BLOCK	/* the socket is not read until there is room */
+};
+
+/* a fixed number of replies waiting for DNSSD::Service#take, see
+ * rdnssd_loop.c.  Protected by the loop's lock. */
+typedef struct dnssd_ring {
+	struct dnssd_reply **replies;
+	long capacity;
+	long head;	/* index of the oldest reply */
+	long count;
+	int overflow;
+	int paused;	/* DNSSD_OVERFLOW_BLOCK stopped reading the socket */
+	unsigned long dropped;
+	unsigned long coalesced;
+	unsigned long pauses;
+	pthread_cond_t ready;	/* signalled when a reply is added or the ring cleared */
+} dnssd_ring_t;
+
+/* the reply filter options of an operation, see rdnssd_filter.c */
+typedef struct dnssd_filter dnssd_filter_t;
+
+/* what a DNSSD::Connection running a pipeline keeps, see rdnssd_service.c */
+typedef struct dnssd_pipeline dnssd_pipeline_t;
+
+/* What each Ractor has of its own: the event loop running the services
+ * it starts (see rdnssd_loop.c), its DNSSD.connection and its shared
+ * subscriptions (see rdnssd_service.c).  Without Ractors there is one. */
+typedef struct dnssd_loop {
+	pthread_mutex_t mutex;	/* see dnssd_loop_lock() */
+	/* replies read by the loop, waiting to be passed to the blocks */
+	dnssd_queue_t queue;
+	int fd;					/* the epoll set, -1 until the loop is started */
+	int wakeup[2];	/* written to interrupt epoll_wait() */
+	VALUE thread;		/* the ruby thread running the loop */
+	VALUE services;	/* running services, keeps them from being collected */
+	VALUE connection;	/* see DNSSD.connection */
+	VALUE shares;		/* running shared operations by key */
+	VALUE timers;		/* services with a deadline, see dnssd_loop_timeout() */
+	double deadline;	/* the earliest of them, negative if none */
+	int share_default;	/* see DNSSD.share_subscriptions= */
+} dnssd_loop_t;
+
+/* native state of a DNSSD::Service */
+typedef struct dnssd_service {
+	DNSServiceRef client;	/* NULL once the service has been deallocated */
+	VALUE self;						/* the DNSSD::Service wrapping this struct */
+	int stopped;
+	int is_connection;		/* a DNSSD::Connection */
+	int is_registration;	/* started by DNSSD.register() */
+	/* the DNSSD::Connection this service shares, NULL if it has its own */
+	struct dnssd_service *connection;
+	/* replies held back while MoreComing is set, nil unless batching */
+	VALUE batch;
+	/* where replies are queued if the service is not run by the event loop */
+	dnssd_queue_t *queue;
+	/* where the event loop stages replies for DNSSD::Service#take, NULL
+	 * unless the service was started with the :buffer option */
+	dnssd_ring_t *ring;
+	/* replies the callbacks drop, NULL to keep them all */
+	dnssd_filter_t *filter;
+	/* a browse or resolve whose replies go to subscribers, see
+	 * dnssd_share_dispatch() in rdnssd_service.c */
+	int is_shared;
+	/* the shared operation a subscriber gets its replies from, NULL if
+	 * the service runs its own */
+	struct dnssd_service *source;
+	/* the subscriber waits for its DNSSD_REPLY_REPLAY */
+	int replaying;
+	/* what the service does, e.g. "browse", for the DNSSD_PROBE()s */
+	const char *operation;
+	/* the loop of the Ractor that started the service */
+	dnssd_loop_t *loop;
+	/* the pipeline stage the service is, passed the replies themselves
+	 * where a block is passed reply objects; NULL if it is none */
+	void (*stage)(struct dnssd_reply *reply);
+	void *stage_data;	/* what the stage keeps about the service */
+	/* the state of the pipeline a DNSSD::Connection runs, NULL if none */
+	dnssd_pipeline_t *pipeline;
+} dnssd_service_t;
+
+#define GetDNSSDService(obj, var) Data_Get_Struct(obj, dnssd_service_t, var)
+
+/* reply types */
+enum {
+	DNSSD_REPLY_ERROR,	/* DNSServiceProcessResult() failed */
+	DNSSD_REPLY_BROWSE,
+	DNSSD_REPLY_RESOLVE,
+	DNSSD_REPLY_REGISTER,
+	DNSSD_REPLY_RECORD,
+	DNSSD_REPLY_REGISTER_RECORD,	/* a DNSSD::RecordSet record registered */
+	DNSSD_REPLY_FILTERED,	/* the filter dropped the last reply of a :batch burst */
+	DNSSD_REPLY_REPLAY	/* a new subscriber is due the instances already known */
+};
+
+/* A reply copied out of a dns_sd callback.  The callbacks run without
+ * the GVL, the ruby reply object is created later from the copy. */
+typedef struct dnssd_reply {
+	struct dnssd_reply *next;
+	dnssd_service_t *service;
+	int type;
+	DNSServiceErrorType error;
+	DNSServiceFlags flags;
+	uint32_t interface;
+	/* browse and register */
+	const char *name;
+	const char *regtype;
+	const char *domain;
+	/* resolve and record */
+	const char *fullname;
+	const char *target;
+	uint16_t opaqueport;
+	uint16_t txt_len;
+	const char *txt_rec;
+	/* record */
+	uint16_t rrtype;
+	uint16_t rrclass;
+	uint16_t rdlen;
+	const char *rdata;
+	uint32_t ttl;
+	/* register record */
+	DNSRecordRef record;
+	/* the strings above point into data */
+	size_t data_len;
+	char data[1];
+} dnssd_reply_t;
+
+/* allocates a reply for the service _context_ with room for _len_ bytes of
+ * strings, NULL if out of memory. does not need the GVL. */
+dnssd_reply_t *dnssd_reply_alloc(void *context, int type, size_t len);
+/* copies _len_ bytes of _src_ into the data of _reply_ */
+const char *dnssd_reply_copy(dnssd_reply_t *reply, const char *src, size_t len);
+
+/* deallocates the DNSServiceRef, dropping any replies not yet dispatched */
+void	dnssd_service_dealloc_client(dnssd_service_t *service);
+/* creates the ruby reply for _reply_ and passes it to the service's block */
+void	dnssd_service_dispatch(dnssd_reply_t *reply);
+
+/* DNSSD::Connection, see rdnssd_service.c */
+VALUE	dnssd_connection_new(VALUE klass);
+/* gives up what of _service_ is past its deadline, returns its next
+ * deadline, negative if it has none, see dnssd_loop_timeout() */
+double	dnssd_service_expire(dnssd_service_t *service);
+uint32_t	dnssd_get_interface_index(VALUE interface);
+
+/* interface table, see rdnssd_interface.c */
+/* the frozen name of interface _index_, the index if it has none */
+VALUE	dnssd_interface_name(uint32_t index);
+/* the index of interface _name_, 0 if there is none */
+uint32_t	dnssd_interface_index(const char *name);
+/* the socket to watch for interface changes, -1 if none */
+int	dnssd_interface_watch(void);
+/* reads the watched socket, does not need the GVL */
+void	dnssd_interface_drain(void);
+
+/* resolve cache, see rdnssd_cache.c, all do nothing while it is off */
+void	dnssd_cache_store(const char *fullname, uint32_t interface, VALUE reply);
+void	dnssd_cache_remove(const char *name, const char *regtype, const char *domain);
+/* the resolve reply kept for the service on _interface_ (any if 0), nil if none */
+VALUE	dnssd_cache_lookup(const char *name, const char *regtype, const char *domain,
+												 uint32_t interface);
+
+/* DNSSD::RecordSet, see rdnssd_record_set.c */
+void	dnssd_record_set_dispatch(dnssd_reply_t *reply);
+
+void	dnssd_queue_push(dnssd_queue_t *queue, dnssd_reply_t *reply);
+dnssd_reply_t *dnssd_queue_shift(dnssd_queue_t *queue);
+void	dnssd_queue_clear(dnssd_queue_t *queue);
+
+/* seconds on a monotonic clock where there is one */
+double	dnssd_now(void);
+
+/* reply filters, see rdnssd_filter.c */
+/* true if _options_ has filter options */
+int	dnssd_filter_given(VALUE options);
+/* the filter for the filter options in _options_, NULL if there are none */
+dnssd_filter_t *dnssd_filter_new(VALUE options);
+void	dnssd_filter_free(dnssd_filter_t *filter);
+/* true if a reply of _type_ passes _filter_, _name_ and _txt_rec_ are
+ * NULL if the reply has none.  Does not need the GVL. */
+int	dnssd_filter_match(const dnssd_filter_t *filter, int type, DNSServiceFlags flags,
+											 uint32_t interface, const char *name,
+											 uint16_t txt_len, const char *txt_rec);
+
+/* ring buffers, see rdnssd_loop.c */
+dnssd_ring_t *dnssd_ring_new(long capacity, int overflow);
+void	dnssd_ring_free(dnssd_ring_t *ring);
+/* drops the replies and wakes the waiting threads, call with the loop locked */
+void	dnssd_ring_clear(dnssd_ring_t *ring);
+/* Waits at most _timeout_ seconds (forever if negative) until the ring
+ * of _service_ has a reply or the service is stopped, without the GVL if
+ * possible. */
+void	dnssd_ring_wait(dnssd_service_t *service, double timeout);
+/* the oldest reply in the ring of _service_, NULL if there is none */
+dnssd_reply_t *dnssd_ring_shift(dnssd_service_t *service);
+
+/* Waits at most _timeout_ seconds for _service_ (not run by the event loop)
+ * to become readable and reads its replies, without the GVL if possible. */
+void	dnssd_service_wait(dnssd_service_t *service, double timeout);
+
+/* event loop, see rdnssd_loop.c */
+/* the loop of the calling Ractor */
+dnssd_loop_t *dnssd_loop_current(void);
+/* true in the Ractor that loaded the extension, the only one using the
+ * tables shared by all (interned flags, interfaces, resolve cache) */
+int	dnssd_loop_is_main(void);
+void	dnssd_loop_lock(dnssd_loop_t *loop);
+void	dnssd_loop_unlock(dnssd_loop_t *loop);
+void	dnssd_loop_add(dnssd_service_t *service);
+/* makes the loop of _service_ call dnssd_service_expire() for it at
+ * _deadline_ (see dnssd_now()) */
+void	dnssd_loop_timeout(dnssd_service_t *service, double deadline);
+void	dnssd_loop_remove(dnssd_service_t *service);
+/* queues _reply_ on its service's loop and wakes the loop to dispatch it */
+void	dnssd_loop_post(dnssd_reply_t *reply);
+/* stops _service_ after its block raised (rb_protect() _state_), and
+ * re-raises in the main thread if Thread.abort_on_exception is set */
+void	dnssd_loop_rescue(VALUE service, int state);
+/* the rest must be called with the loop locked */
+/* queues _reply_ on its service's queue, or its loop's */
+void	dnssd_loop_enqueue(dnssd_reply_t *reply);
+void	dnssd_loop_purge(dnssd_service_t *service);
+
 void	dnssd_check_error_code(DNSServiceErrorType e);
+/* the DNSSD::Error for _e_, not raised */
+VALUE	dnssd_error_new(DNSServiceErrorType e);
 void	dnssd_instantiation_error(const char *what);
 
+/* removes a trailing options hash from argv, returns it (or nil) */
+VALUE	dnssd_extract_options(int *argc, VALUE *argv);
+/* the value of option _name_ in _options_, nil if not given */
+VALUE	dnssd_option(VALUE options, const char *name);
+
 VALUE	dnssd_create_fullname(VALUE name, VALUE regtype, VALUE domain, int err_flag);
 
 /* decodes a buffer, creating a new text record */
 VALUE	dnssd_tr_new(long len, const char *buf);
+/* a DNSSD::LazyTextRecord of the _len_ bytes at _buf_, which _owner_ keeps
+ * from being freed */
+VALUE	dnssd_tr_lazy_new(VALUE owner, long len, const char *buf);
 
 VALUE	dnssd_tr_to_encoded_str(VALUE v);
 
 /* Get DNSServiceFlags from self */
 DNSServiceFlags dnssd_to_flags(VALUE obj);
 
+/* resource record types and classes, as defined in nameser.h */
+#define DNSSD_RR_A	1
+#define DNSSD_RR_PTR	12
+#define DNSSD_RR_TXT	16
+#define DNSSD_RR_AAAA	28
+#define DNSSD_RR_SRV	33
+#define DNSSD_RR_CLASS_IN	1
+
+/* Get a resource record type from an Integer or a type name like :AAAA */
+uint16_t	dnssd_to_rrtype(VALUE obj);
+
 VALUE	dnssd_register_new(VALUE service,	DNSServiceFlags flags, const char *name,
 													const char *regtype, const char *domain	);
 
@@ -33,6 +369,13 @@ VALUE	dnssd_browse_new(VALUE service,	DNSServiceFlags flags, uint32_t interface,
 VALUE	dnssd_resolve_new(VALUE service, DNSServiceFlags flags, uint32_t interface,
 												const char *fullname, const char *host_target,
 												uint16_t opaqueport, uint16_t txt_len, const char *txt_rec);
+/* gives the resolve reply _self_ the name, type and domain of the instance */
+void	dnssd_resolve_set_names(VALUE self, const char *name, const char *regtype,
+															const char *domain);
+
+VALUE	dnssd_record_new(VALUE service, DNSServiceFlags flags, uint32_t interface,
+											 const char *fullname, uint16_t rrtype, uint16_t rrclass,
+											 uint16_t rdlen, const char *rdata, uint32_t ttl);
 
 #endif /* RDNSSD_INCLUDED */
 
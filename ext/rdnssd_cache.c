@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2004 Chad Fowler, Charles Mills, Rich Kilmer
+ * Licenced under the same terms as Ruby.
+ * This software has absolutely no warranty.
+ */
+
+#include "rdnssd.h"
+
+/*
+ * Resolving a service a connection was just made to costs a round trip
+ * to the daemon each time.  Once DNSSD::ResolveCache.ttl is set every
+ * resolve reply is kept, whatever started the resolve, keyed by its
+ * full name and interface, and DNSSD.resolve_sync() (or DNSSD.resolve()
+ * with the :cache option) answers from it.
+ *
+ * A resolve reply does not carry the TTL of the SRV and TXT records it
+ * is made of, so an entry is kept for DNSSD::ResolveCache.ttl seconds,
+ * by default the 120 that mDNS responders give those records.  A browse
+ * reply removing an instance drops its entries.
+ *
+ * The cache is the main Ractor's, the resolves of other Ractors
+ * neither fill nor use it.
+ */
+
+#define DNSSD_CACHE_TTL 120.0
+#define DNSSD_CACHE_MAX_ENTRIES 4096
+
+static VALUE mDNSSDResolveCache;
+
+/* seconds an entry is kept, 0 while the cache is off */
+static double dnssd_cache_ttl = 0;
+/* fullname => [interface, expires, reply, interface, expires, reply, ...] */
+static VALUE dnssd_cache = Qnil;
+/* the number of replies in dnssd_cache */
+static long dnssd_cache_size = 0;
+static unsigned long dnssd_cache_hits = 0;
+static unsigned long dnssd_cache_misses = 0;
+
+static int
+dnssd_cache_expire_i(VALUE fullname, VALUE entries, VALUE now)
+{
+	VALUE kept = rb_ary_new();
+	long i;
+	for (i=0; i<RARRAY_LEN(entries); i+=3) {
+		if (NUM2DBL(RARRAY_PTR(entries)[i+1]) <= NUM2DBL(now)) {
+			dnssd_cache_size--;
+		} else {
+			rb_ary_push(kept, RARRAY_PTR(entries)[i]);
+			rb_ary_push(kept, RARRAY_PTR(entries)[i+1]);
+			rb_ary_push(kept, RARRAY_PTR(entries)[i+2]);
+		}
+	}
+	if (RARRAY_LEN(kept) == 0) return ST_DELETE;
+	rb_ary_replace(entries, kept);
+	return ST_CONTINUE;
+}
+
+/* drops the entries that have expired */
+static void
+dnssd_cache_expire(void)
+{
+	rb_hash_foreach(dnssd_cache, dnssd_cache_expire_i, rb_float_new(dnssd_now()));
+}
+
+void
+dnssd_cache_store(const char *fullname, uint32_t interface, VALUE reply)
+{
+	VALUE key, entries;
+	double expires;
+	long i;
+
+	if (dnssd_cache_ttl <= 0 || !dnssd_loop_is_main()) return;
+	expires = dnssd_now() + dnssd_cache_ttl;
+	key = rb_str_new2(fullname);
+	entries = rb_hash_aref(dnssd_cache, key);
+	if (!NIL_P(entries)) {
+		for (i=0; i<RARRAY_LEN(entries); i+=3) {
+			if (NUM2ULONG(RARRAY_PTR(entries)[i]) == interface) {
+				rb_ary_store(entries, i+1, rb_float_new(expires));
+				rb_ary_store(entries, i+2, reply);
+				return;
+			}
+		}
+	}
+	if (dnssd_cache_size >= DNSSD_CACHE_MAX_ENTRIES) {
+		dnssd_cache_expire();
+		if (dnssd_cache_size >= DNSSD_CACHE_MAX_ENTRIES) return;
+		entries = rb_hash_aref(dnssd_cache, key);
+	}
+	if (NIL_P(entries)) {
+		entries = rb_ary_new2(3);
+		rb_hash_aset(dnssd_cache, key, entries);
+	}
+	rb_ary_push(entries, ULONG2NUM(interface));
+	rb_ary_push(entries, rb_float_new(expires));
+	rb_ary_push(entries, reply);
+	dnssd_cache_size++;
+}
+
+void
+dnssd_cache_remove(const char *name, const char *regtype, const char *domain)
+{
+	char fullname[kDNSServiceMaxDomainName];
+	VALUE entries;
+
+	if (dnssd_cache_ttl <= 0 || dnssd_cache_size == 0 || !dnssd_loop_is_main()) return;
+	if (DNSServiceConstructFullName(fullname, name, regtype, domain) != 0) return;
+	entries = rb_hash_delete(dnssd_cache, rb_str_new2(fullname));
+	if (!NIL_P(entries)) dnssd_cache_size -= RARRAY_LEN(entries) / 3;
+}
+
+/* the reply for _fullname_ on _interface_ (any if 0), nil on a miss */
+static VALUE
+dnssd_cache_get(VALUE fullname, uint32_t interface)
+{
+	VALUE entries = rb_hash_aref(dnssd_cache, fullname);
+	double now;
+	long i;
+
+	if (!NIL_P(entries)) {
+		now = dnssd_now();
+		for (i=0; i<RARRAY_LEN(entries); i+=3) {
+			if (NUM2DBL(RARRAY_PTR(entries)[i+1]) <= now) continue;
+			if (interface == 0 || NUM2ULONG(RARRAY_PTR(entries)[i]) == interface) {
+				dnssd_cache_hits++;
+				return RARRAY_PTR(entries)[i+2];
+			}
+		}
+	}
+	dnssd_cache_misses++;
+	return Qnil;
+}
+
+VALUE
+dnssd_cache_lookup(const char *name, const char *regtype, const char *domain,
+									 uint32_t interface)
+{
+	char fullname[kDNSServiceMaxDomainName];
+	if (dnssd_cache_ttl <= 0 || !dnssd_loop_is_main()) return Qnil;
+	if (DNSServiceConstructFullName(fullname, name, regtype, domain) != 0) return Qnil;
+	return dnssd_cache_get(rb_str_new2(fullname), interface);
+}
+
+/*
+ * Document-module: DNSSD::ResolveCache
+ *
+ * Keeps the replies of resolves so that DNSSD.resolve_sync() need not
+ * ask the daemon again.  Off until a TTL is set:
+ *
+ *    DNSSD::ResolveCache.ttl = 120
+ *    DNSSD.resolve_sync("foo bar", "_http._tcp", "local") # asks the daemon
+ *    DNSSD.resolve_sync("foo bar", "_http._tcp", "local") # does not
+ *    DNSSD::ResolveCache.hits # => 1
+ *
+ * A cached DNSSD::ResolveReply is the reply of the resolve that filled
+ * the cache, its DNSSD::Reply#service is that resolve's.
+ */
+
+/*
+ * call-seq:
+ *    DNSSD::ResolveCache.ttl => seconds or nil
+ *
+ * How long resolve replies are kept, <code>nil</code> if they are not.
+ */
+
+static VALUE
+dnssd_cache_get_ttl(VALUE self)
+{
+	return dnssd_cache_ttl > 0 ? rb_float_new(dnssd_cache_ttl) : Qnil;
+}
+
+/*
+ * call-seq:
+ *    DNSSD::ResolveCache.clear => nil
+ *
+ * Drops every entry, the counters are kept.
+ */
+
+static VALUE
+dnssd_cache_clear(VALUE self)
+{
+	dnssd_cache = rb_hash_new();
+	dnssd_cache_size = 0;
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    DNSSD::ResolveCache.ttl = seconds or true or nil
+ *
+ * Keeps resolve replies for _seconds_, 120 if +true+.  +nil+ (or
+ * +false+) turns the cache off and empties it.
+ */
+
+static VALUE
+dnssd_cache_set_ttl(VALUE self, VALUE ttl)
+{
+	if (!RTEST(ttl)) {
+		dnssd_cache_ttl = 0;
+		dnssd_cache_clear(self);
+	} else if (ttl == Qtrue) {
+		dnssd_cache_ttl = DNSSD_CACHE_TTL;
+	} else {
+		double seconds = NUM2DBL(ttl);
+		if (seconds <= 0) rb_raise(rb_eArgError, "ttl must be positive");
+		dnssd_cache_ttl = seconds;
+	}
+	return ttl;
+}
+
+/*
+ * call-seq:
+ *    DNSSD::ResolveCache[fullname, interface=nil] => resolve_reply or nil
+ *
+ * The reply kept for _fullname_ (see DNSSD::Reply#fullname) received on
+ * _interface_, or on any interface if it is nil.  Counts as a hit or a
+ * miss.
+ */
+
+static VALUE
+dnssd_cache_aref(int argc, VALUE *argv, VALUE self)
+{
+	VALUE fullname, interface;
+	uint32_t interface_index = 0;
+
+	rb_scan_args(argc, argv, "11", &fullname, &interface);
+	StringValue(fullname);
+	if (dnssd_cache_ttl <= 0) return Qnil;
+	if (!NIL_P(interface))
+		interface_index = dnssd_get_interface_index(interface);
+	return dnssd_cache_get(fullname, interface_index);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::ResolveCache.size => integer
+ *
+ * The number of replies kept, expired ones included until they are
+ * dropped.
+ */
+
+static VALUE
+dnssd_cache_get_size(VALUE self)
+{
+	return LONG2NUM(dnssd_cache_size);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::ResolveCache.hits => integer
+ *
+ * The number of lookups answered from the cache.
+ */
+
+static VALUE
+dnssd_cache_get_hits(VALUE self)
+{
+	return ULONG2NUM(dnssd_cache_hits);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::ResolveCache.misses => integer
+ *
+ * The number of lookups that had to ask the daemon.
+ */
+
+static VALUE
+dnssd_cache_get_misses(VALUE self)
+{
+	return ULONG2NUM(dnssd_cache_misses);
+}
+
+void
+Init_DNSSD_ResolveCache(void)
+{
+/* hack so rdoc documents the project correctly */
+#ifdef mDNSSD_RDOC_HACK
+	mDNSSD = rb_define_module("DNSSD");
+#endif
+	rb_global_variable(&dnssd_cache);
+	dnssd_cache = rb_hash_new();
+
+	mDNSSDResolveCache = rb_define_module_under(mDNSSD, "ResolveCache");
+	rb_define_singleton_method(mDNSSDResolveCache, "ttl", dnssd_cache_get_ttl, 0);
+	rb_define_singleton_method(mDNSSDResolveCache, "ttl=", dnssd_cache_set_ttl, 1);
+	rb_define_singleton_method(mDNSSDResolveCache, "[]", dnssd_cache_aref, -1);
+	rb_define_singleton_method(mDNSSDResolveCache, "size", dnssd_cache_get_size, 0);
+	rb_define_singleton_method(mDNSSDResolveCache, "hits", dnssd_cache_get_hits, 0);
+	rb_define_singleton_method(mDNSSDResolveCache, "misses", dnssd_cache_get_misses, 0);
+	rb_define_singleton_method(mDNSSDResolveCache, "clear", dnssd_cache_clear, 0);
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2004 Chad Fowler, Charles Mills, Rich Kilmer
+ * Licenced under the same terms as Ruby.
+ * This software has absolutely no warranty.
+ */
+
+#include "rdnssd.h"
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * The :name, :prefix, :interfaces, :only and :text options of
+ * DNSSD.browse(), DNSSD.resolve() and DNSSD.query_record() are copied
+ * into a dnssd_filter_t when the operation starts.  The reply callbacks
+ * (see rdnssd_service.c) test each reply against it before the reply
+ * is even copied, so a reply that is not wanted costs a few comparisons
+ * and no ruby object.
+ *
+ * Each option applies to the replies that have what it tests:
+ *
+ * :name::        an fnmatch(3) pattern the instance name of a browse
+ *                reply must match, e.g. "Printer*"
+ * :prefix::      the start of the instance name of a browse reply
+ * :interfaces::  the interface (name or index), or an Array of them,
+ *                replies must have been received on
+ * :only::        <code>:add</code> or <code>:remove</code>, the browse
+ *                and record replies to keep (see DNSSD::Flags::Add)
+ * :text::        a Hash of text record keys and values a resolve reply
+ *                must have; a value of +true+ only asks for the key,
+ *                +nil+ or +false+ for its absence
+ *
+ * Names and keys are compared ignoring case, as DNS-SD does.
+ */
+
+#define DNSSD_FILTER_ADD 1
+#define DNSSD_FILTER_REMOVE 2
+
+/* a predicate on a text record entry */
+typedef struct {
+	char *key;
+	size_t key_len;
+	char *value;	/* NULL to only test for the key */
+	size_t value_len;
+	int absent;	/* the key must not be there */
+} dnssd_filter_text_t;
+
+struct dnssd_filter {
+	int only;
+	char *name;
+	char *prefix;
+	size_t prefix_len;
+	uint32_t *interfaces;
+	long interface_count;
+	dnssd_filter_text_t *text;
+	long text_count;
+};
+
+static char *
+dnssd_filter_strdup(const char *str, size_t len)
+{
+	char *copy = (char *)malloc(len + 1);
+	if (copy) {
+		memcpy(copy, str, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
+static int
+dnssd_filter_text_i(VALUE key, VALUE value, VALUE pairs)
+{
+	key = rb_obj_as_string(key);
+	if (RSTRING_LEN(key) == 0 || RSTRING_LEN(key) > 255 ||
+			memchr(RSTRING_PTR(key), '=', RSTRING_LEN(key)))
+		rb_raise(rb_eArgError, "bad text record key %s", RSTRING_PTR(rb_inspect(key)));
+	if (RTEST(value) && value != Qtrue) StringValue(value);
+	rb_ary_push(pairs, rb_assoc_new(key, value));
+	return ST_CONTINUE;
+}
+
+void
+dnssd_filter_free(dnssd_filter_t *filter)
+{
+	long i;
+	if (filter == NULL) return;
+	free(filter->name);
+	free(filter->prefix);
+	free(filter->interfaces);
+	for (i=0; i<filter->text_count; i++) {
+		free(filter->text[i].key);
+		free(filter->text[i].value);
+	}
+	free(filter->text);
+	free(filter);
+}
+
+int
+dnssd_filter_given(VALUE options)
+{
+	return !NIL_P(dnssd_option(options, "name")) ||
+				 !NIL_P(dnssd_option(options, "prefix")) ||
+				 !NIL_P(dnssd_option(options, "interfaces")) ||
+				 !NIL_P(dnssd_option(options, "only")) ||
+				 !NIL_P(dnssd_option(options, "text"));
+}
+
+dnssd_filter_t *
+dnssd_filter_new(VALUE options)
+{
+	VALUE name, prefix, interfaces, only, text;
+	volatile VALUE pairs = Qnil;
+	dnssd_filter_t *filter;
+	int only_flags = 0;
+	long i;
+
+	if (!dnssd_filter_given(options)) return NULL;
+	name = dnssd_option(options, "name");
+	prefix = dnssd_option(options, "prefix");
+	interfaces = dnssd_option(options, "interfaces");
+	only = dnssd_option(options, "only");
+	text = dnssd_option(options, "text");
+
+	/* everything that may raise comes before the first malloc() */
+	if (!NIL_P(name)) StringValueCStr(name);
+	if (!NIL_P(prefix)) StringValueCStr(prefix);
+	if (!NIL_P(interfaces)) {
+		VALUE list = rb_Array(interfaces);
+		interfaces = rb_ary_new2(RARRAY_LEN(list));
+		for (i=0; i<RARRAY_LEN(list); i++)
+			rb_ary_push(interfaces, ULONG2NUM(dnssd_get_interface_index(RARRAY_PTR(list)[i])));
+	}
+	if (!NIL_P(only)) {
+		ID id = rb_to_id(only);
+		if (id == rb_intern("add")) {
+			only_flags = DNSSD_FILTER_ADD;
+		} else if (id == rb_intern("remove")) {
+			only_flags = DNSSD_FILTER_REMOVE;
+		} else {
+			rb_raise(rb_eArgError, ":only must be :add or :remove");
+		}
+	}
+	if (!NIL_P(text)) {
+		pairs = rb_ary_new();
+		rb_hash_foreach(rb_convert_type(text, T_HASH, "Hash", "to_hash"),
+										dnssd_filter_text_i, pairs);
+	}
+
+	filter = (dnssd_filter_t *)calloc(1, sizeof(dnssd_filter_t));
+	if (filter == NULL) rb_memerror();
+	filter->only = only_flags;
+	if (!NIL_P(name) &&
+			!(filter->name = dnssd_filter_strdup(RSTRING_PTR(name), RSTRING_LEN(name))))
+		goto nomem;
+	if (!NIL_P(prefix)) {
+		filter->prefix_len = RSTRING_LEN(prefix);
+		if (!(filter->prefix = dnssd_filter_strdup(RSTRING_PTR(prefix), RSTRING_LEN(prefix))))
+			goto nomem;
+	}
+	if (!NIL_P(interfaces)) {
+		filter->interfaces = (uint32_t *)malloc((RARRAY_LEN(interfaces) + 1) * sizeof(uint32_t));
+		if (filter->interfaces == NULL) goto nomem;
+		filter->interface_count = RARRAY_LEN(interfaces);
+		for (i=0; i<filter->interface_count; i++)
+			filter->interfaces[i] = (uint32_t)NUM2ULONG(RARRAY_PTR(interfaces)[i]);
+	}
+	if (!NIL_P(pairs)) {
+		filter->text = (dnssd_filter_text_t *)calloc(RARRAY_LEN(pairs) + 1,
+																								 sizeof(dnssd_filter_text_t));
+		if (filter->text == NULL) goto nomem;
+		for (i=0; i<RARRAY_LEN(pairs); i++) {
+			dnssd_filter_text_t *pred = &filter->text[filter->text_count++];
+			VALUE key = RARRAY_PTR(RARRAY_PTR(pairs)[i])[0];
+			VALUE value = RARRAY_PTR(RARRAY_PTR(pairs)[i])[1];
+			pred->key_len = RSTRING_LEN(key);
+			if (!(pred->key = dnssd_filter_strdup(RSTRING_PTR(key), RSTRING_LEN(key))))
+				goto nomem;
+			pred->absent = !RTEST(value);
+			if (RTEST(value) && value != Qtrue) {
+				pred->value_len = RSTRING_LEN(value);
+				if (!(pred->value = dnssd_filter_strdup(RSTRING_PTR(value), RSTRING_LEN(value))))
+					goto nomem;
+			}
+		}
+	}
+	return filter;
+
+nomem:
+	dnssd_filter_free(filter);
+	rb_memerror();
+	return NULL; /* not reached */
+}
+
+/* true if the text record _txt_rec_ satisfies _pred_ */
+static int
+dnssd_filter_text(const dnssd_filter_text_t *pred, uint16_t txt_len, const char *txt_rec)
+{
+	const unsigned char *p = (const unsigned char *)txt_rec;
+	const unsigned char *end = p + txt_len;
+
+	while (p < end) {
+		size_t len = *p++;
+		const char *entry = (const char *)p, *eq;
+		size_t key_len;
+		if (len > (size_t)(end - p)) break; /* malformed */
+		p += len;
+		eq = memchr(entry, '=', len);
+		key_len = eq ? (size_t)(eq - entry) : len;
+		if (key_len != pred->key_len || strncasecmp(entry, pred->key, key_len) != 0)
+			continue;
+		/* only the first entry with a key counts */
+		if (pred->absent) return 0;
+		if (pred->value == NULL) return 1;
+		return eq && len - key_len - 1 == pred->value_len &&
+					 memcmp(eq + 1, pred->value, pred->value_len) == 0;
+	}
+	return pred->absent;
+}
+
+int
+dnssd_filter_match(const dnssd_filter_t *filter, int type, DNSServiceFlags flags,
+									 uint32_t interface, const char *name,
+									 uint16_t txt_len, const char *txt_rec)
+{
+	long i;
+
+	if (filter->interface_count > 0) {
+		for (i=0; i<filter->interface_count; i++) {
+			if (filter->interfaces[i] == interface) break;
+		}
+		if (i == filter->interface_count) return 0;
+	}
+	if (filter->only && (type == DNSSD_REPLY_BROWSE || type == DNSSD_REPLY_RECORD)) {
+		int add = (flags & kDNSServiceFlagsAdd) != 0;
+		if (add != (filter->only == DNSSD_FILTER_ADD)) return 0;
+	}
+	if (type == DNSSD_REPLY_BROWSE) {
+		if (filter->prefix && strncasecmp(name, filter->prefix, filter->prefix_len) != 0)
+			return 0;
+#ifdef FNM_CASEFOLD
+		if (filter->name && fnmatch(filter->name, name, FNM_CASEFOLD) != 0)
+			return 0;
+#else
+		if (filter->name && fnmatch(filter->name, name, 0) != 0)
+			return 0;
+#endif
+	}
+	if (type == DNSSD_REPLY_RESOLVE) {
+		for (i=0; i<filter->text_count; i++) {
+			if (!dnssd_filter_text(&filter->text[i], txt_len, txt_rec)) return 0;
+		}
+	}
+	return 1;
+}
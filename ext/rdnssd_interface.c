@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2004 Chad Fowler, Charles Mills, Rich Kilmer
+ * Licenced under the same terms as Ruby.
+ * This software has absolutely no warranty.
+ */
+
+#include "rdnssd.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* for if_nameindex() */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+/*
+ * Every reply carries the index of the interface it was received on,
+ * and if_indextoname()/if_nametoindex() cost a socket and an ioctl
+ * each.  Instead the interfaces are read once into the table below and
+ * looked up there.
+ *
+ * On Linux the table is kept up to date by a netlink socket subscribed
+ * to link changes.  The event loop watches the socket (see
+ * rdnssd_loop.c), otherwise it is read, without blocking, by the next
+ * lookup.  Elsewhere an index or name that is not in the table makes
+ * the table be read again.
+ *
+ * The table is the main Ractor's, other Ractors ask the kernel.
+ */
+
+#ifdef HAVE_IF_NAMEINDEX
+typedef struct {
+	uint32_t index;
+	VALUE name;	/* frozen String */
+} dnssd_interface_t;
+
+static dnssd_interface_t *dnssd_interfaces = NULL;
+static long dnssd_interface_count = 0;
+#endif
+/* keeps the names of dnssd_interfaces from being collected */
+static VALUE dnssd_interface_names = Qnil;
+/* set when the table needs to be read again */
+static volatile int dnssd_interface_stale = 1;
+
+/* the netlink socket, -1 if not available */
+static int dnssd_interface_fd = -1;
+/* set once the event loop reads dnssd_interface_fd */
+static int dnssd_interface_watched = 0;
+
+#ifdef HAVE_IF_NAMEINDEX
+static void
+dnssd_interface_refresh(void)
+{
+	struct if_nameindex *list;
+	dnssd_interface_t *table;
+	VALUE names;
+	long i, count = 0;
+
+	/* before reading, so that a change seen meanwhile is not lost */
+	dnssd_interface_stale = 0;
+	list = if_nameindex();
+
+	if (list == NULL) return; /* keep the old table */
+	while (list[count].if_index != 0) count++;
+
+	names = rb_ary_new2(count);
+	table = (dnssd_interface_t *)malloc((count ? count : 1) * sizeof(dnssd_interface_t));
+	if (table == NULL) {
+		if_freenameindex(list);
+		rb_memerror();
+	}
+	for (i=0; i<count; i++) {
+		table[i].index = list[i].if_index;
+		table[i].name = rb_obj_freeze(rb_str_new2(list[i].if_name));
+		rb_ary_push(names, table[i].name);
+	}
+	if_freenameindex(list);
+
+	free(dnssd_interfaces);
+	dnssd_interfaces = table;
+	dnssd_interface_count = count;
+	dnssd_interface_names = names;
+}
+
+#endif /* HAVE_IF_NAMEINDEX */
+
+void
+dnssd_interface_drain(void)
+{
+#ifdef HAVE_LINUX_RTNETLINK_H
+	char buf[4096];
+	ssize_t n;
+	while ((n = recv(dnssd_interface_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0 ||
+				 (n < 0 && errno == EINTR)) {
+		dnssd_interface_stale = 1;
+	}
+	/* ENOBUFS: messages were lost, assume the worst */
+	if (n < 0 && errno == ENOBUFS) dnssd_interface_stale = 1;
+#endif
+}
+
+int
+dnssd_interface_watch(void)
+{
+	if (dnssd_interface_fd >= 0) dnssd_interface_watched = 1;
+	return dnssd_interface_fd;
+}
+
+#ifdef HAVE_IF_NAMEINDEX
+/* brings the table up to date, _miss_ if a lookup did not find its key */
+static void
+dnssd_interface_check(int miss)
+{
+	if (dnssd_interface_fd >= 0) {
+		if (!dnssd_interface_watched) dnssd_interface_drain();
+	} else if (miss) {
+		/* no notifications, the interface may be new */
+		dnssd_interface_stale = 1;
+	}
+	if (dnssd_interface_stale) dnssd_interface_refresh();
+}
+#endif
+
+VALUE
+dnssd_interface_name(uint32_t index)
+{
+	char buffer[IF_NAMESIZE];
+#ifdef HAVE_IF_NAMEINDEX
+	int attempt;
+	long i;
+	/* 0 is any interface, ~0 kDNSServiceInterfaceIndexLocalOnly */
+	if (index == 0 || index == (uint32_t)~0) return ULONG2NUM(index);
+	if (dnssd_loop_is_main()) {
+		for (attempt=0; attempt<2; attempt++) {
+			dnssd_interface_check(attempt);
+			for (i=0; i<dnssd_interface_count; i++) {
+				if (dnssd_interfaces[i].index == index)
+					return dnssd_interfaces[i].name;
+			}
+		}
+		return ULONG2NUM(index);
+	}
+#endif
+	if (if_indextoname(index, buffer)) {
+		return rb_obj_freeze(rb_str_new2(buffer));
+	} else {
+		return ULONG2NUM(index);
+	}
+}
+
+uint32_t
+dnssd_interface_index(const char *name)
+{
+#ifdef HAVE_IF_NAMEINDEX
+	int attempt;
+	long i;
+	if (!dnssd_loop_is_main()) return if_nametoindex(name);
+	for (attempt=0; attempt<2; attempt++) {
+		dnssd_interface_check(attempt);
+		for (i=0; i<dnssd_interface_count; i++) {
+			if (strcmp(RSTRING_PTR(dnssd_interfaces[i].name), name) == 0)
+				return dnssd_interfaces[i].index;
+		}
+	}
+	return 0;
+#else
+	return if_nametoindex(name);
+#endif
+}
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+static void
+dnssd_interface_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0) return;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	dnssd_interface_fd = fd;
+}
+#endif
+
+void
+Init_DNSSD_Interfaces(void)
+{
+	rb_global_variable(&dnssd_interface_names);
+#if defined(HAVE_IF_NAMEINDEX) && defined(HAVE_LINUX_RTNETLINK_H)
+	/* without if_nameindex() there is no table to keep up to date */
+	dnssd_interface_open();
+#endif
+}
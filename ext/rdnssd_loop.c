@@ -0,0 +1,1006 @@
+/*
+ * Copyright (c) 2004 Chad Fowler, Charles Mills, Rich Kilmer
+ * Licenced under the same terms as Ruby.
+ * This software has absolutely no warranty.
+ */
+
+#include "rdnssd.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+/*
+ * Replies are read in two steps.  First DNSServiceProcessResult() is
+ * called for every readable service, its callbacks copy the replies
+ * into dnssd_reply_t structs queued below; this needs no ruby objects
+ * so (where rb_thread_call_without_gvl() is available) it runs together
+ * with waiting for the sockets without holding the GVL.  Then the queued
+ * replies are turned into ruby objects and passed to the blocks.
+ *
+ * A loop's mutex (see dnssd_loop_lock()) protects its queue and every
+ * DNSServiceRef of its services that the first step may be using.
+ *
+ * The replies of a service started with the :buffer option skip the
+ * second step: they stay in the service's dnssd_ring_t until a thread
+ * calls DNSSD::Service#take, so a slow consumer never holds up reading.
+ *
+ * Each Ractor has a loop of its own (a dnssd_loop_t, with its own queue,
+ * epoll set and thread) which runs the services started in it, so their
+ * blocks are called in that Ractor.  Loops only wait for each other on
+ * the table of sockets below.
+ */
+
+/* the loop of the Ractor that loaded the extension */
+static dnssd_loop_t *dnssd_loop_main = NULL;
+#ifdef HAVE_RUBY_RACTOR_H
+static rb_ractor_local_key_t dnssd_loop_key;
+#endif
+
+static ID dnssd_id_stop;
+static ID dnssd_id_raise;
+static ID dnssd_id_abort_on_exception;
+static ID dnssd_id_keys;
+static ID dnssd_id_alive_p;
+
+static void dnssd_loop_close(dnssd_loop_t *loop);
+
+static void
+dnssd_loop_mark(void *ptr)
+{
+	dnssd_loop_t *loop = (dnssd_loop_t *)ptr;
+	rb_gc_mark(loop->thread);
+	rb_gc_mark(loop->services);
+	rb_gc_mark(loop->connection);
+	rb_gc_mark(loop->shares);
+	rb_gc_mark(loop->timers);
+}
+
+#ifdef HAVE_RUBY_RACTOR_H
+/* the Ractor is gone and its services with it */
+static void
+dnssd_loop_free(void *ptr)
+{
+	dnssd_loop_t *loop = (dnssd_loop_t *)ptr;
+	dnssd_loop_close(loop);
+	dnssd_queue_clear(&loop->queue);
+	pthread_mutex_destroy(&loop->mutex);
+	xfree(loop);
+}
+
+static const struct rb_ractor_local_storage_type dnssd_loop_type = {
+	dnssd_loop_mark,
+	dnssd_loop_free
+};
+#endif
+
+dnssd_loop_t *
+dnssd_loop_current(void)
+{
+	dnssd_loop_t *loop;
+#ifdef HAVE_RUBY_RACTOR_H
+	loop = (dnssd_loop_t *)rb_ractor_local_storage_ptr(dnssd_loop_key);
+	if (loop) return loop;
+#else
+	if (dnssd_loop_main) return dnssd_loop_main;
+#endif
+	loop = ALLOC(dnssd_loop_t);
+	pthread_mutex_init(&loop->mutex, NULL);
+	loop->queue.head = NULL;
+	loop->queue.tail = NULL;
+	loop->fd = -1;
+	loop->wakeup[0] = loop->wakeup[1] = -1;
+	loop->thread = Qnil;
+	loop->services = Qnil;
+	loop->connection = Qnil;
+	loop->shares = Qnil;
+	loop->timers = Qnil;
+	loop->deadline = -1;
+	loop->share_default = 0;
+	/* marked from here on */
+#ifdef HAVE_RUBY_RACTOR_H
+	rb_ractor_local_storage_ptr_set(dnssd_loop_key, loop);
+#else
+	dnssd_loop_main = loop;
+	rb_gc_register_address(&loop->thread);
+	rb_gc_register_address(&loop->services);
+	rb_gc_register_address(&loop->connection);
+	rb_gc_register_address(&loop->shares);
+	rb_gc_register_address(&loop->timers);
+#endif
+	loop->services = rb_hash_new();
+	loop->shares = rb_hash_new();
+	loop->timers = rb_hash_new();
+	return loop;
+}
+
+int
+dnssd_loop_is_main(void)
+{
+	return dnssd_loop_current() == dnssd_loop_main;
+}
+
+void
+dnssd_loop_lock(dnssd_loop_t *loop)
+{
+	pthread_mutex_lock(&loop->mutex);
+}
+
+void
+dnssd_loop_unlock(dnssd_loop_t *loop)
+{
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+dnssd_reply_t *
+dnssd_reply_alloc(void *context, int type, size_t len)
+{
+	/* malloc() not ALLOC(), we may not be holding the GVL */
+	dnssd_reply_t *reply = (dnssd_reply_t *)malloc(sizeof(dnssd_reply_t) + len);
+	if (reply == NULL) return NULL;
+	memset(reply, 0, sizeof(dnssd_reply_t));
+	reply->service = (dnssd_service_t *)context;
+	reply->type = type;
+	return reply;
+}
+
+const char *
+dnssd_reply_copy(dnssd_reply_t *reply, const char *src, size_t len)
+{
+	char *dst = reply->data + reply->data_len;
+	memcpy(dst, src, len);
+	reply->data_len += len;
+	return dst;
+}
+
+void
+dnssd_queue_push(dnssd_queue_t *queue, dnssd_reply_t *reply)
+{
+	reply->next = NULL;
+	if (queue->tail) {
+		queue->tail->next = reply;
+	} else {
+		queue->head = reply;
+	}
+	queue->tail = reply;
+}
+
+dnssd_reply_t *
+dnssd_queue_shift(dnssd_queue_t *queue)
+{
+	dnssd_reply_t *reply = queue->head;
+	if (reply) {
+		queue->head = reply->next;
+		if (queue->head == NULL) queue->tail = NULL;
+	}
+	return reply;
+}
+
+void
+dnssd_queue_clear(dnssd_queue_t *queue)
+{
+	dnssd_reply_t *reply;
+	while ((reply = dnssd_queue_shift(queue)))
+		free(reply);
+}
+
+/* stops (or resumes) watching the socket _fd_ of _service_ */
+static void dnssd_loop_pause(dnssd_service_t *service, int fd, int pause);
+
+dnssd_ring_t *
+dnssd_ring_new(long capacity, int overflow)
+{
+	dnssd_ring_t *ring = ALLOC(dnssd_ring_t);
+	ring->replies = (dnssd_reply_t **)malloc(capacity * sizeof(dnssd_reply_t *));
+	if (ring->replies == NULL) {
+		free(ring);
+		rb_memerror();
+	}
+	ring->capacity = capacity;
+	ring->head = 0;
+	ring->count = 0;
+	ring->overflow = overflow;
+	ring->paused = 0;
+	ring->dropped = 0;
+	ring->coalesced = 0;
+	ring->pauses = 0;
+	pthread_cond_init(&ring->ready, NULL);
+	return ring;
+}
+
+void
+dnssd_ring_clear(dnssd_ring_t *ring)
+{
+	while (ring->count > 0) {
+		free(ring->replies[ring->head]);
+		ring->head = (ring->head + 1) % ring->capacity;
+		ring->count--;
+	}
+	pthread_cond_broadcast(&ring->ready);
+}
+
+void
+dnssd_ring_free(dnssd_ring_t *ring)
+{
+	dnssd_ring_clear(ring);
+	pthread_cond_destroy(&ring->ready);
+	free(ring->replies);
+	free(ring);
+}
+
+/* true if _a_ and _b_ are about the same name on the same interface */
+static int
+dnssd_reply_same_name(dnssd_reply_t *a, dnssd_reply_t *b)
+{
+	if (a->type != b->type || a->interface != b->interface) return 0;
+	switch (a->type) {
+	case DNSSD_REPLY_BROWSE:
+		return strcmp(a->name, b->name) == 0 &&
+					 strcmp(a->regtype, b->regtype) == 0 &&
+					 strcmp(a->domain, b->domain) == 0;
+	case DNSSD_REPLY_RESOLVE:
+		return strcmp(a->fullname, b->fullname) == 0;
+	case DNSSD_REPLY_RECORD:
+		return a->rrtype == b->rrtype && strcmp(a->fullname, b->fullname) == 0;
+	}
+	return 0; /* errors are never coalesced */
+}
+
+static void
+dnssd_ring_push(dnssd_ring_t *ring, dnssd_reply_t *reply)
+{
+	long i;
+	if (ring->count == ring->capacity) {
+		if (ring->overflow == DNSSD_OVERFLOW_COALESCE) {
+			/* the newest reply about the name is the one to replace */
+			for (i=ring->count-1; i>=0; i--) {
+				long index = (ring->head + i) % ring->capacity;
+				if (dnssd_reply_same_name(ring->replies[index], reply)) {
+					free(ring->replies[index]);
+					ring->replies[index] = reply;
+					ring->coalesced++;
+					return;
+				}
+			}
+		}
+		/* also when DNSSD_OVERFLOW_BLOCK gets more than one reply per read */
+		free(ring->replies[ring->head]);
+		ring->head = (ring->head + 1) % ring->capacity;
+		ring->count--;
+		ring->dropped++;
+	}
+	ring->replies[(ring->head + ring->count) % ring->capacity] = reply;
+	ring->count++;
+	pthread_cond_broadcast(&ring->ready);
+}
+
+dnssd_reply_t *
+dnssd_ring_shift(dnssd_service_t *service)
+{
+	dnssd_ring_t *ring = service->ring;
+	dnssd_reply_t *reply = NULL;
+
+	dnssd_loop_lock(service->loop);
+	if (ring->count > 0) {
+		reply = ring->replies[ring->head];
+		ring->head = (ring->head + 1) % ring->capacity;
+		ring->count--;
+	}
+	if (ring->paused && !service->stopped) {
+		ring->paused = 0;
+		dnssd_loop_pause(service, DNSServiceRefSockFD(service->client), 0);
+	}
+	dnssd_loop_unlock(service->loop);
+	return reply;
+}
+
+typedef struct {
+	dnssd_service_t *service;
+	double deadline;	/* negative to wait forever */
+	int interrupted;
+} dnssd_ring_wait_t;
+
+static int
+dnssd_ring_ready(dnssd_ring_wait_t *wait)
+{
+	return wait->service->ring->count > 0 || wait->service->stopped ||
+				 (wait->deadline >= 0 && dnssd_now() >= wait->deadline);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void *
+dnssd_ring_wait_i(void *arg)
+{
+	dnssd_ring_wait_t *wait = (dnssd_ring_wait_t *)arg;
+	pthread_cond_t *ready = &wait->service->ring->ready;
+	pthread_mutex_t *mutex = &wait->service->loop->mutex;
+
+	pthread_mutex_lock(mutex);
+	while (!wait->interrupted && !dnssd_ring_ready(wait)) {
+		if (wait->deadline < 0) {
+			pthread_cond_wait(ready, mutex);
+		} else {
+			double timeout = wait->deadline - dnssd_now();
+			struct timeval now;
+			struct timespec until;
+			gettimeofday(&now, NULL);
+			until.tv_sec = now.tv_sec + (time_t)timeout;
+			until.tv_nsec = now.tv_usec * 1000 + (long)((timeout - (time_t)timeout) * 1e9);
+			if (until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(ready, mutex, &until);
+		}
+	}
+	pthread_mutex_unlock(mutex);
+	return NULL;
+}
+
+static void
+dnssd_ring_interrupt(void *arg)
+{
+	dnssd_ring_wait_t *wait = (dnssd_ring_wait_t *)arg;
+	dnssd_loop_lock(wait->service->loop);
+	wait->interrupted = 1;
+	pthread_cond_broadcast(&wait->service->ring->ready);
+	dnssd_loop_unlock(wait->service->loop);
+}
+#endif
+
+void
+dnssd_ring_wait(dnssd_service_t *service, double timeout)
+{
+	dnssd_ring_wait_t wait;
+	wait.service = service;
+	wait.deadline = timeout < 0 ? -1 : dnssd_now() + timeout;
+	wait.interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	/* interrupted by a signal handler or the like, ruby raises if it has to */
+	do {
+		wait.interrupted = 0;
+		rb_thread_call_without_gvl(dnssd_ring_wait_i, &wait, dnssd_ring_interrupt, &wait);
+	} while (wait.interrupted && !dnssd_ring_ready(&wait));
+#else
+	/* the event loop runs with the GVL, look again every 10ms */
+	while (!dnssd_ring_ready(&wait)) {
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		rb_thread_wait_for(tv);
+	}
+#endif
+}
+
+void
+dnssd_loop_enqueue(dnssd_reply_t *reply)
+{
+	if (reply == NULL) return; /* out of memory, the reply is lost */
+	if (reply->service->ring) {
+		dnssd_ring_push(reply->service->ring, reply);
+	} else if (reply->service->queue) {
+		dnssd_queue_push(reply->service->queue, reply);
+	} else {
+		dnssd_queue_push(&reply->service->loop->queue, reply);
+	}
+}
+
+void
+dnssd_loop_purge(dnssd_service_t *service)
+{
+	dnssd_queue_t *queue = &service->loop->queue;
+	dnssd_reply_t **link = &queue->head;
+	queue->tail = NULL;
+	while (*link) {
+		dnssd_reply_t *reply = *link;
+		if (reply->service == service) {
+			*link = reply->next;
+			free(reply);
+		} else {
+			queue->tail = reply;
+			link = &reply->next;
+		}
+	}
+}
+
+/* Reads the pending replies of _service_ if its socket _fd_ is readable,
+ * call with the loop locked.  Does not need the GVL. */
+static void
+dnssd_loop_process(dnssd_service_t *service, int fd)
+{
+	DNSServiceErrorType e;
+	struct pollfd pfd;
+	dnssd_ring_t *ring = service->ring;
+
+	if (ring && ring->overflow == DNSSD_OVERFLOW_BLOCK && ring->count == ring->capacity) {
+		/* the replies wait in the socket until dnssd_ring_shift() makes room */
+		if (!ring->paused) {
+			ring->paused = 1;
+			ring->pauses++;
+			dnssd_loop_pause(service, fd, 1);
+		}
+		return;
+	}
+
+	/* DNSServiceProcessResult() blocks if nothing can be read */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) <= 0) return;
+	DNSSD_PROBE3(socket__readable, service, service->operation, fd);
+
+	DNSSD_PROBE2(process__entry, service, service->operation);
+	e = DNSServiceProcessResult(service->client);
+	DNSSD_PROBE3(process__return, service, service->operation, e);
+	if (e) {
+		/* dispatching the error stops the service */
+		dnssd_reply_t *reply = dnssd_reply_alloc(service, DNSSD_REPLY_ERROR, 0);
+		if (reply) reply->error = e;
+		dnssd_loop_enqueue(reply);
+	}
+}
+
+typedef struct {
+	dnssd_service_t *service;
+	int fd;
+	int timeout; /* milliseconds */
+} dnssd_wait_t;
+
+/* Polls outside the lock, another thread may stop the service (and
+ * deallocate its ref) meanwhile, see dnssd_service_dealloc_client() */
+static void *
+dnssd_service_wait_i(void *arg)
+{
+	dnssd_wait_t *wait = (dnssd_wait_t *)arg;
+	dnssd_service_t *service = wait->service;
+	struct pollfd pfd;
+	pfd.fd = wait->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, wait->timeout) <= 0) return NULL;
+	dnssd_loop_lock(service->loop);
+	if (service->client && !service->stopped)
+		dnssd_loop_process(service, wait->fd);
+	dnssd_loop_unlock(service->loop);
+	return NULL;
+}
+
+void
+dnssd_service_wait(dnssd_service_t *service, double timeout)
+{
+	dnssd_wait_t wait;
+	if (service->client == NULL || service->stopped) return;
+	wait.service = service;
+	wait.fd = DNSServiceRefSockFD(service->client);
+	/* poll() takes an int, and waits forever if it is negative */
+	timeout *= 1000;
+	wait.timeout = timeout < INT_MAX ? (int)timeout : INT_MAX;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	rb_thread_call_without_gvl(dnssd_service_wait_i, &wait, RUBY_UBF_IO, 0);
+#else
+	{
+		/* let other threads run while waiting */
+		struct timeval tv;
+		fd_set readfds;
+		int fd = wait.fd;
+		if (fd >= FD_SETSIZE) rb_raise(rb_eRuntimeError, "descriptor too large for select()");
+		tv.tv_sec = wait.timeout / 1000;
+		tv.tv_usec = (wait.timeout % 1000) * 1000;
+		FD_ZERO(&readfds);
+		FD_SET(fd, &readfds);
+		if (rb_thread_select(fd + 1, &readfds, NULL, NULL, &tv) > 0) {
+			wait.timeout = 0;
+			dnssd_service_wait_i(&wait);
+		}
+	}
+#endif
+}
+
+static VALUE
+dnssd_loop_dispatch_reply(VALUE reply)
+{
+	dnssd_service_dispatch((dnssd_reply_t *)reply);
+	return Qnil;
+}
+
+void
+dnssd_loop_rescue(VALUE service, int state)
+{
+	dnssd_service_t *client;
+	VALUE err;
+
+	GetDNSSDService(service, client);
+	err = rb_errinfo();
+	if (rb_obj_is_kind_of(err, rb_eException) != Qtrue) {
+		/* not an exception (the thread is being killed etc.) */
+		rb_jump_tag(state);
+	}
+	rb_set_errinfo(Qnil);
+	if (!client->stopped)
+		rb_funcall2(service, dnssd_id_stop, 0, 0);
+	if (RTEST(rb_funcall2(rb_cThread, dnssd_id_abort_on_exception, 0, 0)))
+		rb_funcall2(rb_thread_main(), dnssd_id_raise, 1, &err);
+}
+
+typedef struct {
+	VALUE service;
+	double deadline;
+} dnssd_loop_expire_t;
+
+static VALUE
+dnssd_loop_expire_i(VALUE arg)
+{
+	dnssd_loop_expire_t *expire = (dnssd_loop_expire_t *)arg;
+	dnssd_service_t *service;
+	GetDNSSDService(expire->service, service);
+	expire->deadline = dnssd_service_expire(service);
+	return Qnil;
+}
+
+/* Calls dnssd_service_expire() for the services with a deadline once
+ * the earliest has passed, see dnssd_loop_timeout().  An exception
+ * stops the service, as one raised by a block does. */
+static void
+dnssd_loop_expire(dnssd_loop_t *loop)
+{
+	volatile VALUE services;
+	long i;
+
+	if (loop->deadline < 0 || dnssd_now() < loop->deadline) return;
+	loop->deadline = -1;
+	services = rb_funcall2(loop->timers, dnssd_id_keys, 0, 0);
+	for (i=0; i<RARRAY_LEN(services); i++) {
+		dnssd_loop_expire_t expire;
+		int state = 0;
+		expire.service = RARRAY_PTR(services)[i];
+		expire.deadline = -1;
+		rb_protect(dnssd_loop_expire_i, (VALUE)&expire, &state);
+		if (state) dnssd_loop_rescue(expire.service, state);
+		if (expire.deadline < 0) {
+			rb_hash_delete(loop->timers, expire.service);
+		} else if (loop->deadline < 0 || expire.deadline < loop->deadline) {
+			loop->deadline = expire.deadline;
+		}
+	}
+}
+
+/* Passes _reply_ to its service's block, see dnssd_loop_rescue() for
+ * what an exception raised by the block (or an error reply) does. */
+static void
+dnssd_loop_dispatch(dnssd_reply_t *reply)
+{
+	/* on the stack, the block may drop the last reference to the service */
+	volatile VALUE service = reply->service->self;
+	int state = 0;
+
+	rb_protect(dnssd_loop_dispatch_reply, (VALUE)reply, &state);
+	free(reply);
+	if (state) dnssd_loop_rescue(service, state);
+}
+
+/* dispatches the queued replies, one at a time as a block may stop
+ * services and so purge their replies from the queue */
+static void
+dnssd_loop_drain(dnssd_loop_t *loop)
+{
+	while (1) {
+		dnssd_reply_t *reply;
+		dnssd_loop_lock(loop);
+		reply = dnssd_queue_shift(&loop->queue);
+		dnssd_loop_unlock(loop);
+		if (reply == NULL) break;
+		dnssd_loop_dispatch(reply);
+	}
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+/*
+ * All running services of a Ractor share one epoll set and one ruby
+ * thread.  The thread sleeps on the epoll descriptor, so waking up
+ * costs the same whether one or thousands of services are running, and
+ * only the services with pending replies are looked at.
+ */
+
+/* maximum number of ready services handled per wakeup */
+#define DNSSD_LOOP_MAX_EVENTS 64
+
+/* the socket notifying interface changes, watched by the main Ractor's
+ * loop, see rdnssd_interface.c */
+static int dnssd_loop_interfaces = -1;
+/* running services of every loop by socket, so that a service stopped
+ * while epoll_wait() returns its socket is not touched.  An entry is
+ * only cleared with the lock of the service's loop held as well. */
+static dnssd_service_t **dnssd_loop_table = NULL;
+static int dnssd_loop_table_size = 0;
+static pthread_mutex_t dnssd_loop_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+	dnssd_loop_t *loop;
+	int timeout; /* milliseconds, -1 forever */
+} dnssd_loop_wait_t;
+
+/* Waits at most _timeout_ milliseconds for replies to the services of
+ * _loop_, and reads them. Does not need the GVL. */
+static void *
+dnssd_loop_wait(void *arg)
+{
+	dnssd_loop_wait_t *wait = (dnssd_loop_wait_t *)arg;
+	struct epoll_event events[DNSSD_LOOP_MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(wait->loop->fd, events, DNSSD_LOOP_MAX_EVENTS, wait->timeout);
+	if (n <= 0) return NULL; /* EINTR, ruby checks for interrupts */
+
+	dnssd_loop_lock(wait->loop);
+	for (i=0; i<n; i++) {
+		int fd = events[i].data.fd;
+		dnssd_service_t *service = NULL;
+		if (fd == wait->loop->wakeup[0]) {
+			char buf[64];
+			while (read(fd, buf, sizeof(buf)) > 0);
+			continue;
+		} else if (fd == dnssd_loop_interfaces) {
+			dnssd_interface_drain();
+			continue;
+		}
+		pthread_mutex_lock(&dnssd_loop_table_mutex);
+		if (fd < dnssd_loop_table_size) service = dnssd_loop_table[fd];
+		pthread_mutex_unlock(&dnssd_loop_table_mutex);
+		/* the socket may have been reused by another loop's service since,
+		 * one of this loop's stays while the loop is locked */
+		if (service && service->loop == wait->loop)
+			dnssd_loop_process(service, fd);
+	}
+	dnssd_loop_unlock(wait->loop);
+	return NULL;
+}
+
+static void
+dnssd_loop_interrupt(void *arg)
+{
+	dnssd_loop_t *loop = (dnssd_loop_t *)arg;
+	/* if the pipe is full the loop is waking up anyway */
+	if (write(loop->wakeup[1], "", 1) < 0) return;
+}
+
+void
+dnssd_loop_post(dnssd_reply_t *reply)
+{
+	dnssd_loop_t *loop;
+	if (reply == NULL) return;
+	loop = reply->service->loop;
+	dnssd_loop_lock(loop);
+	dnssd_queue_push(&loop->queue, reply);
+	dnssd_loop_unlock(loop);
+	if (loop->fd >= 0) dnssd_loop_interrupt(loop);
+}
+
+void
+dnssd_loop_timeout(dnssd_service_t *service, double deadline)
+{
+	dnssd_loop_t *loop = service->loop;
+	rb_hash_aset(loop->timers, service->self, Qtrue);
+	if (loop->deadline >= 0 && loop->deadline <= deadline) return;
+	loop->deadline = deadline;
+	/* the loop's thread looks at the deadline before it waits again */
+	if (loop->fd >= 0 && loop->thread != rb_thread_current())
+		dnssd_loop_interrupt(loop);
+}
+
+/* milliseconds until the loop's deadline, -1 if it has none */
+static int
+dnssd_loop_timeout_ms(dnssd_loop_t *loop)
+{
+	double ms;
+	if (loop->deadline < 0) return -1;
+	ms = (loop->deadline - dnssd_now()) * 1000;
+	if (ms <= 0) return 0;
+	/* rounded up, woken up early the loop would only wait again */
+	return ms < INT_MAX ? (int)ms + 1 : INT_MAX;
+}
+
+static VALUE
+dnssd_loop_run(void *arg)
+{
+	dnssd_loop_wait_t wait;
+	wait.loop = (dnssd_loop_t *)arg;
+	while (1) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+		wait.timeout = dnssd_loop_timeout_ms(wait.loop);
+		rb_thread_call_without_gvl(dnssd_loop_wait, &wait, dnssd_loop_interrupt, wait.loop);
+#else
+		int timeout = dnssd_loop_timeout_ms(wait.loop);
+		if (timeout < 0) {
+			rb_thread_wait_fd(wait.loop->fd);
+		} else {
+			/* rb_thread_wait_fd() has no timeout */
+			struct timeval tv;
+			fd_set readfds;
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
+			FD_ZERO(&readfds);
+			FD_SET(wait.loop->fd, &readfds);
+			rb_thread_select(wait.loop->fd + 1, &readfds, NULL, NULL, &tv);
+		}
+		wait.timeout = 0;
+		dnssd_loop_wait(&wait);
+#endif
+		dnssd_loop_drain(wait.loop);
+		dnssd_loop_expire(wait.loop);
+	}
+	return Qnil;
+}
+
+static void
+dnssd_loop_init(dnssd_loop_t *loop)
+{
+	struct epoll_event event;
+	int saved_errno;
+	/* loop->fd is only set once everything is, the next
+	 * dnssd_loop_add() tries again if this fails */
+	int fd = epoll_create(DNSSD_LOOP_MAX_EVENTS);
+
+	if (fd < 0) rb_sys_fail("epoll_create");
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if (pipe(loop->wakeup) < 0) {
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		rb_sys_fail("pipe");
+	}
+	fcntl(loop->wakeup[0], F_SETFD, FD_CLOEXEC);
+	fcntl(loop->wakeup[1], F_SETFD, FD_CLOEXEC);
+	fcntl(loop->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(loop->wakeup[1], F_SETFL, O_NONBLOCK);
+
+	event.events = EPOLLIN;
+	event.data.fd = loop->wakeup[0];
+	if (epoll_ctl(fd, EPOLL_CTL_ADD, loop->wakeup[0], &event) < 0) {
+		saved_errno = errno;
+		close(fd);
+		close(loop->wakeup[0]);
+		close(loop->wakeup[1]);
+		loop->wakeup[0] = loop->wakeup[1] = -1;
+		errno = saved_errno;
+		rb_sys_fail("epoll_ctl");
+	}
+	loop->fd = fd;
+
+	/* only the main Ractor keeps the interface table */
+	if (loop != dnssd_loop_main) return;
+	event.data.fd = dnssd_interface_watch();
+	if (event.data.fd >= 0 &&
+			epoll_ctl(loop->fd, EPOLL_CTL_ADD, event.data.fd, &event) == 0)
+		dnssd_loop_interfaces = event.data.fd;
+}
+
+static void
+dnssd_loop_close(dnssd_loop_t *loop)
+{
+	if (loop->fd < 0) return;
+	close(loop->fd);
+	close(loop->wakeup[0]);
+	close(loop->wakeup[1]);
+	loop->fd = loop->wakeup[0] = loop->wakeup[1] = -1;
+}
+
+void
+dnssd_loop_add(dnssd_service_t *service)
+{
+	struct epoll_event event;
+	dnssd_loop_t *loop = service->loop;
+	int fd = DNSServiceRefSockFD(service->client);
+
+	if (loop->fd < 0) dnssd_loop_init(loop);
+
+	pthread_mutex_lock(&dnssd_loop_table_mutex);
+	if (fd >= dnssd_loop_table_size) {
+		int size = dnssd_loop_table_size ? dnssd_loop_table_size : 64;
+		dnssd_service_t **table;
+		while (size <= fd) size *= 2;
+		table = (dnssd_service_t **)realloc(dnssd_loop_table, size * sizeof(dnssd_service_t *));
+		if (table == NULL) {
+			pthread_mutex_unlock(&dnssd_loop_table_mutex);
+			rb_memerror();
+		}
+		memset(table + dnssd_loop_table_size, 0,
+					 (size - dnssd_loop_table_size) * sizeof(dnssd_service_t *));
+		dnssd_loop_table = table;
+		dnssd_loop_table_size = size;
+	}
+	dnssd_loop_table[fd] = service;
+	pthread_mutex_unlock(&dnssd_loop_table_mutex);
+
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		dnssd_loop_lock(loop);
+		pthread_mutex_lock(&dnssd_loop_table_mutex);
+		dnssd_loop_table[fd] = NULL;
+		pthread_mutex_unlock(&dnssd_loop_table_mutex);
+		dnssd_loop_unlock(loop);
+		rb_sys_fail("epoll_ctl");
+	}
+	rb_hash_aset(loop->services, service->self, Qtrue);
+
+	if (NIL_P(loop->thread) ||
+			!RTEST(rb_funcall2(loop->thread, dnssd_id_alive_p, 0, 0))) {
+		loop->thread = rb_thread_create(dnssd_loop_run, loop);
+	}
+}
+
+static void
+dnssd_loop_pause(dnssd_service_t *service, int fd, int pause)
+{
+	struct epoll_event event;
+	event.events = pause ? 0 : EPOLLIN;
+	event.data.fd = fd;
+	epoll_ctl(service->loop->fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void
+dnssd_loop_remove(dnssd_service_t *service)
+{
+	/* event is ignored, but must not be NULL on kernels before 2.6.9 */
+	struct epoll_event event;
+	int fd = DNSServiceRefSockFD(service->client);
+
+	dnssd_loop_lock(service->loop);
+	epoll_ctl(service->loop->fd, EPOLL_CTL_DEL, fd, &event);
+	pthread_mutex_lock(&dnssd_loop_table_mutex);
+	dnssd_loop_table[fd] = NULL;
+	pthread_mutex_unlock(&dnssd_loop_table_mutex);
+	dnssd_loop_unlock(service->loop);
+	rb_hash_delete(service->loop->services, service->self);
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+/* without epoll each service gets its own thread */
+static ID dnssd_iv_thread;
+static ID dnssd_iv_service;
+
+static VALUE
+dnssd_loop_drain_thread(void *arg)
+{
+	dnssd_loop_drain((dnssd_loop_t *)arg);
+	return Qnil;
+}
+
+void
+dnssd_loop_post(dnssd_reply_t *reply)
+{
+	dnssd_loop_t *loop;
+	if (reply == NULL) return;
+	loop = reply->service->loop;
+	dnssd_loop_lock(loop);
+	dnssd_queue_push(&loop->queue, reply);
+	dnssd_loop_unlock(loop);
+	/* the service threads only look at the queue after reading */
+	rb_thread_create(dnssd_loop_drain_thread, loop);
+}
+
+static VALUE
+dnssd_loop_run(void *arg)
+{
+	dnssd_service_t *service;
+	GetDNSSDService((VALUE)arg, service);
+
+	while (!service->stopped) {
+		int fd = DNSServiceRefSockFD(service->client);
+		if (service->ring && service->ring->paused) {
+			/* see dnssd_loop_pause(), look again every 10ms */
+			struct timeval tv;
+			tv.tv_sec = 0;
+			tv.tv_usec = 10000;
+			rb_thread_wait_for(tv);
+			continue;
+		}
+		rb_thread_wait_fd(fd);
+		dnssd_loop_lock(service->loop);
+		if (!service->stopped) dnssd_loop_process(service, fd);
+		dnssd_loop_unlock(service->loop);
+		dnssd_loop_drain(service->loop);
+	}
+	return Qnil;
+}
+
+/* the loop's thread only keeps the time, an earlier deadline set while
+ * it sleeps is seen at the next look, every DNSSD_LOOP_TIMER_STEP */
+#define DNSSD_LOOP_TIMER_STEP 0.1
+
+static VALUE
+dnssd_loop_timer(void *arg)
+{
+	dnssd_loop_t *loop = (dnssd_loop_t *)arg;
+	while (loop->deadline >= 0) {
+		double wait = loop->deadline - dnssd_now();
+		if (wait > 0) {
+			struct timeval tv;
+			if (wait > DNSSD_LOOP_TIMER_STEP) wait = DNSSD_LOOP_TIMER_STEP;
+			tv.tv_sec = 0;
+			tv.tv_usec = (long)(wait * 1e6);
+			rb_thread_wait_for(tv);
+			continue;
+		}
+		dnssd_loop_expire(loop);
+	}
+	return Qnil;
+}
+
+void
+dnssd_loop_timeout(dnssd_service_t *service, double deadline)
+{
+	dnssd_loop_t *loop = service->loop;
+	rb_hash_aset(loop->timers, service->self, Qtrue);
+	if (loop->deadline >= 0 && loop->deadline <= deadline) return;
+	loop->deadline = deadline;
+	if (NIL_P(loop->thread) ||
+			!RTEST(rb_funcall2(loop->thread, dnssd_id_alive_p, 0, 0))) {
+		loop->thread = rb_thread_create(dnssd_loop_timer, loop);
+	}
+}
+
+void
+dnssd_loop_add(dnssd_service_t *service)
+{
+	VALUE thread = rb_thread_create(dnssd_loop_run, (void *)service->self);
+	rb_ivar_set(service->self, dnssd_iv_thread, thread);
+	/* !! IMPORTANT: prevents premature garbage collection of the service,
+	 * this way the thread holds a reference to the service and
+	 * the service gets marked as long as the thread is running.
+	 * Running threads are always marked by Ruby. !! */
+	rb_ivar_set(thread, dnssd_iv_service, service->self);
+}
+
+static void
+dnssd_loop_pause(dnssd_service_t *service, int fd, int pause)
+{
+	/* dnssd_loop_run() checks the ring */
+}
+
+void
+dnssd_loop_remove(dnssd_service_t *service)
+{
+	VALUE thread = rb_ivar_get(service->self, dnssd_iv_thread);
+	rb_ivar_set(service->self, dnssd_iv_thread, Qnil);
+	/* a thread stopping its own service exits once the block returns */
+	if (thread != rb_thread_current())
+		rb_thread_kill(thread);
+}
+
+static void
+dnssd_loop_close(dnssd_loop_t *loop)
+{
+	/* the service threads ended with the Ractor */
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+void
+Init_DNSSD_Loop(void)
+{
+	dnssd_id_stop = rb_intern("stop");
+	dnssd_id_raise = rb_intern("raise");
+	dnssd_id_abort_on_exception = rb_intern("abort_on_exception");
+	dnssd_id_keys = rb_intern("keys");
+	dnssd_id_alive_p = rb_intern("alive?");
+#ifndef HAVE_SYS_EPOLL_H
+	dnssd_iv_thread = rb_intern("@thread");
+	dnssd_iv_service = rb_intern("@service");
+#endif
+#ifdef HAVE_RUBY_RACTOR_H
+	dnssd_loop_key = rb_ractor_local_storage_ptr_newkey(&dnssd_loop_type);
+#endif
+	dnssd_loop_main = dnssd_loop_current();
+}
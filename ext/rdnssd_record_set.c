@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2004 Chad Fowler, Charles Mills, Rich Kilmer
+ * Licensed under the same terms as Ruby.
+ * This software has absolutely no warranty.
+ */
+
+#include "rdnssd.h"
+
+#ifndef DNSSD_API
+	/* define as nothing if not defined in "dns_sd.h" header  */
+	#define DNSSD_API
+#endif
+
+static VALUE cDNSSDRecordSet;
+static VALUE cDNSSDRecord;
+
+static ID dnssd_id_call;
+static ID dnssd_iv_block;
+static ID dnssd_iv_records;
+static ID dnssd_iv_set;
+static ID dnssd_iv_fullname;
+static ID dnssd_iv_rrtype;
+static ID dnssd_iv_rrclass;
+static ID dnssd_iv_rdata;
+static ID dnssd_iv_ttl;
+static ID dnssd_iv_interface;
+static ID dnssd_iv_error;
+
+/* native state of a DNSSD::Record */
+typedef struct {
+	DNSRecordRef ref;	/* NULL unless the record is in its set */
+	int registered;		/* the daemon confirmed the registration */
+} dnssd_record_t;
+
+#define GetDNSSDRecord(obj, var) Data_Get_Struct(obj, dnssd_record_t, var)
+
+/* a record to be added, see dnssd_record_spec() */
+typedef struct {
+	VALUE record;
+	const char *fullname;
+	uint16_t rrtype;
+	uint16_t rrclass;
+	uint16_t rdlen;
+	const char *rdata;
+	uint32_t ttl;
+	DNSServiceFlags flags;
+	uint32_t interface_index;
+} dnssd_record_spec_t;
+
+/* @records is keyed by the DNSRecordRef the daemon's replies carry */
+static VALUE
+dnssd_record_key(DNSRecordRef ref)
+{
+	return ULONG2NUM((unsigned long)ref);
+}
+
+static dnssd_service_t *
+dnssd_record_set_get(VALUE self)
+{
+	dnssd_service_t *set;
+	GetDNSSDService(self, set);
+	if (set->stopped) rb_raise(rb_eRuntimeError, "record set is stopped");
+	return set;
+}
+
+/* the state of _record_, which must be in _self_ */
+static dnssd_record_t *
+dnssd_record_get(VALUE self, VALUE record)
+{
+	dnssd_record_t *rec;
+	if (rb_obj_is_kind_of(record, cDNSSDRecord) != Qtrue)
+		rb_raise(rb_eTypeError, "need a DNSSD::Record");
+	GetDNSSDRecord(record, rec);
+	if (rec->ref == NULL || rb_ivar_get(record, dnssd_iv_set) != self)
+		rb_raise(rb_eArgError, "record is not in this record set");
+	return rec;
+}
+
+static void
+dnssd_record_free(void *ptr)
+{
+	free(ptr);
+}
+
+static VALUE
+dnssd_record_alloc(VALUE set)
+{
+	dnssd_record_t *rec = ALLOC(dnssd_record_t);
+	VALUE record;
+	rec->ref = NULL;
+	rec->registered = 0;
+	record = Data_Wrap_Struct(cDNSSDRecord, 0, dnssd_record_free, rec);
+	rb_ivar_set(record, dnssd_iv_set, set);
+	rb_ivar_set(record, dnssd_iv_error, Qnil);
+	return record;
+}
+
+static const char *
+dnssd_get_rdata(VALUE rdata, uint16_t *rdlen)
+{
+	StringValue(rdata);
+	if (RSTRING_LEN(rdata) > 0xffff)
+		rb_raise(rb_eArgError, "rdata too large");
+	*rdlen = (uint16_t)RSTRING_LEN(rdata);
+	return RSTRING_PTR(rdata);
+}
+
+/* Converts the arguments of DNSSD::RecordSet#add into _spec_ and the
+ * DNSSD::Record it will register.  Only ruby objects referenced by the
+ * record are pointed to. */
+static void
+dnssd_record_spec(VALUE self, dnssd_record_spec_t *spec, int argc, VALUE *argv)
+{
+	VALUE fullname, rrtype, rdata, tmp_ttl, tmp_flags, interface;
+	VALUE record;
+
+	rb_scan_args(argc, argv, "33", &fullname, &rrtype, &rdata,
+							 &tmp_ttl, &tmp_flags, &interface);
+
+	MEMZERO(spec, dnssd_record_spec_t, 1);
+	spec->fullname = StringValueCStr(fullname);
+	spec->rrtype = dnssd_to_rrtype(rrtype);
+	spec->rrclass = DNSSD_RR_CLASS_IN;
+	rdata = rb_obj_freeze(rb_str_new4(StringValue(rdata)));
+	spec->rdata = dnssd_get_rdata(rdata, &spec->rdlen);
+	/* 0 lets the daemon pick its default */
+	if (tmp_ttl != Qnil)
+		spec->ttl = (uint32_t)NUM2ULONG(tmp_ttl);
+	spec->flags = kDNSServiceFlagsUnique;
+	if (tmp_flags != Qnil) {
+		spec->flags = dnssd_to_flags(tmp_flags);
+		if (!(spec->flags & (kDNSServiceFlagsShared | kDNSServiceFlagsUnique)))
+			rb_raise(rb_eArgError, "need DNSSD::Flags::Shared or DNSSD::Flags::Unique");
+	}
+	if (interface != Qnil)
+		spec->interface_index = dnssd_get_interface_index(interface);
+
+	spec->record = record = dnssd_record_alloc(self);
+	rb_ivar_set(record, dnssd_iv_fullname, fullname);
+	rb_ivar_set(record, dnssd_iv_rrtype, UINT2NUM(spec->rrtype));
+	rb_ivar_set(record, dnssd_iv_rrclass, UINT2NUM(spec->rrclass));
+	rb_ivar_set(record, dnssd_iv_rdata, rdata);
+	rb_ivar_set(record, dnssd_iv_ttl, ULONG2NUM(spec->ttl));
+	rb_ivar_set(record, dnssd_iv_interface, interface);
+}
+
+static void DNSSD_API
+dnssd_register_record_reply (DNSServiceRef client, DNSRecordRef record_ref,
+														 DNSServiceFlags flags, DNSServiceErrorType errorCode,
+														 void *context)
+{
+	dnssd_reply_t *reply = dnssd_reply_alloc(context, DNSSD_REPLY_REGISTER_RECORD, 0);
+	if (reply) {
+		reply->flags = flags;
+		reply->error = errorCode;
+		reply->record = record_ref;
+	}
+	dnssd_loop_enqueue(reply);
+}
+
+/* Registers the records of _specs_ with one hold of the loop's lock,
+ * all or none of them. */
+static void
+dnssd_record_set_register(VALUE self, dnssd_record_spec_t *specs, long len)
+{
+	dnssd_service_t *set = dnssd_record_set_get(self);
+	VALUE records = rb_ivar_get(self, dnssd_iv_records);
+	DNSServiceErrorType e = kDNSServiceErr_NoError;
+	dnssd_record_t *rec;
+	long i, j;
+
+	/* the event loop may be reading replies from the ref without the GVL */
+	dnssd_loop_lock(set->loop);
+	for (i=0; i<len; i++) {
+		dnssd_record_spec_t *spec = &specs[i];
+		GetDNSSDRecord(spec->record, rec);
+		e = DNSServiceRegisterRecord(set->client, &rec->ref, spec->flags,
+																 spec->interface_index, spec->fullname,
+																 spec->rrtype, spec->rrclass,
+																 spec->rdlen, spec->rdata, spec->ttl,
+																 dnssd_register_record_reply, (void *)set);
+		if (e) break;
+	}
+	if (e) {
+		rec->ref = NULL;
+		for (j=0; j<i; j++) {
+			GetDNSSDRecord(specs[j].record, rec);
+			DNSServiceRemoveRecord(set->client, rec->ref, 0);
+			rec->ref = NULL;
+		}
+	}
+	dnssd_loop_unlock(set->loop);
+	dnssd_check_error_code(e);
+
+	/* the replies are dispatched while holding the GVL, so after this */
+	for (i=0; i<len; i++) {
+		GetDNSSDRecord(specs[i].record, rec);
+		rb_hash_aset(records, dnssd_record_key(rec->ref), specs[i].record);
+	}
+}
+
+/* takes _record_ out of _self_, returning the error of removing it */
+static DNSServiceErrorType
+dnssd_record_set_forget(VALUE self, VALUE record)
+{
+	dnssd_service_t *set;
+	dnssd_record_t *rec;
+	DNSServiceErrorType e;
+	GetDNSSDService(self, set);
+	GetDNSSDRecord(record, rec);
+
+	rb_hash_delete(rb_ivar_get(self, dnssd_iv_records), dnssd_record_key(rec->ref));
+	dnssd_loop_lock(set->loop);
+	e = DNSServiceRemoveRecord(set->client, rec->ref, 0);
+	dnssd_loop_unlock(set->loop);
+	rec->ref = NULL;
+	rec->registered = 0;
+	return e;
+}
+
+void
+dnssd_record_set_dispatch(dnssd_reply_t *reply)
+{
+	VALUE self = reply->service->self;
+	VALUE record = rb_hash_aref(rb_ivar_get(self, dnssd_iv_records),
+															dnssd_record_key(reply->record));
+	VALUE block;
+	dnssd_record_t *rec;
+
+	if (NIL_P(record)) return; /* removed since */
+	GetDNSSDRecord(record, rec);
+	if (reply->error) {
+		/* e.g. a conflict with a unique record, the record is dropped */
+		rb_ivar_set(record, dnssd_iv_error, dnssd_error_new(reply->error));
+		dnssd_record_set_forget(self, record);
+	} else {
+		rec->registered = 1;
+	}
+	block = rb_ivar_get(self, dnssd_iv_block);
+	if (!NIL_P(block))
+		rb_funcall2(block, dnssd_id_call, 1, &record);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::RecordSet.new => record_set
+ *    DNSSD::RecordSet.new do |record|
+ *      block
+ *    end => record_set
+ *
+ * Opens a connection to the mDNS daemon for registering individual
+ * records.  If a block is given each DNSSD::Record is passed to it once
+ * the daemon has registered it, or failed to (see DNSSD::Record#error).
+ */
+
+static VALUE
+dnssd_record_set_new(VALUE klass)
+{
+	VALUE self = dnssd_connection_new(klass);
+	rb_ivar_set(self, dnssd_iv_block, rb_block_given_p() ? rb_block_proc() : Qnil);
+	rb_ivar_set(self, dnssd_iv_records, rb_hash_new());
+	return self;
+}
+
+/*
+ * call-seq:
+ *    record_set.add(fullname, rrtype, rdata, ttl=0, flags=DNSSD::Flags::Unique, interface=DNSSD::InterfaceAny) => record
+ *
+ * Registers a resource record of type _rrtype_ (an Integer or a type
+ * name such as <code>:A</code>) named _fullname_, with the raw _rdata_.
+ * A _ttl_ of 0 uses the daemon's default.  _flags_ must include one of
+ * DNSSD::Flags::Unique (the default, for records like A records whose
+ * name belongs to this host) or DNSSD::Flags::Shared (for records like
+ * PTR records that many hosts may publish).
+ *
+ *    set.add("box-17.local.", :A, [10, 0, 0, 17].pack("C4"), 120)
+ */
+
+static VALUE
+dnssd_record_set_add(int argc, VALUE *argv, VALUE self)
+{
+	dnssd_record_spec_t spec;
+	dnssd_record_set_get(self);
+	dnssd_record_spec(self, &spec, argc, argv);
+	dnssd_record_set_register(self, &spec, 1);
+	return spec.record;
+}
+
+/*
+ * call-seq:
+ *    record_set.add_many([[fullname, rrtype, rdata, ttl, flags, interface], ...]) => [record, ...]
+ *
+ * Like DNSSD::RecordSet#add for each Array of arguments, submitted as
+ * one batch: all arguments are checked first and then all records are
+ * registered, or none if one fails.
+ */
+
+static VALUE
+dnssd_record_set_add_many(VALUE self, VALUE args)
+{
+	volatile VALUE buf, records;
+	dnssd_record_spec_t *specs;
+	long i, len;
+
+	dnssd_record_set_get(self);
+	Check_Type(args, T_ARRAY);
+	len = RARRAY_LEN(args);
+	buf = rb_str_new(0, len * sizeof(dnssd_record_spec_t));
+	specs = (dnssd_record_spec_t *)RSTRING_PTR(buf);
+	records = rb_ary_new2(len);
+	for (i=0; i<len; i++) {
+		VALUE arg = rb_Array(RARRAY_PTR(args)[i]);
+		dnssd_record_spec(self, &specs[i], (int)RARRAY_LEN(arg), RARRAY_PTR(arg));
+		/* the specs point into the records, keep them referenced */
+		rb_ary_push(records, specs[i].record);
+	}
+	dnssd_record_set_register(self, specs, len);
+	return records;
+}
+
+/*
+ * call-seq:
+ *    record_set.update(record, rdata, ttl=record.ttl) => record
+ *
+ * Replaces the rdata (and time to live) of _record_ in place.
+ */
+
+static VALUE
+dnssd_record_set_update(int argc, VALUE *argv, VALUE self)
+{
+	VALUE record, rdata, tmp_ttl;
+	dnssd_service_t *set = dnssd_record_set_get(self);
+	dnssd_record_t *rec;
+	const char *rdata_ptr;
+	uint16_t rdlen;
+	uint32_t ttl;
+	DNSServiceErrorType e;
+
+	rb_scan_args(argc, argv, "21", &record, &rdata, &tmp_ttl);
+	rec = dnssd_record_get(self, record);
+	rdata = rb_obj_freeze(rb_str_new4(StringValue(rdata)));
+	rdata_ptr = dnssd_get_rdata(rdata, &rdlen);
+	if (tmp_ttl == Qnil) tmp_ttl = rb_ivar_get(record, dnssd_iv_ttl);
+	ttl = (uint32_t)NUM2ULONG(tmp_ttl);
+
+	dnssd_loop_lock(set->loop);
+	e = DNSServiceUpdateRecord(set->client, rec->ref, 0, rdlen, rdata_ptr, ttl);
+	dnssd_loop_unlock(set->loop);
+	dnssd_check_error_code(e);
+
+	rb_ivar_set(record, dnssd_iv_rdata, rdata);
+	rb_ivar_set(record, dnssd_iv_ttl, ULONG2NUM(ttl));
+	return record;
+}
+
+/*
+ * call-seq:
+ *    record_set.remove(record) => record
+ *
+ * Deregisters _record_.
+ */
+
+static VALUE
+dnssd_record_set_remove(VALUE self, VALUE record)
+{
+	dnssd_record_set_get(self);
+	dnssd_record_get(self, record);
+	dnssd_check_error_code(dnssd_record_set_forget(self, record));
+	return record;
+}
+
+/*
+ * call-seq:
+ *    record_set.records => [record, ...]
+ *
+ * The records added to _record_set_ and not removed.
+ */
+
+static VALUE
+dnssd_record_set_records(VALUE self)
+{
+	return rb_funcall2(rb_ivar_get(self, dnssd_iv_records), rb_intern("values"), 0, 0);
+}
+
+static int
+dnssd_record_set_stop_i(VALUE key, VALUE record, VALUE arg)
+{
+	dnssd_record_t *rec;
+	GetDNSSDRecord(record, rec);
+	/* deallocating the set's ref deallocates the record's ref */
+	rec->ref = NULL;
+	rec->registered = 0;
+	return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *    record_set.stop => record_set
+ *
+ * Closes _record_set_, deregistering every record in it.
+ */
+
+static VALUE
+dnssd_record_set_stop(VALUE self)
+{
+	rb_hash_foreach(rb_ivar_get(self, dnssd_iv_records), dnssd_record_set_stop_i, 0);
+	rb_ivar_set(self, dnssd_iv_records, rb_hash_new());
+	return rb_call_super(0, 0);
+}
+
+/*
+ * call-seq:
+ *    record.registered? => true or false
+ *
+ * Returns <code>true</code> once the daemon has registered _record_,
+ * until it is removed.
+ */
+
+static VALUE
+dnssd_record_is_registered(VALUE self)
+{
+	dnssd_record_t *rec;
+	GetDNSSDRecord(self, rec);
+	return rec->registered ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    record.inspect => string
+ *
+ */
+
+static VALUE
+dnssd_record_inspect(VALUE self)
+{
+	VALUE buf = rb_str_buf_new(0);
+	rb_str_buf_cat2(buf, "#<");
+	rb_str_buf_cat2(buf, rb_obj_classname(self));
+	rb_str_buf_cat2(buf, " ");
+	rb_str_buf_append(buf, rb_String(rb_ivar_get(self, dnssd_iv_fullname)));
+	rb_str_buf_cat2(buf, " type:");
+	rb_str_buf_append(buf, rb_inspect(rb_ivar_get(self, dnssd_iv_rrtype)));
+	rb_str_buf_cat2(buf, " ttl:");
+	rb_str_buf_append(buf, rb_inspect(rb_ivar_get(self, dnssd_iv_ttl)));
+	if (RTEST(dnssd_record_is_registered(self)))
+		rb_str_buf_cat2(buf, " (registered)");
+	rb_str_buf_cat2(buf, ">");
+	return buf;
+}
+
+static VALUE
+dnssd_record_s_new(int argc, VALUE *argv, VALUE klass)
+{
+	rb_raise(rb_eRuntimeError, "cannot instantiate %s, use DNSSD::RecordSet#add() instead",
+					 rb_class2name(klass));
+	return Qnil;
+}
+
+void
+Init_DNSSD_RecordSet(void)
+{
+/* hack so rdoc documents the project correctly */
+#ifdef mDNSSD_RDOC_HACK
+	mDNSSD = rb_define_module("DNSSD");
+#endif
+	dnssd_id_call = rb_intern("call");
+	dnssd_iv_block = rb_intern("@block");
+	dnssd_iv_records = rb_intern("@records");
+	dnssd_iv_set = rb_intern("@set");
+	dnssd_iv_fullname = rb_intern("@fullname");
+	dnssd_iv_rrtype = rb_intern("@rrtype");
+	dnssd_iv_rrclass = rb_intern("@rrclass");
+	dnssd_iv_rdata = rb_intern("@rdata");
+	dnssd_iv_ttl = rb_intern("@ttl");
+	dnssd_iv_interface = rb_intern("@interface");
+	dnssd_iv_error = rb_intern("@error");
+
+	/* a record set runs on its Ractor's loop like any service */
+	rb_ext_ractor_safe(1);
+	cDNSSDRecordSet = rb_define_class_under(mDNSSD, "RecordSet",
+																					rb_const_get(mDNSSD, rb_intern("Connection")));
+	rb_define_singleton_method(cDNSSDRecordSet, "new", dnssd_record_set_new, 0);
+	rb_define_method(cDNSSDRecordSet, "add", dnssd_record_set_add, -1);
+	rb_define_method(cDNSSDRecordSet, "add_many", dnssd_record_set_add_many, 1);
+	rb_define_method(cDNSSDRecordSet, "update", dnssd_record_set_update, -1);
+	rb_define_method(cDNSSDRecordSet, "remove", dnssd_record_set_remove, 1);
+	rb_define_method(cDNSSDRecordSet, "records", dnssd_record_set_records, 0);
+	rb_define_method(cDNSSDRecordSet, "stop", dnssd_record_set_stop, 0);
+
+	cDNSSDRecord = rb_define_class_under(mDNSSD, "Record", rb_cObject);
+	/* records are only created by DNSSD::RecordSet#add and #add_many */
+	rb_undef_alloc_func(cDNSSDRecord);
+	rb_define_singleton_method(cDNSSDRecord, "new", dnssd_record_s_new, -1);
+	/* The DNSSD::RecordSet the record was added to. */
+	rb_define_attr(cDNSSDRecord, "set", 1, 0);
+	/* The record's full domain name. */
+	rb_define_attr(cDNSSDRecord, "fullname", 1, 0);
+	/* The record's type as an Integer, e.g. DNSSD::RecordReply::A. */
+	rb_define_attr(cDNSSDRecord, "rrtype", 1, 0);
+	/* The record's class, DNSSD::RecordReply::IN. */
+	rb_define_attr(cDNSSDRecord, "rrclass", 1, 0);
+	/* The record's raw rdata as a frozen String. */
+	rb_define_attr(cDNSSDRecord, "rdata", 1, 0);
+	/* The record's time to live in seconds, 0 for the daemon's default. */
+	rb_define_attr(cDNSSDRecord, "ttl", 1, 0);
+	/* The interface the record is registered on, nil for all. */
+	rb_define_attr(cDNSSDRecord, "interface", 1, 0);
+	/* The DNSSD::Error the daemon failed to register the record with, or nil. */
+	rb_define_attr(cDNSSDRecord, "error", 1, 0);
+	rb_define_method(cDNSSDRecord, "registered?", dnssd_record_is_registered, 0);
+	rb_define_method(cDNSSDRecord, "inspect", dnssd_record_inspect, 0);
+	rb_ext_ractor_safe(0);
+}
+
+/* Document-class: DNSSD::RecordSet
+ *
+ * Individual resource records registered over one connection to the
+ * mDNS daemon, without a service registration per record.
+ *
+ *    set = DNSSD::RecordSet.new do |record|
+ *      puts "#{record.fullname} failed: #{record.error}" if record.error
+ *    end
+ *    host = set.add("box-17.local.", :A, [10, 0, 0, 17].pack("C4"), 120)
+ *    set.add_many(containers.map { |c| [c.hostname, :A, c.address, 120] })
+ *    set.update(host, [10, 0, 0, 18].pack("C4"))
+ *    set.remove(host)
+ *    set.stop
+ */
+
+/* Document-class: DNSSD::Record
+ *
+ * A resource record added to a DNSSD::RecordSet.
+ */
@@ -8,12 +8,14 @@
  */
 
 #include "rdnssd.h"
-#include <intern.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
 
-/* for if_nametoindex() */
+/* for the sockaddrs of DNSSD.resolve_addresses() */
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <net/if.h>
+#include <netinet/in.h>
 
 #ifndef DNSSD_API
 	/* define as nothing if not defined in "dns_sd.h" header  */
@@ -21,16 +23,42 @@
 #endif
 
 static VALUE cDNSSDService;
+static VALUE cDNSSDConnection;
+static VALUE cDNSSDServiceGroup;
 static ID dnssd_id_call;
 static ID dnssd_id_to_str;
+static ID dnssd_id_keys;
+static ID dnssd_id_cached;
 static ID dnssd_iv_block;
-static ID dnssd_iv_thread;
-static ID dnssd_iv_service;
+static ID dnssd_iv_services;
+static ID dnssd_iv_connection;
+static ID dnssd_iv_results;
+static ID dnssd_iv_pending;
+static ID dnssd_iv_index;
+static ID dnssd_iv_io;
+static ID dnssd_id_subscribers;
+static ID dnssd_id_known;
+static ID dnssd_id_source;
+static ID dnssd_id_share_key;
+static ID dnssd_id_for_fd;
+static ID dnssd_id_autoclose_set;
+static ID dnssd_id_addrinfo;
+
+/* DNSSD.connection, DNSSD.share_subscriptions and the running shared
+ * browses and resolves (by their dnssd_share_key()) are the calling
+ * Ractor's, see dnssd_loop_t */
+
+static VALUE dnssd_service_stop(VALUE service);
+static void dnssd_pipeline_mark(dnssd_pipeline_t *pipeline);
+static void dnssd_pipeline_free(dnssd_pipeline_t *pipeline);
+static void dnssd_share_unsubscribe(VALUE service);
+static void dnssd_share_stop(VALUE source);
+static void dnssd_share_dispatch(dnssd_reply_t *reply);
+static void dnssd_share_replay(VALUE service);
 
 #define IsDNSSDService(obj) (rb_obj_is_kind_of(obj,cDNSSDService)==Qtrue)
-#define GetDNSSDService(obj, var) Data_Get_Struct(obj, DNSServiceRef, var)
-
-static VALUE dnssd_process(VALUE service);
+#define IsDNSSDConnection(obj) (rb_obj_is_kind_of(obj,cDNSSDConnection)==Qtrue)
+#define IsDNSSDServiceGroup(obj) (rb_obj_is_kind_of(obj,cDNSSDServiceGroup)==Qtrue)
 
 static void
 dnssd_check_block(VALUE block)
@@ -40,6 +68,17 @@ dnssd_check_block(VALUE block)
 	}
 }
 
+/* a block is required unless the replies are buffered for DNSSD::Service#take */
+static void
+dnssd_check_block_or_buffer(VALUE block, VALUE options)
+{
+	if (NIL_P(dnssd_option(options, "buffer"))) {
+		dnssd_check_block(block);
+	} else if (!NIL_P(block)) {
+		rb_raise(rb_eArgError, "no block is called with the :buffer option");
+	}
+}
+
 static const char *
 dnssd_get_domain(VALUE service_domain)
 {
@@ -50,12 +89,12 @@ dnssd_get_domain(VALUE service_domain)
 	return domain;
 }
 
-static uint32_t
+uint32_t
 dnssd_get_interface_index(VALUE interface)
 {
 	/* if the interface is a string then convert it to the interface index */
 	if (rb_respond_to(interface, dnssd_id_to_str)) {
-		return if_nametoindex(StringValueCStr(interface));
+		return dnssd_interface_index(StringValueCStr(interface));
 	} else {
 		return (uint32_t)NUM2ULONG(interface);
 	}
@@ -100,48 +139,126 @@ dnssd_service_new(int argc, VALUE *argv, VALUE klass)
 	return Qnil;
 }
 
+void
+dnssd_service_dealloc_client(dnssd_service_t *service)
+{
+	/* the event loop may be reading replies without the GVL */
+	dnssd_loop_lock(service->loop);
+	dnssd_loop_purge(service);
+	if (service->queue) dnssd_queue_clear(service->queue);
+	if (service->ring) dnssd_ring_clear(service->ring);
+	DNSServiceRefDeallocate(service->client);
+	service->client = NULL;
+	dnssd_loop_unlock(service->loop);
+}
+
 static void
-dnssd_service_stop_client(VALUE service)
+dnssd_service_mark(void *ptr)
 {
-	DNSServiceRef *client = (DNSServiceRef*)RDATA(service)->data;
-	/* set to null right away for a bit more thread safety */
-	RDATA(service)->data = NULL;
-  DNSServiceRefDeallocate(*client);
-	free(client); /* free the pointer */
+	dnssd_service_t *service = (dnssd_service_t *)ptr;
+	rb_gc_mark(service->batch);
+	if (service->pipeline) dnssd_pipeline_mark(service->pipeline);
 }
 
 static void
 dnssd_service_free(void *ptr)
 {
-	DNSServiceRef *client = (DNSServiceRef*)ptr;
-	if (client) {
-		/* client will be non-null only if client has not been deallocated
-		 * see dnssd_service_stop_client() above. */
-		DNSServiceRefDeallocate(*client);
-		free(client); /* free the pointer, see dnssd_service_alloc() below */
+	dnssd_service_t *service = (dnssd_service_t *)ptr;
+	/* client will be non-null only if client has not been deallocated
+	 * see dnssd_service_stop() below.  An operation sharing a connection
+	 * goes with the connection's ref, which may be gone already (the
+	 * running services of a terminated Ractor are collected together). */
+	if (service->client && !service->connection)
+		DNSServiceRefDeallocate(service->client);
+	if (service->queue) {
+		dnssd_queue_clear(service->queue);
+		free(service->queue);
 	}
+	if (service->ring) dnssd_ring_free(service->ring);
+	dnssd_filter_free(service->filter);
+	if (service->pipeline) dnssd_pipeline_free(service->pipeline);
+	free(service); /* see dnssd_service_alloc() below */
 }
 
 static VALUE
-dnssd_service_alloc(VALUE block)
+dnssd_service_alloc(VALUE klass, VALUE block)
 {
-  DNSServiceRef *client = ALLOC(DNSServiceRef);
-	VALUE service = Data_Wrap_Struct(cDNSSDService, 0, dnssd_service_free, client);
-  rb_ivar_set(service, dnssd_iv_block, block);
-  rb_ivar_set(service, dnssd_iv_thread, Qnil);
+	dnssd_service_t *client = ALLOC(dnssd_service_t);
+	VALUE service;
+	client->batch = Qnil;
+	service = Data_Wrap_Struct(klass, dnssd_service_mark, dnssd_service_free, client);
+	client->client = NULL;
+	client->self = service;
+	client->stopped = 0;
+	client->is_connection = 0;
+	client->is_registration = 0;
+	client->connection = NULL;
+	client->queue = NULL;
+	client->ring = NULL;
+	client->filter = NULL;
+	client->is_shared = 0;
+	client->source = NULL;
+	client->replaying = 0;
+	client->operation = "";
+	client->loop = dnssd_loop_current();
+	client->stage = NULL;
+	client->stage_data = NULL;
+	client->pipeline = NULL;
+	rb_ivar_set(service, dnssd_iv_block, block);
 	return service;
 }
 
+/* Prepares _service_ for an operation on _connection_ (if not nil),
+ * returning the flags to pass to the operation.
+ * A service run by the caller (see DNSSD::Service#process) or
+ * buffering its replies (see DNSSD::Service#take) always gets its own
+ * connection.
+ * The connection's ref is in use by the event loop, so the loop is
+ * locked until the operation is started by dnssd_service_start(). */
+static DNSServiceFlags
+dnssd_service_share(VALUE service, VALUE connection, DNSServiceFlags flags)
+{
+	dnssd_service_t *client, *conn;
+	GetDNSSDService(service, client);
+	if (NIL_P(connection) || client->queue || client->ring) return flags;
+
+	GetDNSSDService(connection, conn);
+	if (conn->stopped) rb_raise(rb_eRuntimeError, "connection is stopped");
+	/* the operation's ref starts out as a copy of the connection's ref */
+	client->client = conn->client;
+	client->connection = conn;
+	rb_ivar_set(service, dnssd_iv_connection, connection);
+	dnssd_loop_lock(client->loop);
+	return flags | kDNSServiceFlagsShareConnection;
+}
+
+/* _operation_ and _name_ (what is browsed, resolved, ...) are for the
+ * probes, see DNSSD_PROBE() */
 static void
-dnssd_service_start(VALUE service)
+dnssd_service_start(VALUE service, DNSServiceErrorType e,
+										const char *operation, const char *name)
 {
-  VALUE thread = rb_thread_create(dnssd_process, (void *)service);
-  rb_ivar_set(service, dnssd_iv_thread, thread);
-	/* !! IMPORTANT: prevents premature garbage collection of the service,
-	 * this way the thread holds a reference to the service and
-	 * the service gets marked as long as the thread is running.
-	 * Running threads are always marked by Ruby. !! */
-	rb_ivar_set(thread, dnssd_iv_service, service);
+	dnssd_service_t *client;
+	GetDNSSDService(service, client);
+	client->operation = operation;
+	if (client->connection) dnssd_loop_unlock(client->loop);
+	if (e) {
+		/* the ref was not initialized (or is still the connection's) */
+		client->client = NULL;
+		client->connection = NULL;
+		dnssd_check_error_code(e);
+	}
+	if (client->connection) {
+		/* replies arrive on the connection's socket */
+		rb_hash_aset(rb_ivar_get(client->connection->self, dnssd_iv_services),
+								 service, Qtrue);
+	} else if (client->queue) {
+		/* replies are read and dispatched by DNSSD::Service#process */
+	} else {
+		/* replies are read and dispatched by the event loop, see rdnssd_loop.c */
+		dnssd_loop_add(client);
+	}
+	DNSSD_PROBE3(service__start, client, operation, name);
 }
 
 /*
@@ -154,34 +271,50 @@ dnssd_service_start(VALUE service)
 static VALUE
 dnssd_service_is_stopped(VALUE service)
 {
-  return NIL_P(rb_ivar_get(service, dnssd_iv_thread)) ? Qtrue : Qfalse;
+	dnssd_service_t *client;
+	GetDNSSDService(service, client);
+	return client->stopped ? Qtrue : Qfalse;
 }
 
 /*
  * call-seq:
  *    service.stop => service
  *
- * Stops the DNSSD::Service _service_; closing the underlying socket and killing
- * the underlying thread.
+ * Stops the DNSSD::Service _service_; closing the underlying socket and removing
+ * it from the event loop.
  */
 
 static VALUE
 dnssd_service_stop(VALUE service)
 {
-	VALUE thread = rb_ivar_get(service, dnssd_iv_thread);
-	if (NIL_P(thread)) rb_raise(rb_eRuntimeError, "service is already stopped");
-
-	/* mark service as stopped, then kill thread -
-	 * just in case stop is called in thread! :( */
-	rb_ivar_set(service, dnssd_iv_thread, Qnil);
-	rb_thread_kill(thread);
-
-	/* once thread is killed we don't need to reference the block any more */
-  rb_ivar_set(service, dnssd_iv_block, Qnil);
- 
-	/* do this last! - thread must be killed */
-	dnssd_service_stop_client(service);
-  return service;
+	dnssd_service_t *client;
+	GetDNSSDService(service, client);
+	if (client->stopped) rb_raise(rb_eRuntimeError, "service is already stopped");
+
+	client->stopped = 1;
+	DNSSD_PROBE2(service__stop, client, client->operation);
+	/* no more replies will be dispatched so we don't need to reference the block any more */
+	rb_ivar_set(service, dnssd_iv_block, Qnil);
+	client->batch = Qnil;
+
+	if (client->source) {
+		/* has no ref of its own */
+		dnssd_share_unsubscribe(service);
+		return service;
+	}
+	if (client->is_shared) dnssd_share_stop(service);
+	if (client->connection) {
+		/* deallocating a ref sharing a connection only terminates its operation */
+		rb_hash_delete(rb_ivar_get(client->connection->self, dnssd_iv_services), service);
+		client->connection = NULL;
+	} else if (client->queue) {
+		/* the socket is closed below */
+		rb_ivar_set(service, dnssd_iv_io, Qnil);
+	} else {
+		dnssd_loop_remove(client);
+	}
+	dnssd_service_dealloc_client(client);
+	return service;
 }
 
 /*
@@ -209,261 +342,1126 @@ dnssd_service_get_block(VALUE service)
 	return rb_ivar_get(service, dnssd_iv_block);
 }
 
-static VALUE
-dnssd_process(VALUE service)
+/* calls the block of _service_ with _arg_, _count_ replies */
+static void
+dnssd_service_call(VALUE service, VALUE arg, long count)
 {
-  int dns_sd_fd, nfds, result;
-  fd_set readfds;
+	dnssd_service_t *client;
+	GetDNSSDService(service, client);
+	DNSSD_PROBE3(block__entry, client, client->operation, count);
+	rb_funcall2(dnssd_service_get_block(service), dnssd_id_call, 1, &arg);
+	DNSSD_PROBE3(block__return, client, client->operation, count);
+}
 
-  DNSServiceRef *client;
-  GetDNSSDService(service, client);
+static void
+dnssd_service_flush(VALUE service)
+{
+	dnssd_service_t *client;
+	VALUE batch;
+	GetDNSSDService(service, client);
+	if (NIL_P(client->batch) || RARRAY_LEN(client->batch) == 0) return;
 
-  dns_sd_fd = DNSServiceRefSockFD (*client);
-  nfds = dns_sd_fd + 1;
-  while (1) {
-    FD_ZERO (&readfds);
-    FD_SET (dns_sd_fd, &readfds);
-    result = rb_thread_select (nfds, &readfds, (fd_set *) NULL, (fd_set *) NULL, (struct timeval *) NULL);
-    if (result > 0) {
-      if (FD_ISSET (dns_sd_fd, &readfds)) {
-        DNSServiceProcessResult(*client);
-      }
-    } else {
-      break;
-    }
-  }
-  return Qnil;
+	/* the block gets its own array, the next batch starts out empty */
+	batch = client->batch;
+	client->batch = rb_ary_new();
+	dnssd_service_call(service, batch, RARRAY_LEN(batch));
 }
 
-static void DNSSD_API
-dnssd_browse_reply (DNSServiceRef client, DNSServiceFlags flags,
-										uint32_t interface_index, DNSServiceErrorType errorCode,
-							      const char *replyName, const char *replyType,
-										const char *replyDomain, void *context)
+/* Passes _reply_ to the block of _service_, or with the :batch option
+ * adds it to the batch which is passed once MoreComing is no longer set.
+ * _reply_ is Qundef if the filter dropped it, see dnssd_reply_wanted().
+ * The ring of a service with the :buffer option only holds replies
+ * from the daemon, a reply object (a cached one) waits for
+ * DNSSD::Service#take in the hidden "cached" Array instead. */
+static void
+dnssd_service_yield(VALUE service, VALUE reply, DNSServiceFlags flags)
 {
-  VALUE service, block, browse_reply;
-	/* other parameters are undefined if errorCode != 0 */
-	dnssd_check_error_code(errorCode);
-	
-	service = (VALUE)context;
-	block = dnssd_service_get_block(service);
-	browse_reply = dnssd_browse_new(service, flags, interface_index,
-																	replyName, replyType, replyDomain);
+	dnssd_service_t *client;
+	GetDNSSDService(service, client);
+	if (client->ring) {
+		VALUE cached = rb_ivar_get(service, dnssd_id_cached);
+		if (reply == Qundef) return;
+		if (NIL_P(cached)) {
+			cached = rb_ary_new();
+			rb_ivar_set(service, dnssd_id_cached, cached);
+		}
+		rb_ary_push(cached, reply);
+		return;
+	}
+	if (NIL_P(client->batch)) {
+		if (reply != Qundef) dnssd_service_call(service, reply, 1);
+		return;
+	}
 
-	/* client is wrapped by service */
-  rb_funcall2(block, dnssd_id_call, 1, &browse_reply);
+	if (reply != Qundef) rb_ary_push(client->batch, reply);
+	if (flags & kDNSServiceFlagsMoreComing) return;
+
+	if (client->connection) {
+		/* MoreComing covers every operation sharing the connection,
+		 * the other services may be holding back replies as well.
+		 * The blocks may start services, so iterate over a copy. */
+		volatile VALUE services = rb_funcall2(rb_ivar_get(client->connection->self, dnssd_iv_services),
+																					dnssd_id_keys, 0, 0);
+		long i;
+		for (i=0; i<RARRAY_LEN(services); i++)
+			dnssd_service_flush(RARRAY_PTR(services)[i]);
+	} else {
+		dnssd_service_flush(service);
+	}
 }
 
-/*
- * call-seq:
- *    DNSSD.browse(service_type, domain=nil, flags=0, interface=DNSSD::InterfaceAny) do |browse_reply|
- *      block
- *    end => service_handle
- *
- * Browse for DNSSD services.
- * For each service found DNSSD::BrowseReply object is passed to block.
- * The returned _service_handle_ can be used to control when to
- * stop browsing for services (see DNSSD::Service#stop).
- *
- */
- 
+/* Returns the reply object for _reply_ of _service_,
+ * raises the error if _reply_ is one. */
 static VALUE
-dnssd_browse (int argc, VALUE * argv, VALUE self)
+dnssd_reply_object(dnssd_reply_t *reply, VALUE service)
 {
-  VALUE service_type, domain, tmp_flags, interface, block;
-	
-	const char *type_str;
-	const char *domain_str = NULL;
-	DNSServiceFlags flags = 0;
-	uint32_t interface_index = 0;
+	VALUE obj = Qnil;
+
+	dnssd_check_error_code(reply->error);
+	switch (reply->type) {
+	case DNSSD_REPLY_BROWSE:
+		/* the instance is gone, so is its resolve */
+		if (!(reply->flags & kDNSServiceFlagsAdd))
+			dnssd_cache_remove(reply->name, reply->regtype, reply->domain);
+		obj = dnssd_browse_new(service, reply->flags, reply->interface,
+													 reply->name, reply->regtype, reply->domain);
+		break;
+	case DNSSD_REPLY_RESOLVE:
+		obj = dnssd_resolve_new(service, reply->flags, reply->interface,
+														reply->fullname, reply->target, reply->opaqueport,
+														reply->txt_len, reply->txt_rec);
+		dnssd_cache_store(reply->fullname, reply->interface, obj);
+		break;
+	case DNSSD_REPLY_REGISTER:
+		obj = dnssd_register_new(service, reply->flags,
+														 reply->name, reply->regtype, reply->domain);
+		break;
+	case DNSSD_REPLY_RECORD:
+		obj = dnssd_record_new(service, reply->flags, reply->interface,
+													 reply->fullname, reply->rrtype, reply->rrclass,
+													 reply->rdlen, reply->rdata, reply->ttl);
+		break;
+	default:
+		return Qnil;
+	}
+	DNSSD_PROBE3(reply__built, reply->service, reply->service->operation,
+							 reply->fullname ? reply->fullname : reply->name);
+	return obj;
+}
 
-  DNSServiceErrorType e;
-	DNSServiceRef *client;
-  VALUE service;
+/* Records the outcome of a registration of a DNSSD::ServiceGroup,
+ * errors included, and once every registration has an outcome passes
+ * them all to the group's block. */
+static void
+dnssd_group_dispatch(dnssd_reply_t *reply)
+{
+	VALUE service = reply->service->self;
+	VALUE group = reply->service->connection->self;
+	VALUE results = rb_ivar_get(group, dnssd_iv_results);
+	long index = NUM2LONG(rb_ivar_get(service, dnssd_iv_index));
+	int first = NIL_P(rb_ary_entry(results, index));
+	long pending;
+	VALUE result, block;
+
+	if (reply->error) {
+		result = dnssd_error_new(reply->error);
+		dnssd_service_stop(service);
+	} else {
+		result = dnssd_register_new(service, reply->flags,
+																reply->name, reply->regtype, reply->domain);
+	}
+	rb_ary_store(results, index, result);
+	if (!first) return; /* e.g. renamed after a conflict */
+
+	pending = NUM2LONG(rb_ivar_get(group, dnssd_iv_pending)) - 1;
+	rb_ivar_set(group, dnssd_iv_pending, LONG2NUM(pending));
+	block = dnssd_service_get_block(group);
+	if (pending == 0 && !NIL_P(block)) {
+		results = rb_ary_dup(results);
+		rb_funcall2(block, dnssd_id_call, 1, &results);
+	}
+}
 
-  rb_scan_args (argc, argv, "13&", &service_type, &domain,
-								&tmp_flags, &interface, &block);
+void
+dnssd_service_dispatch(dnssd_reply_t *reply)
+{
+	VALUE service = reply->service->self;
+	VALUE obj;
 
-	/* required */
-	dnssd_check_block(block);
-	type_str = StringValueCStr(service_type);
+	if (reply->type == DNSSD_REPLY_FILTERED) {
+		dnssd_service_yield(service, Qundef, reply->flags);
+		return;
+	}
+	if (reply->type == DNSSD_REPLY_REPLAY) {
+		dnssd_share_replay(service);
+		return;
+	}
+	if (reply->service->is_shared) {
+		dnssd_share_dispatch(reply);
+		return;
+	}
+	if (reply->type == DNSSD_REPLY_REGISTER_RECORD) {
+		dnssd_record_set_dispatch(reply);
+		return;
+	}
+	if (reply->service->connection && IsDNSSDServiceGroup(reply->service->connection->self)) {
+		dnssd_group_dispatch(reply);
+		return;
+	}
+	if (reply->service->stage) {
+		/* an error stops the stage as it would a service */
+		dnssd_check_error_code(reply->error);
+		reply->service->stage(reply);
+		return;
+	}
+	obj = dnssd_reply_object(reply, service);
 
-	/* optional parameters */
-  if (domain != Qnil)
-		domain_str = dnssd_get_domain(domain);
-	if (tmp_flags != Qnil)
-		flags = dnssd_to_flags(tmp_flags);
-	if (interface != Qnil)
-		interface_index = dnssd_get_interface_index(interface);
-	
-	/* allocate this last since all other parameters are on the stack (thanks to & unary operator) */
-	service = dnssd_service_alloc(block);
-	GetDNSSDService(service, client);
-	
-  e = DNSServiceBrowse (client, flags, interface_index,
-												type_str, domain_str,
-												dnssd_browse_reply, (void *)service);
-  dnssd_check_error_code(e);
-	dnssd_service_start(service);
-  return service;
+	if (reply->type == DNSSD_REPLY_REGISTER) {
+		dnssd_service_call(service, obj, 1);
+	} else {
+		dnssd_service_yield(service, obj, reply->flags);
+	}
 }
 
-static void DNSSD_API
-dnssd_register_reply (DNSServiceRef client, DNSServiceFlags flags,
-											DNSServiceErrorType errorCode,
-											const char *name, const char *regtype,
-											const char *domain, void *context)
+static int
+dnssd_to_overflow(VALUE overflow)
 {
-	VALUE service, block, register_reply;
-	/* other parameters are undefined if errorCode != 0 */
-	dnssd_check_error_code(errorCode);
-
-  service = (VALUE)context;
-  block = dnssd_service_get_block(service);
-	register_reply = dnssd_register_new(service, flags, name, regtype, domain);
+	ID id;
+	if (NIL_P(overflow)) return DNSSD_OVERFLOW_DROP_OLDEST;
+	id = rb_to_id(overflow);
+	if (id == rb_intern("drop_oldest")) return DNSSD_OVERFLOW_DROP_OLDEST;
+	if (id == rb_intern("coalesce")) return DNSSD_OVERFLOW_COALESCE;
+	if (id == rb_intern("block")) return DNSSD_OVERFLOW_BLOCK;
+	rb_raise(rb_eArgError, "unknown overflow policy %s", rb_id2name(id));
+	return 0; /* not reached */
+}
 
-  rb_funcall2(block, dnssd_id_call, 1, &register_reply);
+/* applies the options common to the operations */
+static void
+dnssd_service_options(VALUE service, VALUE options)
+{
+	dnssd_service_t *client;
+	VALUE tmp_buffer;
+	GetDNSSDService(service, client);
+	if (RTEST(dnssd_option(options, "batch")))
+		client->batch = rb_ary_new();
+	if (RTEST(dnssd_option(options, "reactor"))) {
+		client->queue = ALLOC(dnssd_queue_t);
+		client->queue->head = NULL;
+		client->queue->tail = NULL;
+	}
+	client->filter = dnssd_filter_new(options);
+	tmp_buffer = dnssd_option(options, "buffer");
+	if (!NIL_P(tmp_buffer)) {
+		long capacity = NUM2LONG(tmp_buffer);
+		int overflow = dnssd_to_overflow(dnssd_option(options, "overflow"));
+		if (capacity < 1)
+			rb_raise(rb_eArgError, "the buffer must hold at least one reply");
+		if (!NIL_P(client->batch) || client->queue)
+			rb_raise(rb_eArgError, "the :buffer option excludes :batch and :reactor");
+		client->ring = dnssd_ring_new(capacity, overflow);
+	}
 }
 
 /*
- * call-seq:
- *    DNSSD.register(service_name, service_type, service_domain, service_port, text_record=nil, flags=0, interface=DNSSD::InterfaceAny) do |register_reply|
- *      block
- *    end => service_handle
+ * Shared subscriptions.  With DNSSD.share_subscriptions set (or the
+ * :share option) a DNSSD.browse() or DNSSD.resolve() with the same
+ * arguments as a running one does not ask the daemon again.  The first
+ * starts a hidden operation, the source, which every such call
+ * subscribes to: each subscriber is a DNSSD::Service without a ref of
+ * its own, the source's replies are turned into reply objects for each
+ * subscriber and passed to its block.  Stopping the last subscriber
+ * stops the source.
  *
- * Register a service.
- * If a block is provided a DNSSD::RegisterReply object will passed to the block
- * when the registration completes or asynchronously fails.
- * If no block is passed the client will not be notified of the default values picked
- * on its behalf or of any error that occur.
- * The returned _service_handle_ can be used to control when to
- * stop the service (see DNSSD::Service#stop).
+ * The source keeps a copy of the latest reply about each instance it
+ * knows ("known"), a new subscriber is passed those first.  Its
+ * DNSSD_REPLY_REPLAY goes through the loop's queue like any reply, so
+ * the replies queued before it (they are known by the time it is
+ * dispatched) are not passed twice and the ones after it come after
+ * the replay.
  */
 
+/* The key of the operation _op_ with the arguments given, nil if it is
+ * not to be shared: the options ask for something only a service of
+ * its own can do, or it does not run on the connection DNSSD.browse()
+ * and DNSSD.resolve() use. */
 static VALUE
-dnssd_register (int argc, VALUE * argv, VALUE self)
+dnssd_share_key(VALUE connection, VALUE options, const char *op,
+								const char *name, const char *type, const char *domain,
+								DNSServiceFlags flags, uint32_t interface_index)
 {
-  VALUE service_name, service_type, service_domain, service_port,
-				text_record, tmp_flags, interface, block;
+	VALUE share = dnssd_option(options, "share");
+	VALUE key;
+	char buf[32];
+
+	if (NIL_P(share) ? !dnssd_loop_current()->share_default : !RTEST(share)) return Qnil;
+	if (connection != dnssd_loop_current()->connection ||
+			RTEST(dnssd_option(options, "reactor")) ||
+			!NIL_P(dnssd_option(options, "buffer")) ||
+			dnssd_filter_given(options))
+		return Qnil;
+
+	/* names cannot contain NUL */
+	key = rb_str_buf_new2(op);
+	rb_str_buf_cat(key, "", 1);
+	if (name) rb_str_buf_cat2(key, name);
+	rb_str_buf_cat(key, "", 1);
+	rb_str_buf_cat2(key, type);
+	rb_str_buf_cat(key, "", 1);
+	if (domain) rb_str_buf_cat2(key, domain);
+	snprintf(buf, sizeof(buf), "/%lu/%lu", (unsigned long)flags,
+					 (unsigned long)interface_index);
+	rb_str_buf_cat2(key, buf);
+	return key;
+}
 
-	const char *name_str, *type_str, *domain_str = NULL;
-	uint16_t opaqueport;
-	uint16_t txt_len = 0;
-	char *txt_rec = NULL;
-	DNSServiceFlags flags = 0;
-	uint32_t interface_index = 0;
+/* adds a subscriber with _block_ to the shared operation _source_ */
+static VALUE
+dnssd_share_subscribe(VALUE source, VALUE block, VALUE options)
+{
+	dnssd_service_t *client;
+	VALUE service = dnssd_service_alloc(cDNSSDService, block);
+	GetDNSSDService(service, client);
+	GetDNSSDService(source, client->source);
+	client->operation = "subscribe";
+	if (RTEST(dnssd_option(options, "batch")))
+		client->batch = rb_ary_new();
+	rb_ivar_set(service, dnssd_id_source, source);
+	rb_ary_push(rb_ivar_get(source, dnssd_id_subscribers), service);
+
+	if (RHASH_SIZE(rb_ivar_get(source, dnssd_id_known)) > 0) {
+		dnssd_reply_t *reply = dnssd_reply_alloc(client, DNSSD_REPLY_REPLAY, 0);
+		if (reply == NULL) rb_memerror();
+		client->replaying = 1;
+		dnssd_loop_post(reply);
+	}
+	return service;
+}
 
-  DNSServiceErrorType e;
-  DNSServiceRef *client;
-  VALUE service;
+/* The running shared operation for _key_ on _connection_ if there is
+ * one, nil otherwise.  A new subscriber is added to it. */
+static VALUE
+dnssd_share_find(VALUE connection, VALUE key, VALUE block, VALUE options)
+{
+	VALUE source = rb_hash_aref(dnssd_loop_current()->shares, key);
+	if (NIL_P(source) || RTEST(dnssd_service_is_stopped(source))) return Qnil;
+	/* started before DNSSD.connection was changed */
+	if (rb_ivar_get(source, dnssd_iv_connection) != connection) return Qnil;
+	return dnssd_share_subscribe(source, block, options);
+}
 
-  rb_scan_args (argc, argv, "43&",
-								&service_name, &service_type,
-								&service_domain, &service_port,
-								&text_record, &tmp_flags,
-								&interface, &block);
+/* Makes the operation _source_, not yet started, the shared operation
+ * for _key_ and returns its first subscriber.  The caller adds it to
+ * the shares of its loop once it has started. */
+static VALUE
+dnssd_share_init(VALUE source, VALUE key, VALUE block, VALUE options)
+{
+	dnssd_service_t *client;
+	GetDNSSDService(source, client);
+	client->is_shared = 1;
+	/* the subscribers are called, not the source's block */
+	rb_ivar_set(source, dnssd_iv_block, Qnil);
+	client->batch = Qnil;
+	rb_ivar_set(source, dnssd_id_share_key, key);
+	rb_ivar_set(source, dnssd_id_subscribers, rb_ary_new());
+	rb_ivar_set(source, dnssd_id_known, rb_hash_new());
+	return dnssd_share_subscribe(source, block, options);
+}
 
-	/* required parameters */
-	dnssd_check_block(block); /* in the future this may not be required */
-	name_str = StringValueCStr(service_name);
-	type_str = StringValueCStr(service_type);
+static void
+dnssd_share_unsubscribe(VALUE service)
+{
+	dnssd_service_t *client;
+	VALUE source, subscribers;
+	GetDNSSDService(service, client);
 
-	if (service_domain != Qnil)
-		domain_str = dnssd_get_domain(service_domain);
-	/* convert from host to net byte order */
-	opaqueport = htons((uint16_t)NUM2UINT(service_port));
+	/* drops a DNSSD_REPLY_REPLAY still queued */
+	dnssd_loop_lock(client->loop);
+	dnssd_loop_purge(client);
+	dnssd_loop_unlock(client->loop);
 
-	/* optional parameters */
-	if (text_record != Qnil) {
-		text_record = dnssd_tr_to_encoded_str(text_record);
-		txt_rec = RSTRING(text_record)->ptr;
-		txt_len = RSTRING(text_record)->len;
+	source = rb_ivar_get(service, dnssd_id_source);
+	subscribers = rb_ivar_get(source, dnssd_id_subscribers);
+	rb_ary_delete(subscribers, service);
+	if (RARRAY_LEN(subscribers) == 0 && !client->source->stopped)
+		dnssd_service_stop(source);
+}
+
+/* stopping the source, e.g. after an error reply, stops the subscribers */
+static void
+dnssd_share_stop(VALUE source)
+{
+	VALUE key = rb_ivar_get(source, dnssd_id_share_key);
+	VALUE subscribers = rb_ivar_get(source, dnssd_id_subscribers);
+	dnssd_service_t *client;
+	long i;
+
+	GetDNSSDService(source, client);
+	if (rb_hash_aref(client->loop->shares, key) == source)
+		rb_hash_delete(client->loop->shares, key);
+	rb_ivar_set(source, dnssd_id_subscribers, rb_ary_new());
+	rb_ivar_set(source, dnssd_id_known, rb_hash_new());
+	for (i=0; i<RARRAY_LEN(subscribers); i++) {
+		if (!RTEST(dnssd_service_is_stopped(RARRAY_PTR(subscribers)[i])))
+			dnssd_service_stop(RARRAY_PTR(subscribers)[i]);
 	}
-	if (tmp_flags != Qnil)
-		flags = dnssd_to_flags(tmp_flags);
-  if(interface != Qnil)
-		interface_index = dnssd_get_interface_index(interface);
+}
 
-	/* allocate this last since all other parameters are on the stack (thanks to & unary operator) */
-	service = dnssd_service_alloc(block);
-  GetDNSSDService(service, client);
+/* a copy of _reply_ owned by a hidden object, for "known" */
+static VALUE
+dnssd_share_keep(dnssd_reply_t *reply)
+{
+	dnssd_reply_t *copy;
+	VALUE obj = Data_Wrap_Struct(0, 0, free, 0);
+	copy = (dnssd_reply_t *)malloc(sizeof(dnssd_reply_t) + reply->data_len);
+	if (copy == NULL) rb_memerror();
+	memcpy(copy, reply, sizeof(dnssd_reply_t) + reply->data_len);
+	copy->next = NULL;
+#define DNSSD_REPLY_REBASE(field) \
+	if (reply->field) copy->field = copy->data + (reply->field - reply->data)
+	DNSSD_REPLY_REBASE(name);
+	DNSSD_REPLY_REBASE(regtype);
+	DNSSD_REPLY_REBASE(domain);
+	DNSSD_REPLY_REBASE(fullname);
+	DNSSD_REPLY_REBASE(target);
+	DNSSD_REPLY_REBASE(txt_rec);
+	DNSSD_REPLY_REBASE(rdata);
+#undef DNSSD_REPLY_REBASE
+	DATA_PTR(obj) = copy;
+	return obj;
+}
 
-  e = DNSServiceRegister( client, flags, interface_index,
-													name_str, type_str, domain_str,
-													NULL, opaqueport, txt_len, txt_rec,
-													/*block == Qnil ? NULL : dnssd_register_reply,*/
-													dnssd_register_reply, (void*)service );
-  dnssd_check_error_code(e);
-  dnssd_service_start(service);
-  return service;
+/* the instance _reply_ is about, a resolve is about one instance */
+static VALUE
+dnssd_share_known_key(dnssd_reply_t *reply)
+{
+	VALUE key = ULONG2NUM(reply->interface);
+	if (reply->type != DNSSD_REPLY_BROWSE) return key;
+	key = rb_obj_as_string(key);
+	rb_str_buf_cat(key, "", 1);
+	rb_str_buf_cat2(key, reply->name);
+	rb_str_buf_cat(key, "", 1);
+	rb_str_buf_cat2(key, reply->regtype);
+	rb_str_buf_cat(key, "", 1);
+	rb_str_buf_cat2(key, reply->domain);
+	return key;
 }
 
-/*
-set text record using AddRecord
 static VALUE
-dnssd_service_record(VALUE self, VALUE text_record)
+dnssd_share_yield_i(VALUE arg)
 {
-	VALUE text_record, flags, time_to_live;
-	
-	
-	text_record = dnssd_tr_to_encoded_str(text_record);
-	
+	VALUE *args = (VALUE *)arg;
+	dnssd_reply_t *reply = (dnssd_reply_t *)args[1];
+	dnssd_service_yield(args[0], dnssd_reply_object(reply, args[0]), (DNSServiceFlags)args[2]);
+	return Qnil;
 }
-*/
 
-static void DNSSD_API
-dnssd_resolve_reply (DNSServiceRef client, DNSServiceFlags flags,
-										 uint32_t interface_index, DNSServiceErrorType errorCode,
-										 const char *fullname, const char *host_target,
-										 uint16_t opaqueport, uint16_t txt_len,
-										 const char *txt_rec, void *context)
+/* Passes _reply_ to _service_ with _flags_.  An exception raised by
+ * the subscriber's block only stops the subscriber. */
+static void
+dnssd_share_yield(VALUE service, dnssd_reply_t *reply, DNSServiceFlags flags)
 {
-	/* other parameters are undefined if errorCode != 0 */
-	dnssd_check_error_code(errorCode);
-	VALUE service, block, resolve_reply;
+	VALUE args[3];
+	int state = 0;
+	args[0] = service;
+	args[1] = (VALUE)reply;
+	args[2] = (VALUE)flags;
+	rb_protect(dnssd_share_yield_i, (VALUE)args, &state);
+	if (state) dnssd_loop_rescue(service, state);
+}
+
+/* fans a reply of the source out to the subscribers */
+static void
+dnssd_share_dispatch(dnssd_reply_t *reply)
+{
+	VALUE source = reply->service->self;
+	volatile VALUE subscribers;
+	VALUE known;
+	long i;
+
+	/* raises the error reply, stopping the source and the subscribers */
+	dnssd_check_error_code(reply->error);
 
-	service = (VALUE)context;
-  block = dnssd_service_get_block(service);
-	resolve_reply = dnssd_resolve_new(service, flags, interface_index,
-																		fullname, host_target, opaqueport,
-																		txt_len, txt_rec);
-  
-	rb_funcall2(block, dnssd_id_call, 1, &resolve_reply);
+	known = rb_ivar_get(source, dnssd_id_known);
+	if (reply->type == DNSSD_REPLY_BROWSE && !(reply->flags & kDNSServiceFlagsAdd)) {
+		rb_hash_delete(known, dnssd_share_known_key(reply));
+	} else {
+		rb_hash_aset(known, dnssd_share_known_key(reply), dnssd_share_keep(reply));
+	}
+
+	/* the blocks may add and stop subscribers */
+	subscribers = rb_ary_dup(rb_ivar_get(source, dnssd_id_subscribers));
+	for (i=0; i<RARRAY_LEN(subscribers); i++) {
+		dnssd_service_t *client;
+		GetDNSSDService(RARRAY_PTR(subscribers)[i], client);
+		if (client->stopped || client->replaying) continue;
+		dnssd_share_yield(RARRAY_PTR(subscribers)[i], reply, reply->flags);
+	}
+}
+
+/* passes the instances its source knows to a new subscriber */
+static void
+dnssd_share_replay(VALUE service)
+{
+	dnssd_service_t *client;
+	volatile VALUE known;
+	long i;
+
+	GetDNSSDService(service, client);
+	client->replaying = 0;
+	if (client->stopped || client->source->stopped) return;
+
+	known = rb_funcall2(rb_ivar_get(client->source->self, dnssd_id_known),
+											rb_intern("values"), 0, 0);
+	for (i=0; i<RARRAY_LEN(known) && !client->stopped; i++) {
+		dnssd_reply_t *reply;
+		DNSServiceFlags flags;
+		Data_Get_Struct(RARRAY_PTR(known)[i], dnssd_reply_t, reply);
+		/* one burst, for the :batch option */
+		flags = reply->flags & ~kDNSServiceFlagsMoreComing;
+		if (i < RARRAY_LEN(known) - 1) flags |= kDNSServiceFlagsMoreComing;
+		dnssd_share_yield(service, reply, flags);
+	}
 }
 
 /*
  * call-seq:
- *    DNSSD.resolve(service_name, service_type, service_domain, flags=0, interface=DNSSD::InterfaceAny) do |resolve_reply|
- *      block
- *    end => service_handle
+ *    service.to_io => io
  *
- * Resolve a service discovered via DNSSD.browse().
- * The service is resolved to a target host name, port number, and text record - all contained
- * in the DNSSD::ResolveReply object passed to the required block.  
- * The returned _service_handle_ can be used to control when to
- * stop resolving the service (see DNSSD::Service#stop).
+ * The socket _service_ receives its replies on, for services started
+ * with the <code>:reactor</code> option.  Register it with an event loop
+ * and call DNSSD::Service#process when it is readable:
+ *
+ *    service = DNSSD.browse('_http._tcp', :reactor => true) do |browse_reply|
+ *      ...
+ *    end
+ *    monitor = selector.register(service, :r)
+ *    monitor.value = proc { service.process }
+ *
+ * The IO does not own the descriptor, it is closed by DNSSD::Service#stop.
  */
 
 static VALUE
-dnssd_resolve(int argc, VALUE * argv, VALUE self)
+dnssd_service_to_io(VALUE service)
 {
-  VALUE service_name, service_type, service_domain,
-				tmp_flags, interface, block;
+	dnssd_service_t *client;
+	VALUE io;
+	GetDNSSDService(service, client);
+	if (client->stopped) rb_raise(rb_eRuntimeError, "service is stopped");
+	if (!client->queue)
+		rb_raise(rb_eRuntimeError, "service was not started with the :reactor option");
+
+	io = rb_ivar_get(service, dnssd_iv_io);
+	if (NIL_P(io)) {
+		VALUE fd = INT2NUM(DNSServiceRefSockFD(client->client));
+		io = rb_funcall2(rb_cIO, dnssd_id_for_fd, 1, &fd);
+		if (rb_respond_to(io, dnssd_id_autoclose_set)) {
+			VALUE autoclose = Qfalse;
+			rb_funcall2(io, dnssd_id_autoclose_set, 1, &autoclose);
+		}
+		rb_ivar_set(service, dnssd_iv_io, io);
+	}
+	return io;
+}
 
-	const char *name_str, *type_str, *domain_str;
-	DNSServiceFlags flags = 0;
-	uint32_t interface_index = 0;
+static VALUE
+dnssd_service_process_reply(VALUE reply)
+{
+	dnssd_service_dispatch((dnssd_reply_t *)reply);
+	return Qnil;
+}
 
-  DNSServiceErrorType err;
-  DNSServiceRef *client;
-  VALUE service;
+/*
+ * call-seq:
+ *    service.process(max = nil) => integer
+ *    service.process(:max => n) => integer
+ *
+ * Passes the replies _service_ has received to its block, at most _max_
+ * of them, without blocking.  Returns the number of replies processed.
+ * For services started with the <code>:reactor</code> option.
+ *
+ * An exception raised by the block (or an error reply) stops _service_
+ * and is raised by DNSSD::Service#process.
+ */
 
-  rb_scan_args (argc, argv, "32&",
-								&service_name, &service_type, &service_domain,
-								&tmp_flags, &interface, &block);
+static VALUE
+dnssd_service_process(int argc, VALUE *argv, VALUE service)
+{
+	VALUE options, tmp_max;
+	dnssd_service_t *client;
+	long max = -1, count = 0;
 
-	/* required parameters */
-	dnssd_check_block(block);
+	options = dnssd_extract_options(&argc, argv);
+	rb_scan_args(argc, argv, "01", &tmp_max);
+	if (NIL_P(tmp_max))
+		tmp_max = dnssd_option(options, "max");
+	if (!NIL_P(tmp_max))
+		max = NUM2LONG(tmp_max);
+
+	GetDNSSDService(service, client);
+	if (!client->queue)
+		rb_raise(rb_eRuntimeError, "service was not started with the :reactor option");
+
+	while (!client->stopped && (max < 0 || count < max)) {
+		dnssd_reply_t *reply = dnssd_queue_shift(client->queue);
+		int state = 0;
+		if (reply == NULL) {
+			/* reads what the socket has without blocking */
+			dnssd_service_wait(client, 0);
+			reply = dnssd_queue_shift(client->queue);
+			if (reply == NULL) break;
+		}
+		rb_protect(dnssd_service_process_reply, (VALUE)reply, &state);
+		free(reply);
+		count++;
+		if (state) {
+			if (!client->stopped) dnssd_service_stop(service);
+			rb_jump_tag(state);
+		}
+	}
+	return LONG2NUM(count);
+}
+
+static dnssd_service_t *
+dnssd_service_get_ring(VALUE service)
+{
+	dnssd_service_t *client;
+	GetDNSSDService(service, client);
+	if (!client->ring)
+		rb_raise(rb_eRuntimeError, "service was not started with the :buffer option");
+	return client;
+}
+
+static VALUE
+dnssd_service_take_reply(VALUE reply)
+{
+	return dnssd_reply_object((dnssd_reply_t *)reply, ((dnssd_reply_t *)reply)->service->self);
+}
+
+/* The oldest buffered reply of _service_, waiting at most _timeout_
+ * seconds (forever if negative) for one.  Qundef if none arrived or
+ * _service_ was stopped. */
+static VALUE
+dnssd_service_shift(VALUE service, dnssd_service_t *client, double timeout)
+{
+	dnssd_reply_t *reply;
+	VALUE obj, cached = rb_ivar_get(service, dnssd_id_cached);
+	int state = 0;
+
+	/* see dnssd_service_yield(), kept even once _service_ is stopped */
+	if (!NIL_P(cached) && RARRAY_LEN(cached) > 0) return rb_ary_shift(cached);
+	if (client->stopped) return Qundef;
+	if (timeout != 0) dnssd_ring_wait(client, timeout);
+	if (client->stopped || (reply = dnssd_ring_shift(client)) == NULL) return Qundef;
+
+	obj = rb_protect(dnssd_service_take_reply, (VALUE)reply, &state);
+	free(reply);
+	if (state) {
+		if (!client->stopped) dnssd_service_stop(service);
+		rb_jump_tag(state);
+	}
+	return obj;
+}
+
+/*
+ * call-seq:
+ *    service.take(n = 1, :timeout => nil) => [reply, ...]
+ *
+ * Removes at most _n_ replies from the buffer of _service_ and returns
+ * them, oldest first.  Waits until there is at least one, or until
+ * <code>:timeout</code> seconds have passed (forever if +nil+) or
+ * _service_ is stopped, in which case the Array is empty.  For services
+ * started with the <code>:buffer</code> option:
+ *
+ *    browser = DNSSD.browse('_http._tcp', :buffer => 256, :overflow => :coalesce)
+ *    browser.take(16, :timeout => 1).each do |browse_reply|
+ *      ...
+ *    end
+ *
+ * An error reply stops _service_ and is raised.
+ */
+
+static VALUE
+dnssd_service_take(int argc, VALUE *argv, VALUE service)
+{
+	VALUE options, tmp_max, tmp_timeout, replies, obj;
+	dnssd_service_t *client;
+	double timeout = -1;
+	long max = 1;
+
+	options = dnssd_extract_options(&argc, argv);
+	rb_scan_args(argc, argv, "01", &tmp_max);
+	if (!NIL_P(tmp_max))
+		max = NUM2LONG(tmp_max);
+	tmp_timeout = dnssd_option(options, "timeout");
+	if (!NIL_P(tmp_timeout)) {
+		timeout = NUM2DBL(tmp_timeout);
+		if (timeout < 0) timeout = 0;
+	}
+	client = dnssd_service_get_ring(service);
+
+	replies = rb_ary_new();
+	if (max < 1) return replies;
+	obj = dnssd_service_shift(service, client, timeout);
+	while (obj != Qundef) {
+		rb_ary_push(replies, obj);
+		if (RARRAY_LEN(replies) >= max) break;
+		obj = dnssd_service_shift(service, client, 0);
+	}
+	return replies;
+}
+
+/*
+ * call-seq:
+ *    service.each { |reply| block } => service
+ *    service.each => enumerator
+ *
+ * Takes the replies buffered by _service_ one at a time (see
+ * DNSSD::Service#take) and passes them to the block, until _service_
+ * is stopped.
+ */
+
+static VALUE
+dnssd_service_each(VALUE service)
+{
+	dnssd_service_t *client;
+	VALUE obj;
+#ifdef RETURN_ENUMERATOR
+	RETURN_ENUMERATOR(service, 0, 0);
+#endif
+	client = dnssd_service_get_ring(service);
+	while ((obj = dnssd_service_shift(service, client, -1)) != Qundef)
+		rb_yield(obj);
+	return service;
+}
+
+/*
+ * call-seq:
+ *    service.buffered => integer
+ *
+ * The number of replies waiting in the buffer of _service_.
+ */
+
+static VALUE
+dnssd_service_buffered(VALUE service)
+{
+	dnssd_service_t *client = dnssd_service_get_ring(service);
+	VALUE cached = rb_ivar_get(service, dnssd_id_cached);
+	long count;
+	dnssd_loop_lock(client->loop);
+	count = client->ring->count;
+	dnssd_loop_unlock(client->loop);
+	if (!NIL_P(cached)) count += RARRAY_LEN(cached);
+	return LONG2NUM(count);
+}
+
+/*
+ * call-seq:
+ *    service.overflows => {:dropped => n, :coalesced => n, :paused => n}
+ *
+ * How often the buffer of _service_ was full: the replies dropped to
+ * make room for newer ones, the replies replaced by a newer reply about
+ * the same name (<code>:overflow => :coalesce</code>), and the times
+ * reading stopped until there was room (<code>:overflow => :block</code>).
+ */
+
+static VALUE
+dnssd_service_overflows(VALUE service)
+{
+	dnssd_service_t *client = dnssd_service_get_ring(service);
+	unsigned long dropped, coalesced, pauses;
+	VALUE hash = rb_hash_new();
+
+	dnssd_loop_lock(client->loop);
+	dropped = client->ring->dropped;
+	coalesced = client->ring->coalesced;
+	pauses = client->ring->pauses;
+	dnssd_loop_unlock(client->loop);
+
+	rb_hash_aset(hash, ID2SYM(rb_intern("dropped")), ULONG2NUM(dropped));
+	rb_hash_aset(hash, ID2SYM(rb_intern("coalesced")), ULONG2NUM(coalesced));
+	rb_hash_aset(hash, ID2SYM(rb_intern("paused")), ULONG2NUM(pauses));
+	return hash;
+}
+
+/* reply callbacks, see dnssd_reply_t and rdnssd_loop.c */
+
+/* false if the filter of the service _context_ drops the reply */
+static int
+dnssd_reply_wanted(void *context, int type, DNSServiceFlags flags, uint32_t interface,
+									 const char *name, uint16_t txt_len, const char *txt_rec)
+{
+	dnssd_service_t *client = (dnssd_service_t *)context;
+	dnssd_reply_t *reply;
+
+	if (client->filter == NULL ||
+			dnssd_filter_match(client->filter, type, flags, interface, name, txt_len, txt_rec))
+		return 1;
+	/* a burst may end on a dropped reply, the replies held back are due */
+	if (!(flags & kDNSServiceFlagsMoreComing) && !NIL_P(client->batch)) {
+		reply = dnssd_reply_alloc(context, DNSSD_REPLY_FILTERED, 0);
+		if (reply) reply->flags = flags;
+		dnssd_loop_enqueue(reply);
+	}
+	return 0;
+}
+
+static void DNSSD_API
+dnssd_browse_reply (DNSServiceRef client, DNSServiceFlags flags,
+										uint32_t interface_index, DNSServiceErrorType errorCode,
+							      const char *replyName, const char *replyType,
+										const char *replyDomain, void *context)
+{
+	dnssd_reply_t *reply;
+	size_t name_len, type_len, domain_len;
+	/* other parameters are undefined if errorCode != 0 */
+	if (errorCode) {
+		reply = dnssd_reply_alloc(context, DNSSD_REPLY_ERROR, 0);
+		if (reply) reply->error = errorCode;
+		dnssd_loop_enqueue(reply);
+		return;
+	}
+
+	if (!dnssd_reply_wanted(context, DNSSD_REPLY_BROWSE, flags, interface_index,
+													replyName, 0, NULL))
+		return;
+
+	name_len = strlen(replyName) + 1;
+	type_len = strlen(replyType) + 1;
+	domain_len = strlen(replyDomain) + 1;
+	reply = dnssd_reply_alloc(context, DNSSD_REPLY_BROWSE,
+														name_len + type_len + domain_len);
+	if (reply) {
+		reply->flags = flags;
+		reply->interface = interface_index;
+		reply->name = dnssd_reply_copy(reply, replyName, name_len);
+		reply->regtype = dnssd_reply_copy(reply, replyType, type_len);
+		reply->domain = dnssd_reply_copy(reply, replyDomain, domain_len);
+	}
+	dnssd_loop_enqueue(reply);
+}
+
+static VALUE
+dnssd_do_browse (VALUE connection, int argc, VALUE * argv)
+{
+  VALUE service_type, domain, tmp_flags, interface, block, options;
+	
+	const char *type_str;
+	const char *domain_str = NULL;
+	DNSServiceFlags flags = 0;
+	uint32_t interface_index = 0;
+
+  DNSServiceErrorType e;
+	dnssd_service_t *client;
+  VALUE service, key, subscriber = Qnil;
+
+	options = dnssd_extract_options(&argc, argv);
+  rb_scan_args (argc, argv, "13&", &service_type, &domain,
+								&tmp_flags, &interface, &block);
+
+	/* required */
+	dnssd_check_block_or_buffer(block, options);
+	type_str = StringValueCStr(service_type);
+
+	/* optional parameters */
+  if (domain != Qnil)
+		domain_str = dnssd_get_domain(domain);
+	if (tmp_flags != Qnil)
+		flags = dnssd_to_flags(tmp_flags);
+	if (interface != Qnil)
+		interface_index = dnssd_get_interface_index(interface);
+
+	key = dnssd_share_key(connection, options, "browse", NULL,
+												type_str, domain_str, flags, interface_index);
+	if (!NIL_P(key)) {
+		subscriber = dnssd_share_find(connection, key, block, options);
+		if (!NIL_P(subscriber)) return subscriber;
+	}
+	
+	/* allocate this last since all other parameters are on the stack (thanks to & unary operator) */
+	service = dnssd_service_alloc(cDNSSDService, block);
+	GetDNSSDService(service, client);
+	dnssd_service_options(service, options);
+	if (!NIL_P(key))
+		subscriber = dnssd_share_init(service, key, block, options);
+	flags = dnssd_service_share(service, connection, flags);
+	
+  e = DNSServiceBrowse (&client->client, flags, interface_index,
+												type_str, domain_str,
+												dnssd_browse_reply, (void *)client);
+	dnssd_service_start(service, e, "browse", type_str);
+	if (!NIL_P(key)) {
+		rb_hash_aset(dnssd_loop_current()->shares, key, service);
+		return subscriber;
+	}
+  return service;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.browse(service_type, domain=nil, flags=0, interface=DNSSD::InterfaceAny) do |browse_reply|
+ *      block
+ *    end => service_handle
+ *    DNSSD.browse(service_type, ..., :batch => true) do |browse_replies|
+ *      block
+ *    end => service_handle
+ *
+ * Browse for DNSSD services.
+ * For each service found DNSSD::BrowseReply object is passed to block.
+ * The returned _service_handle_ can be used to control when to
+ * stop browsing for services (see DNSSD::Service#stop).
+ *
+ * With the <code>:batch</code> option the replies the daemon delivers
+ * in one burst (see DNSSD::Flags::MoreComing) are collected and passed
+ * to the block as an Array once the burst is over.
+ *
+ * With the <code>:reactor</code> option no thread reads the replies,
+ * the caller's event loop does: it watches DNSSD::Service#to_io and
+ * calls DNSSD::Service#process when it is readable.
+ *
+ * The <code>:name</code> (a glob like <code>"Printer*"</code>),
+ * <code>:prefix</code>, <code>:interfaces</code> and <code>:only</code>
+ * (<code>:add</code> or <code>:remove</code>) options drop unwanted
+ * replies before any ruby object is made for them:
+ *
+ *    DNSSD.browse('_http._tcp', :prefix => "build-", :interfaces => %w(eth0)) do |browse_reply|
+ *      ...
+ *    end
+ *
+ * DNSSD.resolve() takes <code>:interfaces</code> and <code>:text</code>,
+ * a Hash of text record keys and the values they must have
+ * (+true+ for any value, +nil+ for no such key), DNSSD.query_record()
+ * <code>:interfaces</code> and <code>:only</code>.
+ *
+ * With <code>:buffer => n</code> no block is given, the replies wait in
+ * a buffer of _n_ replies until taken with DNSSD::Service#take or
+ * DNSSD::Service#each.  When the buffer is full the
+ * <code>:overflow</code> option decides: <code>:drop_oldest</code> (the
+ * default) drops the oldest reply, <code>:coalesce</code> replaces the
+ * newest reply about the same name, if any, and <code>:block</code>
+ * leaves the replies to the daemon until there is room, which a daemon
+ * may answer by dropping the connection.  See DNSSD::Service#overflows.
+ *
+ * With <code>:share => true</code> a browse like one still running
+ * subscribes to it, see DNSSD.share_subscriptions=.
+ *
+ */
+
+static VALUE
+dnssd_browse (int argc, VALUE * argv, VALUE self)
+{
+	return dnssd_do_browse(dnssd_loop_current()->connection, argc, argv);
+}
+
+static void DNSSD_API
+dnssd_register_reply (DNSServiceRef client, DNSServiceFlags flags,
+											DNSServiceErrorType errorCode,
+											const char *name, const char *regtype,
+											const char *domain, void *context)
+{
+	dnssd_reply_t *reply;
+	size_t name_len, type_len, domain_len;
+	/* other parameters are undefined if errorCode != 0 */
+	if (errorCode) {
+		reply = dnssd_reply_alloc(context, DNSSD_REPLY_ERROR, 0);
+		if (reply) reply->error = errorCode;
+		dnssd_loop_enqueue(reply);
+		return;
+	}
+
+	name_len = strlen(name) + 1;
+	type_len = strlen(regtype) + 1;
+	domain_len = strlen(domain) + 1;
+	reply = dnssd_reply_alloc(context, DNSSD_REPLY_REGISTER,
+														name_len + type_len + domain_len);
+	if (reply) {
+		reply->flags = flags;
+		reply->name = dnssd_reply_copy(reply, name, name_len);
+		reply->regtype = dnssd_reply_copy(reply, regtype, type_len);
+		reply->domain = dnssd_reply_copy(reply, domain, domain_len);
+	}
+	dnssd_loop_enqueue(reply);
+}
+
+static VALUE
+dnssd_do_register (VALUE connection, int argc, VALUE * argv)
+{
+  VALUE service_name, service_type, service_domain, service_port,
+				text_record, tmp_flags, interface, block, options;
+
+	const char *name_str, *type_str, *domain_str = NULL;
+	uint16_t opaqueport;
+	uint16_t txt_len = 0;
+	char *txt_rec = NULL;
+	DNSServiceFlags flags = 0;
+	uint32_t interface_index = 0;
+
+  DNSServiceErrorType e;
+  dnssd_service_t *client;
+  VALUE service;
+
+	options = dnssd_extract_options(&argc, argv);
+  rb_scan_args (argc, argv, "43&",
+								&service_name, &service_type,
+								&service_domain, &service_port,
+								&text_record, &tmp_flags,
+								&interface, &block);
+
+	/* required parameters */
+	dnssd_check_block(block); /* in the future this may not be required */
+	name_str = StringValueCStr(service_name);
+	type_str = StringValueCStr(service_type);
+
+	if (service_domain != Qnil)
+		domain_str = dnssd_get_domain(service_domain);
+	/* convert from host to net byte order */
+	opaqueport = htons((uint16_t)NUM2UINT(service_port));
+
+	/* optional parameters */
+	if (text_record != Qnil) {
+		text_record = dnssd_tr_to_encoded_str(text_record);
+		txt_rec = RSTRING_PTR(text_record);
+		txt_len = RSTRING_LEN(text_record);
+	}
+	if (tmp_flags != Qnil)
+		flags = dnssd_to_flags(tmp_flags);
+  if(interface != Qnil)
+		interface_index = dnssd_get_interface_index(interface);
+
+	/* allocate this last since all other parameters are on the stack (thanks to & unary operator) */
+	service = dnssd_service_alloc(cDNSSDService, block);
+  GetDNSSDService(service, client);
+	client->is_registration = 1;
+	dnssd_service_options(service, options);
+	flags = dnssd_service_share(service, connection, flags);
+
+  e = DNSServiceRegister( &client->client, flags, interface_index,
+													name_str, type_str, domain_str,
+													NULL, opaqueport, txt_len, txt_rec,
+													/*block == Qnil ? NULL : dnssd_register_reply,*/
+													dnssd_register_reply, (void*)client );
+  dnssd_service_start(service, e, "register", name_str);
+  return service;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.register(service_name, service_type, service_domain, service_port, text_record=nil, flags=0, interface=DNSSD::InterfaceAny) do |register_reply|
+ *      block
+ *    end => service_handle
+ *
+ * Register a service.
+ * If a block is provided a DNSSD::RegisterReply object will passed to the block
+ * when the registration completes or asynchronously fails.
+ * If no block is passed the client will not be notified of the default values picked
+ * on its behalf or of any error that occur.
+ * The returned _service_handle_ can be used to control when to
+ * stop the service (see DNSSD::Service#stop).
+ *
+ * Takes a trailing options Hash, see DNSSD.browse() for the <code>:reactor</code> option.
+ */
+
+static VALUE
+dnssd_register (int argc, VALUE * argv, VALUE self)
+{
+	return dnssd_do_register(dnssd_loop_current()->connection, argc, argv);
+}
+
+/*
+ * call-seq:
+ *    service.text_record = text_record
+ *
+ * Replaces the primary TXT record of the registered service _service_
+ * (see DNSSD.register()) with _text_record_, a DNSSD::TextRecord, Hash
+ * or <code>nil</code> for an empty one.  The record is updated in place,
+ * the service is not probed or re-announced as a stop and register would.
+ */
+
+static VALUE
+dnssd_service_set_text_record(VALUE service, VALUE text_record)
+{
+	dnssd_service_t *client;
+	DNSServiceErrorType e;
+	volatile VALUE encoded = Qnil;
+	const char *txt_rec = NULL;
+	uint16_t txt_len = 0;
+
+	GetDNSSDService(service, client);
+	if (client->stopped) rb_raise(rb_eRuntimeError, "service is stopped");
+	if (!client->is_registration)
+		rb_raise(rb_eRuntimeError, "only a registered service has a text record");
+
+	if (text_record != Qnil) {
+		encoded = dnssd_tr_to_encoded_str(text_record);
+		txt_rec = RSTRING_PTR(encoded);
+		txt_len = RSTRING_LEN(encoded);
+	}
+	/* the event loop may be reading replies from the ref without the GVL */
+	dnssd_loop_lock(client->loop);
+	e = DNSServiceUpdateRecord(client->client, NULL, 0, txt_len, txt_rec, 0);
+	dnssd_loop_unlock(client->loop);
+	dnssd_check_error_code(e);
+	return text_record;
+}
+
+static void DNSSD_API
+dnssd_resolve_reply (DNSServiceRef client, DNSServiceFlags flags,
+										 uint32_t interface_index, DNSServiceErrorType errorCode,
+										 const char *fullname, const char *host_target,
+										 uint16_t opaqueport, uint16_t txt_len,
+										 const char *txt_rec, void *context)
+{
+	dnssd_reply_t *reply;
+	size_t fullname_len, target_len;
+	/* other parameters are undefined if errorCode != 0 */
+	if (errorCode) {
+		reply = dnssd_reply_alloc(context, DNSSD_REPLY_ERROR, 0);
+		if (reply) reply->error = errorCode;
+		dnssd_loop_enqueue(reply);
+		return;
+	}
+
+	if (!dnssd_reply_wanted(context, DNSSD_REPLY_RESOLVE, flags, interface_index,
+													NULL, txt_len, txt_rec))
+		return;
+
+	fullname_len = strlen(fullname) + 1;
+	target_len = strlen(host_target) + 1;
+	reply = dnssd_reply_alloc(context, DNSSD_REPLY_RESOLVE,
+														fullname_len + target_len + txt_len);
+	if (reply) {
+		reply->flags = flags;
+		reply->interface = interface_index;
+		reply->fullname = dnssd_reply_copy(reply, fullname, fullname_len);
+		reply->target = dnssd_reply_copy(reply, host_target, target_len);
+		reply->opaqueport = opaqueport;
+		reply->txt_len = txt_len;
+		reply->txt_rec = dnssd_reply_copy(reply, txt_rec, txt_len);
+	}
+	dnssd_loop_enqueue(reply);
+}
+
+static VALUE
+dnssd_do_resolve(VALUE connection, int argc, VALUE * argv)
+{
+  VALUE service_name, service_type, service_domain,
+				tmp_flags, interface, block, options;
+
+	const char *name_str, *type_str, *domain_str;
+	DNSServiceFlags flags = 0;
+	uint32_t interface_index = 0;
+
+  DNSServiceErrorType err;
+  dnssd_service_t *client;
+  VALUE service, cached, key, subscriber = Qnil;
+
+	options = dnssd_extract_options(&argc, argv);
+  rb_scan_args (argc, argv, "32&",
+								&service_name, &service_type, &service_domain,
+								&tmp_flags, &interface, &block);
+
+	/* required parameters */
+	dnssd_check_block_or_buffer(block, options);
 	name_str = StringValueCStr(service_name),
 	type_str = StringValueCStr(service_type),
 	domain_str = dnssd_get_domain(service_domain);
@@ -471,19 +1469,1441 @@ dnssd_resolve(int argc, VALUE * argv, VALUE self)
 	/* optional parameters */
 	if (tmp_flags != Qnil)
 		flags = dnssd_to_flags(tmp_flags);
-	if (interface != Qnil) {
+	if (interface != Qnil) {
+		interface_index = dnssd_get_interface_index(interface);
+	}
+
+	if (RTEST(dnssd_option(options, "cache")) && !dnssd_filter_given(options)) {
+		cached = dnssd_cache_lookup(name_str, type_str, domain_str, interface_index);
+		if (!NIL_P(cached)) {
+			/* no resolve is started, the handle is stopped before the
+			 * reply is passed on as the block may drop it */
+			service = dnssd_service_alloc(cDNSSDService, block);
+			GetDNSSDService(service, client);
+			dnssd_service_options(service, options);
+			client->operation = "resolve";
+			client->stopped = 1;
+			dnssd_service_yield(service, cached, 0);
+			rb_ivar_set(service, dnssd_iv_block, Qnil);
+			client->batch = Qnil;
+			return service;
+		}
+	}
+
+	key = dnssd_share_key(connection, options, "resolve", name_str,
+												type_str, domain_str, flags, interface_index);
+	if (!NIL_P(key)) {
+		subscriber = dnssd_share_find(connection, key, block, options);
+		if (!NIL_P(subscriber)) return subscriber;
+	}
+
+	/* allocate this last since all other parameters are on the stack (thanks to unary & operator) */
+	service = dnssd_service_alloc(cDNSSDService, block);
+  GetDNSSDService(service, client);
+	dnssd_service_options(service, options);
+	if (!NIL_P(key))
+		subscriber = dnssd_share_init(service, key, block, options);
+	flags = dnssd_service_share(service, connection, flags);
+
+  err = DNSServiceResolve (&client->client, flags, interface_index, name_str, type_str,
+													 domain_str, dnssd_resolve_reply, (void *) client);
+	dnssd_service_start(service, err, "resolve", name_str);
+	if (!NIL_P(key)) {
+		rb_hash_aset(dnssd_loop_current()->shares, key, service);
+		return subscriber;
+	}
+  return service;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.resolve(service_name, service_type, service_domain, flags=0, interface=DNSSD::InterfaceAny) do |resolve_reply|
+ *      block
+ *    end => service_handle
+ *
+ * Resolve a service discovered via DNSSD.browse().
+ * The service is resolved to a target host name, port number, and text record - all contained
+ * in the DNSSD::ResolveReply object passed to the required block.  
+ * The returned _service_handle_ can be used to control when to
+ * stop resolving the service (see DNSSD::Service#stop).
+ *
+ * Takes a trailing options Hash, see DNSSD.browse() for the <code>:batch</code>
+ * and <code>:buffer</code> options and the reply filters.
+ * With <code>:cache => true</code> a reply kept by DNSSD::ResolveCache is
+ * passed on (to the block, as a batch of one or to the buffer) before
+ * DNSSD.resolve() returns, no resolve is started and the returned
+ * _service_handle_ is already stopped.  <code>:share</code> works as for DNSSD.browse().
+ */
+
+static VALUE
+dnssd_resolve(int argc, VALUE * argv, VALUE self)
+{
+	return dnssd_do_resolve(dnssd_loop_current()->connection, argc, argv);
+}
+
+static void DNSSD_API
+dnssd_query_record_reply (DNSServiceRef client, DNSServiceFlags flags,
+													uint32_t interface_index, DNSServiceErrorType errorCode,
+													const char *fullname, uint16_t rrtype, uint16_t rrclass,
+													uint16_t rdlen, const void *rdata, uint32_t ttl,
+													void *context)
+{
+	dnssd_reply_t *reply;
+	size_t fullname_len;
+	/* other parameters are undefined if errorCode != 0 */
+	if (errorCode) {
+		reply = dnssd_reply_alloc(context, DNSSD_REPLY_ERROR, 0);
+		if (reply) reply->error = errorCode;
+		dnssd_loop_enqueue(reply);
+		return;
+	}
+
+	if (!dnssd_reply_wanted(context, DNSSD_REPLY_RECORD, flags, interface_index,
+													NULL, 0, NULL))
+		return;
+
+	fullname_len = strlen(fullname) + 1;
+	reply = dnssd_reply_alloc(context, DNSSD_REPLY_RECORD, fullname_len + rdlen);
+	if (reply) {
+		reply->flags = flags;
+		reply->interface = interface_index;
+		reply->fullname = dnssd_reply_copy(reply, fullname, fullname_len);
+		reply->rrtype = rrtype;
+		reply->rrclass = rrclass;
+		reply->rdlen = rdlen;
+		reply->rdata = dnssd_reply_copy(reply, (const char *)rdata, rdlen);
+		reply->ttl = ttl;
+	}
+	dnssd_loop_enqueue(reply);
+}
+
+static VALUE
+dnssd_do_query_record(VALUE connection, int argc, VALUE * argv)
+{
+	VALUE fullname, tmp_rrtype, tmp_rrclass,
+				tmp_flags, interface, block, options;
+
+	const char *fullname_str;
+	uint16_t rrtype, rrclass = 1; /* IN */
+	DNSServiceFlags flags = 0;
+	uint32_t interface_index = 0;
+
+	DNSServiceErrorType err;
+	dnssd_service_t *client;
+	VALUE service;
+
+	options = dnssd_extract_options(&argc, argv);
+	rb_scan_args (argc, argv, "23&",
+								&fullname, &tmp_rrtype, &tmp_rrclass,
+								&tmp_flags, &interface, &block);
+
+	/* required parameters */
+	dnssd_check_block_or_buffer(block, options);
+	fullname_str = StringValueCStr(fullname);
+	rrtype = dnssd_to_rrtype(tmp_rrtype);
+
+	/* optional parameters */
+	if (tmp_rrclass != Qnil)
+		rrclass = (uint16_t)NUM2UINT(tmp_rrclass);
+	if (tmp_flags != Qnil)
+		flags = dnssd_to_flags(tmp_flags);
+	if (interface != Qnil)
+		interface_index = dnssd_get_interface_index(interface);
+
+	/* allocate this last since all other parameters are on the stack (thanks to unary & operator) */
+	service = dnssd_service_alloc(cDNSSDService, block);
+	GetDNSSDService(service, client);
+	dnssd_service_options(service, options);
+	flags = dnssd_service_share(service, connection, flags);
+
+	err = DNSServiceQueryRecord (&client->client, flags, interface_index,
+															 fullname_str, rrtype, rrclass,
+															 dnssd_query_record_reply, (void *) client);
+	dnssd_service_start(service, err, "query_record", fullname_str);
+	return service;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.query_record(fullname, rrtype, rrclass=DNSSD::RecordReply::IN, flags=0, interface=DNSSD::InterfaceAny) do |record_reply|
+ *      block
+ *    end => service_handle
+ *
+ * Query for the resource records of type _rrtype_ (an Integer or a
+ * type name such as <code>:AAAA</code>) named _fullname_, e.g. the
+ * address of a host found with DNSSD.resolve():
+ *
+ *    DNSSD.query_record(resolve_reply.target, :A) do |record_reply|
+ *      puts record_reply.value # => "192.168.1.2"
+ *    end
+ *
+ * For each record found a DNSSD::RecordReply is passed to the block.
+ * The returned _service_handle_ can be used to control when to
+ * stop querying (see DNSSD::Service#stop).
+ *
+ * Takes a trailing options Hash, see DNSSD.browse() for the <code>:batch</code>
+ * and <code>:buffer</code> options and the reply filters.
+ */
+
+static VALUE
+dnssd_query_record(int argc, VALUE * argv, VALUE self)
+{
+	return dnssd_do_query_record(dnssd_loop_current()->connection, argc, argv);
+}
+
+/*
+ * DNSSD.resolve_addresses() is a pipeline on one connection: the
+ * resolve's reply starts a lookup of its target's addresses, whose
+ * replies are passed to the block as socket addresses with the port
+ * already filled in.  The stages are services whose replies go to a
+ * C function (the service's stage) instead of a block, so no reply
+ * object is made before the last stage.  The lookup uses
+ * DNSServiceGetAddrInfo() where the daemon has it, A and AAAA record
+ * queries otherwise, either way its replies arrive as records.
+ */
+
+/* an instance found by DNSSD.browse_and_resolve() */
+typedef struct dnssd_instance dnssd_instance_t;
+
+typedef struct {
+	dnssd_instance_t *head;
+	dnssd_instance_t *tail;
+	long count;
+} dnssd_instance_list_t;
+
+struct dnssd_pipeline {
+	/* DNSSD.resolve_addresses() */
+	uint16_t port;	/* of the resolved service, network byte order */
+	int socktype;
+	int protocol;
+	/* DNSSD.browse_and_resolve() */
+	long limit;
+	double timeout;
+	/* key => dnssd_instance_t, every instance queued or being resolved */
+	st_table *instances;
+	dnssd_instance_list_t queued;	/* in the order they were added */
+	dnssd_instance_list_t resolving;	/* in the order the resolves started */
+	int timed;	/* the loop has a deadline, see dnssd_service_expire() */
+};
+
+static VALUE dnssd_connection_stop(VALUE self);
+
+static dnssd_pipeline_t *
+dnssd_pipeline_new(void)
+{
+	dnssd_pipeline_t *pipeline = ALLOC(dnssd_pipeline_t);
+	MEMZERO(pipeline, dnssd_pipeline_t, 1);
+	return pipeline;
+}
+
+#ifdef HAVE_DNSSERVICEGETADDRINFO
+static void DNSSD_API
+dnssd_addrinfo_reply (DNSServiceRef client, DNSServiceFlags flags,
+											uint32_t interface_index, DNSServiceErrorType errorCode,
+											const char *hostname, const struct sockaddr *address,
+											uint32_t ttl, void *context)
+{
+	dnssd_reply_t *reply;
+	size_t hostname_len;
+	const void *addr;
+	uint16_t rrtype, rdlen;
+	/* other parameters are undefined if errorCode != 0 */
+	if (errorCode) {
+		reply = dnssd_reply_alloc(context, DNSSD_REPLY_ERROR, 0);
+		if (reply) reply->error = errorCode;
+		dnssd_loop_enqueue(reply);
+		return;
+	}
+
+	/* passed on as the rdata of an A or AAAA record */
+	if (address->sa_family == AF_INET) {
+		addr = &((const struct sockaddr_in *)address)->sin_addr;
+		rrtype = DNSSD_RR_A;
+		rdlen = 4;
+	} else if (address->sa_family == AF_INET6) {
+		addr = &((const struct sockaddr_in6 *)address)->sin6_addr;
+		rrtype = DNSSD_RR_AAAA;
+		rdlen = 16;
+	} else {
+		return;
+	}
+
+	hostname_len = strlen(hostname) + 1;
+	reply = dnssd_reply_alloc(context, DNSSD_REPLY_RECORD, hostname_len + rdlen);
+	if (reply) {
+		reply->flags = flags;
+		reply->interface = interface_index;
+		reply->fullname = dnssd_reply_copy(reply, hostname, hostname_len);
+		reply->rrtype = rrtype;
+		reply->rrclass = DNSSD_RR_CLASS_IN;
+		reply->rdlen = rdlen;
+		reply->rdata = dnssd_reply_copy(reply, (const char *)addr, rdlen);
+		reply->ttl = ttl;
+	}
+	dnssd_loop_enqueue(reply);
+}
+#endif
+
+/* the last stage, passes the address to the connection's block */
+static void
+dnssd_addresses_record_stage(dnssd_reply_t *reply)
+{
+	VALUE connection = reply->service->connection->self;
+	dnssd_pipeline_t *pipeline = reply->service->connection->pipeline;
+	VALUE obj, block;
+	int family;
+
+	if (!(reply->flags & kDNSServiceFlagsAdd))
+		return; /* address removed */
+
+	switch (reply->rrtype) {
+	case DNSSD_RR_A: {
+		struct sockaddr_in sin;
+		if (reply->rdlen != 4) return;
+		MEMZERO(&sin, struct sockaddr_in, 1);
+		sin.sin_family = family = AF_INET;
+		sin.sin_port = pipeline->port;
+		memcpy(&sin.sin_addr, reply->rdata, 4);
+		obj = rb_str_new((const char *)&sin, sizeof(sin));
+		break;
+	}
+	case DNSSD_RR_AAAA: {
+		struct sockaddr_in6 sin6;
+		if (reply->rdlen != 16) return;
+		MEMZERO(&sin6, struct sockaddr_in6, 1);
+		sin6.sin6_family = family = AF_INET6;
+		sin6.sin6_port = pipeline->port;
+		memcpy(&sin6.sin6_addr, reply->rdata, 16);
+		/* link-local addresses are only usable on the interface they were found on */
+		if (IN6_IS_ADDR_LINKLOCAL(&sin6.sin6_addr))
+			sin6.sin6_scope_id = reply->interface;
+		obj = rb_str_new((const char *)&sin6, sizeof(sin6));
+		break;
+	}
+	default:
+		return;
+	}
+
+	/* a packed sockaddr for rubies without Addrinfo */
+	if (rb_const_defined(rb_cObject, dnssd_id_addrinfo)) {
+		VALUE args[4];
+		args[0] = obj;
+		args[1] = INT2FIX(family);
+		args[2] = INT2FIX(pipeline->socktype);
+		args[3] = INT2FIX(pipeline->protocol);
+		obj = rb_class_new_instance(4, args, rb_const_get(rb_cObject, dnssd_id_addrinfo));
+	}
+	block = dnssd_service_get_block(connection);
+	if (!NIL_P(block))
+		rb_funcall2(block, dnssd_id_call, 1, &obj);
+}
+
+typedef struct {
+	VALUE connection;
+	const char *hostname;
+	uint32_t interface_index;
+} dnssd_lookup_args_t;
+
+/* starts one lookup service on the connection */
+static void
+dnssd_addresses_lookup_start(dnssd_lookup_args_t *args, uint16_t rrtype)
+{
+	dnssd_service_t *client;
+	DNSServiceFlags flags;
+	DNSServiceErrorType e;
+	VALUE service = dnssd_service_alloc(cDNSSDService, Qnil);
+	GetDNSSDService(service, client);
+	client->stage = dnssd_addresses_record_stage;
+	flags = dnssd_service_share(service, args->connection, 0);
+#ifdef HAVE_DNSSERVICEGETADDRINFO
+	e = DNSServiceGetAddrInfo(&client->client, flags, args->interface_index, 0,
+														args->hostname, dnssd_addrinfo_reply, (void *)client);
+#else
+	e = DNSServiceQueryRecord(&client->client, flags, args->interface_index,
+														args->hostname, rrtype, DNSSD_RR_CLASS_IN,
+														dnssd_query_record_reply, (void *)client);
+#endif
+	dnssd_service_start(service, e, "resolve_addresses", args->hostname);
+}
+
+/* starts the lookup stage on the connection */
+static VALUE
+dnssd_addresses_lookup(VALUE arg)
+{
+	dnssd_lookup_args_t *args = (dnssd_lookup_args_t *)arg;
+	dnssd_addresses_lookup_start(args, DNSSD_RR_A);
+#ifndef HAVE_DNSSERVICEGETADDRINFO
+	dnssd_addresses_lookup_start(args, DNSSD_RR_AAAA);
+#endif
+	return Qnil;
+}
+
+/* the resolve stage */
+static void
+dnssd_addresses_resolve_stage(dnssd_reply_t *reply)
+{
+	dnssd_service_t *conn = reply->service->connection;
+	dnssd_lookup_args_t args;
+	int state = 0;
+
+	/* the first reply is enough */
+	if (!reply->service->stopped)
+		dnssd_service_stop(reply->service->self);
+
+	conn->pipeline->port = reply->opaqueport;
+	args.connection = conn->self;
+	args.hostname = reply->target;
+	args.interface_index = reply->interface;
+	rb_protect(dnssd_addresses_lookup, (VALUE)&args, &state);
+	if (state) {
+		/* nothing left to do */
+		dnssd_connection_stop(args.connection);
+		rb_jump_tag(state);
+	}
+}
+
+typedef struct {
+	VALUE connection;
+	VALUE block;
+	void (*stage)(dnssd_reply_t *reply);
+	void *stage_data;
+	DNSServiceFlags flags;
+	uint32_t interface_index;
+	const char *name;
+	const char *type;
+	const char *domain;
+} dnssd_resolve_args_t;
+
+/* starts a resolve on args->connection, returns its service */
+static VALUE
+dnssd_start_resolve(VALUE arg)
+{
+	dnssd_resolve_args_t *args = (dnssd_resolve_args_t *)arg;
+	dnssd_service_t *client;
+	DNSServiceFlags flags;
+	DNSServiceErrorType e;
+	VALUE service = dnssd_service_alloc(cDNSSDService, args->block);
+	GetDNSSDService(service, client);
+	client->stage = args->stage;
+	client->stage_data = args->stage_data;
+	flags = dnssd_service_share(service, args->connection, args->flags);
+	e = DNSServiceResolve(&client->client, flags, args->interface_index,
+												args->name, args->type, args->domain,
+												dnssd_resolve_reply, (void *)client);
+	dnssd_service_start(service, e, "resolve", args->name);
+	return service;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.resolve_addresses(service_name, service_type, service_domain, flags=0, interface=DNSSD::InterfaceAny) do |addrinfo|
+ *      block
+ *    end => connection
+ *
+ * Resolves a service discovered via DNSSD.browse() and looks up the
+ * addresses of its target host, as one pipelined operation on one
+ * connection to the daemon.  Each IPv4 or IPv6 address is passed to
+ * the block as it arrives, as an Addrinfo (a packed sockaddr String on
+ * rubies without Addrinfo) that has the service's port filled in and
+ * is ready to connect to:
+ *
+ *    DNSSD.resolve_addresses("foo bar", "_http._tcp", "local") do |addrinfo|
+ *      socket = addrinfo.connect
+ *      ...
+ *    end
+ *
+ * Returns the DNSSD::Connection running the resolve and the lookup,
+ * stop it to stop them (see DNSSD::Connection#stop).
+ */
+
+static VALUE
+dnssd_resolve_addresses(int argc, VALUE * argv, VALUE self)
+{
+	VALUE service_name, service_type, service_domain,
+				tmp_flags, interface, block;
+	dnssd_resolve_args_t args;
+	dnssd_service_t *conn;
+	int udp, state = 0;
+
+	rb_scan_args (argc, argv, "32&",
+								&service_name, &service_type, &service_domain,
+								&tmp_flags, &interface, &block);
+
+	/* required parameters */
+	dnssd_check_block(block);
+	args.name = StringValueCStr(service_name);
+	args.type = StringValueCStr(service_type);
+	args.domain = dnssd_get_domain(service_domain);
+
+	/* optional parameters */
+	args.flags = 0;
+	args.interface_index = 0;
+	if (tmp_flags != Qnil)
+		args.flags = dnssd_to_flags(tmp_flags);
+	if (interface != Qnil)
+		args.interface_index = dnssd_get_interface_index(interface);
+
+	udp = strstr(args.type, "._udp") != NULL;
+	args.connection = dnssd_connection_new(cDNSSDConnection);
+	rb_ivar_set(args.connection, dnssd_iv_block, block);
+	GetDNSSDService(args.connection, conn);
+	conn->pipeline = dnssd_pipeline_new();
+	conn->pipeline->socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+	conn->pipeline->protocol = udp ? IPPROTO_UDP : IPPROTO_TCP;
+	args.block = Qnil;
+	args.stage = dnssd_addresses_resolve_stage;
+	args.stage_data = NULL;
+	rb_protect(dnssd_start_resolve, (VALUE)&args, &state);
+	if (state) {
+		dnssd_connection_stop(args.connection);
+		rb_jump_tag(state);
+	}
+	return args.connection;
+}
+
+/*
+ * DNSSD.browse_and_resolve() is a pipeline on one connection as well.
+ * Added instances are queued by the browse stage and resolved at most
+ * limit at a time, the first reply of each resolve ends it and starts
+ * the next.  A removal drops the instance from the queue or stops its
+ * resolve.  An instance that never answers is given up timeout seconds
+ * after its resolve started, so stale ones can't hold every slot; the
+ * event loop calls dnssd_service_expire() for that, see
+ * dnssd_loop_timeout().
+ *
+ * An instance is keyed by its full name and interface, the daemon
+ * reports it once per interface.  The resolves start in the order their
+ * instances were added and all have the same timeout, so the first
+ * instance being resolved is the first to expire.
+ */
+
+#define DNSSD_BROWSE_AND_RESOLVE_LIMIT 8
+#define DNSSD_BROWSE_AND_RESOLVE_TIMEOUT 5.0
+
+/* room for the full name and "%<interface index>" */
+#define DNSSD_INSTANCE_KEY_SIZE (kDNSServiceMaxDomainName + 16)
+
+struct dnssd_instance {
+	dnssd_instance_t *prev;
+	dnssd_instance_t *next;
+	VALUE resolve;	/* its resolve service, nil while queued */
+	double deadline;	/* when the resolve is given up, see dnssd_now() */
+	uint32_t interface;
+	/* the strings follow the key */
+	const char *name;
+	const char *regtype;
+	const char *domain;
+	char key[1];
+};
+
+/* writes the key of the instance _reply_ is about to _key_, false if
+ * it has no valid full name */
+static int
+dnssd_instance_key(char *key, const dnssd_reply_t *reply)
+{
+	if (DNSServiceConstructFullName(key, reply->name, reply->regtype, reply->domain))
+		return 0;
+	key[kDNSServiceMaxDomainName - 1] = '\000'; /* just in case */
+	snprintf(key + strlen(key), DNSSD_INSTANCE_KEY_SIZE - kDNSServiceMaxDomainName,
+					 "%%%lu", (unsigned long)reply->interface);
+	return 1;
+}
+
+static dnssd_instance_t *
+dnssd_instance_new(const char *key, const dnssd_reply_t *reply)
+{
+	size_t key_len = strlen(key) + 1;
+	size_t name_len = strlen(reply->name) + 1;
+	size_t regtype_len = strlen(reply->regtype) + 1;
+	size_t domain_len = strlen(reply->domain) + 1;
+	dnssd_instance_t *instance = (dnssd_instance_t *)
+		xmalloc(sizeof(dnssd_instance_t) + key_len + name_len + regtype_len + domain_len);
+	char *p = instance->key + key_len;
+
+	memcpy(instance->key, key, key_len);
+	instance->name = memcpy(p, reply->name, name_len);
+	p += name_len;
+	instance->regtype = memcpy(p, reply->regtype, regtype_len);
+	p += regtype_len;
+	instance->domain = memcpy(p, reply->domain, domain_len);
+	instance->interface = reply->interface;
+	instance->resolve = Qnil;
+	instance->deadline = 0;
+	return instance;
+}
+
+static void
+dnssd_instance_link(dnssd_instance_list_t *list, dnssd_instance_t *instance)
+{
+	instance->prev = list->tail;
+	instance->next = NULL;
+	if (list->tail) {
+		list->tail->next = instance;
+	} else {
+		list->head = instance;
+	}
+	list->tail = instance;
+	list->count++;
+}
+
+static void
+dnssd_instance_unlink(dnssd_instance_list_t *list, dnssd_instance_t *instance)
+{
+	if (instance->prev) {
+		instance->prev->next = instance->next;
+	} else {
+		list->head = instance->next;
+	}
+	if (instance->next) {
+		instance->next->prev = instance->prev;
+	} else {
+		list->tail = instance->prev;
+	}
+	list->count--;
+}
+
+static void
+dnssd_pipeline_mark(dnssd_pipeline_t *pipeline)
+{
+	dnssd_instance_t *instance;
+	for (instance = pipeline->resolving.head; instance; instance = instance->next)
+		rb_gc_mark(instance->resolve);
+}
+
+static void
+dnssd_pipeline_free(dnssd_pipeline_t *pipeline)
+{
+	dnssd_instance_t *instance, *next;
+	if (pipeline->instances) {
+		/* every instance is either queued or being resolved */
+		for (instance = pipeline->queued.head; instance; instance = next) {
+			next = instance->next;
+			xfree(instance);
+		}
+		for (instance = pipeline->resolving.head; instance; instance = next) {
+			next = instance->next;
+			xfree(instance);
+		}
+		st_free_table(pipeline->instances);
+	}
+	xfree(pipeline);
+}
+
+/* forgets _instance_, stopping its resolve */
+static void
+dnssd_pipeline_drop(dnssd_pipeline_t *pipeline, dnssd_instance_t *instance)
+{
+	st_data_t key = (st_data_t)instance->key;
+	VALUE resolve = instance->resolve;
+
+	st_delete(pipeline->instances, &key, 0);
+	if (NIL_P(resolve)) {
+		dnssd_instance_unlink(&pipeline->queued, instance);
+	} else {
+		dnssd_instance_unlink(&pipeline->resolving, instance);
+	}
+	xfree(instance);
+
+	if (!NIL_P(resolve)) {
+		dnssd_service_t *client;
+		GetDNSSDService(resolve, client);
+		client->stage_data = NULL;
+		if (!client->stopped) dnssd_service_stop(resolve);
+	}
+}
+
+static void dnssd_pipeline_resolve_stage(dnssd_reply_t *reply);
+
+/* starts resolves from the queue until limit are running */
+static void
+dnssd_pipeline_fill(dnssd_service_t *conn)
+{
+	dnssd_pipeline_t *pipeline = conn->pipeline;
+	dnssd_instance_t *instance, *next;
+	int state = 0;
+
+	if (conn->stopped) return;
+	/* resolves stopped by an error reply free their slot here */
+	for (instance = pipeline->resolving.head; instance; instance = next) {
+		dnssd_service_t *client;
+		next = instance->next;
+		GetDNSSDService(instance->resolve, client);
+		if (client->stopped) dnssd_pipeline_drop(pipeline, instance);
+	}
+
+	while (pipeline->resolving.count < pipeline->limit && pipeline->queued.head) {
+		dnssd_resolve_args_t args;
+		VALUE service;
+		instance = pipeline->queued.head;
+		args.connection = conn->self;
+		args.block = Qnil;
+		args.stage = dnssd_pipeline_resolve_stage;
+		args.stage_data = instance;
+		args.flags = 0;
+		args.interface_index = instance->interface;
+		args.name = instance->name;
+		args.type = instance->regtype;
+		args.domain = instance->domain;
+		service = rb_protect(dnssd_start_resolve, (VALUE)&args, &state);
+		if (state) {
+			/* nothing left to do */
+			dnssd_connection_stop(conn->self);
+			rb_jump_tag(state);
+		}
+		dnssd_instance_unlink(&pipeline->queued, instance);
+		instance->resolve = service;
+		instance->deadline = dnssd_now() + pipeline->timeout;
+		dnssd_instance_link(&pipeline->resolving, instance);
+	}
+	/* later resolves expire later, the loop has the deadline once timed */
+	if (pipeline->resolving.head && !pipeline->timed) {
+		pipeline->timed = 1;
+		dnssd_loop_timeout(conn, pipeline->resolving.head->deadline);
+	}
+}
+
+double
+dnssd_service_expire(dnssd_service_t *service)
+{
+	dnssd_pipeline_t *pipeline = service->pipeline;
+	double now = dnssd_now();
+
+	if (pipeline == NULL) return -1;
+	if (!service->stopped && pipeline->instances) {
+		/* their slots go to the queue */
+		while (pipeline->resolving.head && pipeline->resolving.head->deadline <= now)
+			dnssd_pipeline_drop(pipeline, pipeline->resolving.head);
+		dnssd_pipeline_fill(service);
+		if (pipeline->resolving.head) return pipeline->resolving.head->deadline;
+	}
+	pipeline->timed = 0;
+	return -1;
+}
+
+/* the resolve stage */
+static void
+dnssd_pipeline_resolve_stage(dnssd_reply_t *reply)
+{
+	dnssd_service_t *conn = reply->service->connection;
+	dnssd_instance_t *instance = (dnssd_instance_t *)reply->service->stage_data;
+	volatile VALUE obj = dnssd_reply_object(reply, reply->service->self);
+	VALUE block;
+
+	dnssd_resolve_set_names(obj, instance->name, instance->regtype, instance->domain);
+	/* the first reply is enough, its slot goes to the next instance */
+	dnssd_pipeline_drop(conn->pipeline, instance);
+	dnssd_pipeline_fill(conn);
+
+	block = dnssd_service_get_block(conn->self);
+	if (!NIL_P(block))
+		rb_funcall2(block, dnssd_id_call, 1, (VALUE *)&obj);
+}
+
+/* the browse stage */
+static void
+dnssd_pipeline_browse_stage(dnssd_reply_t *reply)
+{
+	dnssd_service_t *conn = reply->service->connection;
+	dnssd_pipeline_t *pipeline = conn->pipeline;
+	char key[DNSSD_INSTANCE_KEY_SIZE];
+	st_data_t found;
+
+	if (!(reply->flags & kDNSServiceFlagsAdd))
+		/* the instance is gone, so is its resolve */
+		dnssd_cache_remove(reply->name, reply->regtype, reply->domain);
+	if (!dnssd_instance_key(key, reply)) return;
+
+	if (st_lookup(pipeline->instances, (st_data_t)key, &found)) {
+		if (reply->flags & kDNSServiceFlagsAdd) return;
+		dnssd_pipeline_drop(pipeline, (dnssd_instance_t *)found);
+	} else if (reply->flags & kDNSServiceFlagsAdd) {
+		dnssd_instance_t *instance = dnssd_instance_new(key, reply);
+		st_insert(pipeline->instances, (st_data_t)instance->key, (st_data_t)instance);
+		dnssd_instance_link(&pipeline->queued, instance);
+	} else {
+		return;
+	}
+	dnssd_pipeline_fill(conn);
+}
+
+typedef struct {
+	VALUE connection;
+	DNSServiceFlags flags;
+	uint32_t interface_index;
+	const char *type;
+	const char *domain;
+	VALUE options;
+} dnssd_pipeline_args_t;
+
+static VALUE
+dnssd_pipeline_browse(VALUE arg)
+{
+	dnssd_pipeline_args_t *args = (dnssd_pipeline_args_t *)arg;
+	dnssd_service_t *client;
+	DNSServiceFlags flags;
+	DNSServiceErrorType e;
+	VALUE service = dnssd_service_alloc(cDNSSDService, Qnil);
+	GetDNSSDService(service, client);
+	client->stage = dnssd_pipeline_browse_stage;
+	client->filter = dnssd_filter_new(args->options);
+	flags = dnssd_service_share(service, args->connection, args->flags);
+	e = DNSServiceBrowse(&client->client, flags, args->interface_index,
+											 args->type, args->domain,
+											 dnssd_browse_reply, (void *)client);
+	dnssd_service_start(service, e, "browse", args->type);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.browse_and_resolve(service_type, domain=nil, flags=0, interface=DNSSD::InterfaceAny, :limit => 8, :timeout => 5) do |resolve_reply|
+ *      block
+ *    end => connection
+ *
+ * Browses for services of _service_type_ and resolves each instance
+ * found, as one pipelined operation on one connection to the daemon.
+ * At most <code>:limit</code> instances are resolved at a time, the
+ * others wait their turn; an instance removed before its turn is not
+ * resolved and one removed while being resolved stops its resolve.
+ * An instance not resolved within <code>:timeout</code> seconds is
+ * given up and its slot goes to the next one.
+ *
+ * The first DNSSD::ResolveReply of each instance is passed to the
+ * block.  Unlike those of DNSSD.resolve() it has the name, type and
+ * domain of the instance:
+ *
+ *    DNSSD.browse_and_resolve("_http._tcp", :limit => 16) do |reply|
+ *      puts "#{reply.name} is at #{reply.target}:#{reply.port}"
+ *    end
+ *
+ * The <code>:name</code>, <code>:prefix</code> and <code>:interfaces</code>
+ * options filter the instances before any is queued, see DNSSD.browse().
+ *
+ * Returns the DNSSD::Connection running the browse and the resolves,
+ * stop it to stop them (see DNSSD::Connection#stop).
+ */
+
+static VALUE
+dnssd_browse_and_resolve(int argc, VALUE * argv, VALUE self)
+{
+	VALUE service_type, domain, tmp_flags, interface, block, options, tmp_limit, tmp_timeout;
+	dnssd_pipeline_args_t args;
+	dnssd_service_t *conn;
+	long limit = DNSSD_BROWSE_AND_RESOLVE_LIMIT;
+	double timeout = DNSSD_BROWSE_AND_RESOLVE_TIMEOUT;
+	int state = 0;
+
+	options = dnssd_extract_options(&argc, argv);
+	rb_scan_args (argc, argv, "13&", &service_type, &domain,
+								&tmp_flags, &interface, &block);
+
+	/* required */
+	dnssd_check_block(block);
+	args.type = StringValueCStr(service_type);
+
+	/* optional parameters */
+	args.domain = NULL;
+	args.flags = 0;
+	args.interface_index = 0;
+	if (domain != Qnil)
+		args.domain = dnssd_get_domain(domain);
+	if (tmp_flags != Qnil)
+		args.flags = dnssd_to_flags(tmp_flags);
+	if (interface != Qnil)
+		args.interface_index = dnssd_get_interface_index(interface);
+	tmp_limit = dnssd_option(options, "limit");
+	if (!NIL_P(tmp_limit))
+		limit = NUM2LONG(tmp_limit);
+	if (limit < 1)
+		rb_raise(rb_eArgError, "limit must be at least 1");
+	tmp_timeout = dnssd_option(options, "timeout");
+	if (!NIL_P(tmp_timeout))
+		timeout = NUM2DBL(tmp_timeout);
+	if (!(timeout > 0)) /* NaN too */
+		rb_raise(rb_eArgError, "timeout must be positive");
+	/* the pipeline needs the removals, and stops a resolve on its first reply */
+	if (!NIL_P(dnssd_option(options, "only")) || !NIL_P(dnssd_option(options, "text")))
+		rb_raise(rb_eArgError, "browse_and_resolve does not take the :only and :text options");
+	args.options = options;
+
+	args.connection = dnssd_connection_new(cDNSSDConnection);
+	rb_ivar_set(args.connection, dnssd_iv_block, block);
+	GetDNSSDService(args.connection, conn);
+	conn->pipeline = dnssd_pipeline_new();
+	conn->pipeline->limit = limit;
+	conn->pipeline->timeout = timeout;
+	conn->pipeline->instances = st_init_strtable();
+	rb_protect(dnssd_pipeline_browse, (VALUE)&args, &state);
+	if (state) {
+		dnssd_connection_stop(args.connection);
+		rb_jump_tag(state);
+	}
+	return args.connection;
+}
+
+/*
+ * DNSSD.resolve_sync() and DNSSD.browse_for() run their operation on
+ * the calling thread: the operation gets its own connection to the
+ * daemon, whose socket is polled until a monotonic deadline and then
+ * closed.  Neither the event loop nor a ruby thread is involved, and
+ * there is no DNSSD::Service, the replies' service is nil.
+ */
+
+#define DNSSD_RESOLVE_SYNC_TIMEOUT 5.0
+#define DNSSD_BROWSE_FOR_TIMEOUT 1.0
+
+typedef struct {
+	dnssd_service_t client;
+	dnssd_queue_t queue;
+	/* the reply being converted, freed if that raises */
+	dnssd_reply_t *reply;
+	double deadline;
+	/* return the first reply instead of the Array of all */
+	int first_only;
+	VALUE replies;
+} dnssd_sync_t;
+
+double
+dnssd_now(void)
+{
+	struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+dnssd_sync_init(dnssd_sync_t *sync, VALUE options, double timeout)
+{
+	VALUE tmp_timeout = dnssd_option(options, "timeout");
+	if (!NIL_P(tmp_timeout))
+		timeout = NUM2DBL(tmp_timeout);
+	if (isnan(timeout))
+		rb_raise(rb_eArgError, "timeout must be a number");
+
+	MEMZERO(sync, dnssd_sync_t, 1);
+	sync->client.self = Qnil;
+	sync->client.loop = dnssd_loop_current();
+	sync->client.batch = Qnil;
+	sync->client.queue = &sync->queue;
+	sync->replies = Qnil;
+	sync->deadline = dnssd_now() + timeout;
+}
+
+static VALUE
+dnssd_sync_run(VALUE arg)
+{
+	dnssd_sync_t *sync = (dnssd_sync_t *)arg;
+	double timeout;
+
+	while ((timeout = sync->deadline - dnssd_now()) > 0) {
+		dnssd_service_wait(&sync->client, timeout);
+		while ((sync->reply = dnssd_queue_shift(&sync->queue))) {
+			VALUE obj = dnssd_reply_object(sync->reply, Qnil);
+			free(sync->reply);
+			sync->reply = NULL;
+			if (sync->first_only) return obj;
+			rb_ary_push(sync->replies, obj);
+		}
+	}
+	return sync->replies;
+}
+
+static VALUE
+dnssd_sync_ensure(VALUE arg)
+{
+	dnssd_sync_t *sync = (dnssd_sync_t *)arg;
+	free(sync->reply);
+	dnssd_queue_clear(&sync->queue);
+	dnssd_filter_free(sync->client.filter);
+	DNSServiceRefDeallocate(sync->client.client);
+	return Qnil;
+}
+
+static VALUE
+dnssd_sync(dnssd_sync_t *sync, DNSServiceErrorType e)
+{
+	if (e) dnssd_filter_free(sync->client.filter);
+	dnssd_check_error_code(e);
+	return rb_ensure(dnssd_sync_run, (VALUE)sync, dnssd_sync_ensure, (VALUE)sync);
+}
+
+/*
+ * call-seq:
+ *    DNSSD.resolve_sync(service_name, service_type, service_domain, flags=0, interface=DNSSD::InterfaceAny, :timeout => 5) => resolve_reply or nil
+ *
+ * Like DNSSD.resolve(), but waits on the calling thread for the first
+ * DNSSD::ResolveReply and returns it, or returns +nil+ if none arrived
+ * within <code>:timeout</code> seconds.  The resolve is stopped before
+ * returning.
+ *
+ * Once DNSSD::ResolveCache.ttl is set a reply kept in the cache is
+ * returned without asking the daemon.
+ */
+
+static VALUE
+dnssd_resolve_sync(int argc, VALUE * argv, VALUE self)
+{
+	VALUE service_name, service_type, service_domain,
+				tmp_flags, interface, options, cached;
+
+	const char *name_str, *type_str, *domain_str;
+	DNSServiceFlags flags = 0;
+	uint32_t interface_index = 0;
+	dnssd_sync_t sync;
+
+	options = dnssd_extract_options(&argc, argv);
+	rb_scan_args (argc, argv, "32",
+								&service_name, &service_type, &service_domain,
+								&tmp_flags, &interface);
+
+	name_str = StringValueCStr(service_name);
+	type_str = StringValueCStr(service_type);
+	domain_str = dnssd_get_domain(service_domain);
+	if (tmp_flags != Qnil)
+		flags = dnssd_to_flags(tmp_flags);
+	if (interface != Qnil)
 		interface_index = dnssd_get_interface_index(interface);
+
+	/* a cached reply has not been through the filter */
+	if (!dnssd_filter_given(options)) {
+		cached = dnssd_cache_lookup(name_str, type_str, domain_str, interface_index);
+		if (!NIL_P(cached)) return cached;
 	}
 
-	/* allocate this last since all other parameters are on the stack (thanks to unary & operator) */
-	service = dnssd_service_alloc(block);
-  GetDNSSDService(service, client);
+	dnssd_sync_init(&sync, options, DNSSD_RESOLVE_SYNC_TIMEOUT);
+	sync.client.operation = "resolve_sync";
+	sync.client.filter = dnssd_filter_new(options);
+	sync.first_only = 1;
+	return dnssd_sync(&sync,
+										DNSServiceResolve(&sync.client.client, flags, interface_index,
+																			name_str, type_str, domain_str,
+																			dnssd_resolve_reply, (void *)&sync.client));
+}
 
-  err = DNSServiceResolve (client, flags, interface_index, name_str, type_str,
-													 domain_str, dnssd_resolve_reply, (void *) service);
-  dnssd_check_error_code(err);
-	dnssd_service_start(service);
-  return service;
+/*
+ * call-seq:
+ *    DNSSD.browse_for(service_type, domain=nil, flags=0, interface=DNSSD::InterfaceAny, :timeout => 1) => [browse_reply, ...]
+ *
+ * Like DNSSD.browse(), but browses on the calling thread for
+ * <code>:timeout</code> seconds and returns the DNSSD::BrowseReply
+ * objects received in that time, in order (removals included, see
+ * DNSSD::Flags::Add).
+ */
+
+static VALUE
+dnssd_browse_for(int argc, VALUE * argv, VALUE self)
+{
+	VALUE service_type, domain, tmp_flags, interface, options;
+	volatile VALUE replies;
+
+	const char *type_str;
+	const char *domain_str = NULL;
+	DNSServiceFlags flags = 0;
+	uint32_t interface_index = 0;
+	dnssd_sync_t sync;
+
+	options = dnssd_extract_options(&argc, argv);
+	rb_scan_args (argc, argv, "13", &service_type, &domain,
+								&tmp_flags, &interface);
+
+	type_str = StringValueCStr(service_type);
+	if (domain != Qnil)
+		domain_str = dnssd_get_domain(domain);
+	if (tmp_flags != Qnil)
+		flags = dnssd_to_flags(tmp_flags);
+	if (interface != Qnil)
+		interface_index = dnssd_get_interface_index(interface);
+
+	dnssd_sync_init(&sync, options, DNSSD_BROWSE_FOR_TIMEOUT);
+	sync.client.operation = "browse_for";
+	sync.replies = replies = rb_ary_new();
+	sync.client.filter = dnssd_filter_new(options);
+	return dnssd_sync(&sync,
+										DNSServiceBrowse(&sync.client.client, flags, interface_index,
+																		 type_str, domain_str,
+																		 dnssd_browse_reply, (void *)&sync.client));
+}
+
+/*
+ * call-seq:
+ *    DNSSD::Connection.new => connection
+ *
+ * Opens a connection to the mDNS daemon that can be shared by many
+ * services, see DNSSD::Connection#browse(), DNSSD::Connection#resolve()
+ * and DNSSD::Connection#register().
+ */
+
+VALUE
+dnssd_connection_new(VALUE klass)
+{
+	dnssd_service_t *conn;
+	VALUE connection = dnssd_service_alloc(klass, Qnil);
+	GetDNSSDService(connection, conn);
+	conn->is_connection = 1;
+	rb_ivar_set(connection, dnssd_iv_services, rb_hash_new());
+
+	dnssd_service_start(connection, DNSServiceCreateConnection(&conn->client),
+											"connection", "");
+	return connection;
+}
+
+/*
+ * call-seq:
+ *    connection.browse(service_type, domain=nil, flags=0, interface=DNSSD::InterfaceAny) do |browse_reply|
+ *      block
+ *    end => service_handle
+ *
+ * Like DNSSD.browse(), but the browse shares _connection_.
+ */
+
+static VALUE
+dnssd_connection_browse(int argc, VALUE *argv, VALUE self)
+{
+	return dnssd_do_browse(self, argc, argv);
+}
+
+/*
+ * call-seq:
+ *    connection.resolve(service_name, service_type, service_domain, flags=0, interface=DNSSD::InterfaceAny) do |resolve_reply|
+ *      block
+ *    end => service_handle
+ *
+ * Like DNSSD.resolve(), but the resolve shares _connection_.
+ */
+
+static VALUE
+dnssd_connection_resolve(int argc, VALUE *argv, VALUE self)
+{
+	return dnssd_do_resolve(self, argc, argv);
+}
+
+/*
+ * call-seq:
+ *    connection.register(service_name, service_type, service_domain, service_port, text_record=nil, flags=0, interface=DNSSD::InterfaceAny) do |register_reply|
+ *      block
+ *    end => service_handle
+ *
+ * Like DNSSD.register(), but the registration shares _connection_.
+ */
+
+static VALUE
+dnssd_connection_register(int argc, VALUE *argv, VALUE self)
+{
+	return dnssd_do_register(self, argc, argv);
+}
+
+/*
+ * call-seq:
+ *    connection.query_record(fullname, rrtype, rrclass=DNSSD::RecordReply::IN, flags=0, interface=DNSSD::InterfaceAny) do |record_reply|
+ *      block
+ *    end => service_handle
+ *
+ * Like DNSSD.query_record(), but the query shares _connection_.
+ */
+
+static VALUE
+dnssd_connection_query_record(int argc, VALUE *argv, VALUE self)
+{
+	return dnssd_do_query_record(self, argc, argv);
+}
+
+static int
+dnssd_connection_stop_i(VALUE service, VALUE value, VALUE arg)
+{
+	dnssd_service_t *client;
+	GetDNSSDService(service, client);
+	/* deallocating the connection's ref deallocates the service's ref */
+	client->stopped = 1;
+	dnssd_loop_lock(client->loop);
+	dnssd_loop_purge(client);
+	client->client = NULL;
+	dnssd_loop_unlock(client->loop);
+	client->connection = NULL;
+	client->batch = Qnil;
+	rb_ivar_set(service, dnssd_iv_block, Qnil);
+	return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *    connection.stop => connection
+ *
+ * Closes _connection_, stopping every service started on it.
+ */
+
+static VALUE
+dnssd_connection_stop(VALUE self)
+{
+	if (!dnssd_service_is_stopped(self)) {
+		rb_hash_foreach(rb_ivar_get(self, dnssd_iv_services), dnssd_connection_stop_i, 0);
+		rb_ivar_set(self, dnssd_iv_services, rb_hash_new());
+	}
+	return dnssd_service_stop(self);
+}
+
+/*
+ * DNSSD.register_many() converts every spec before registering any, so
+ * a bad spec raises without registering anything.
+ */
+
+typedef struct {
+	const char *name;
+	const char *type;
+	const char *domain;
+	uint16_t opaqueport;
+	uint16_t txt_len;
+	const char *txt_rec;
+	DNSServiceFlags flags;
+	uint32_t interface_index;
+} dnssd_register_spec_t;
+
+/* converts _hash_ into _spec_, the converted strings are pushed onto _keep_ */
+static void
+dnssd_register_spec(dnssd_register_spec_t *spec, VALUE hash, VALUE keep)
+{
+	VALUE name, type, domain, port, text_record, tmp_flags, interface;
+
+	Check_Type(hash, T_HASH);
+	name = dnssd_option(hash, "name");
+	type = dnssd_option(hash, "type");
+	domain = dnssd_option(hash, "domain");
+	port = dnssd_option(hash, "port");
+	text_record = dnssd_option(hash, "text_record");
+	tmp_flags = dnssd_option(hash, "flags");
+	interface = dnssd_option(hash, "interface");
+	if (NIL_P(name) || NIL_P(type) || NIL_P(port))
+		rb_raise(rb_eArgError, "service spec needs :name, :type and :port");
+
+	MEMZERO(spec, dnssd_register_spec_t, 1);
+	spec->name = StringValueCStr(name);
+	rb_ary_push(keep, name);
+	spec->type = StringValueCStr(type);
+	rb_ary_push(keep, type);
+	if (domain != Qnil) {
+		StringValue(domain);
+		spec->domain = dnssd_get_domain(domain);
+		rb_ary_push(keep, domain);
+	}
+	/* convert from host to net byte order */
+	spec->opaqueport = htons((uint16_t)NUM2UINT(port));
+	if (text_record != Qnil) {
+		text_record = dnssd_tr_to_encoded_str(text_record);
+		spec->txt_rec = RSTRING_PTR(text_record);
+		spec->txt_len = RSTRING_LEN(text_record);
+		rb_ary_push(keep, text_record);
+	}
+	if (tmp_flags != Qnil)
+		spec->flags = dnssd_to_flags(tmp_flags);
+	if (interface != Qnil)
+		spec->interface_index = dnssd_get_interface_index(interface);
+}
+
+typedef struct {
+	VALUE group;
+	dnssd_register_spec_t *specs;
+	long len;
+} dnssd_group_args_t;
+
+static VALUE
+dnssd_group_register(VALUE arg)
+{
+	dnssd_group_args_t *args = (dnssd_group_args_t *)arg;
+	long i;
+	for (i=0; i<args->len; i++) {
+		dnssd_register_spec_t *spec = &args->specs[i];
+		dnssd_service_t *client;
+		DNSServiceFlags flags;
+		DNSServiceErrorType e;
+		VALUE service = dnssd_service_alloc(cDNSSDService, Qnil);
+
+		GetDNSSDService(service, client);
+		rb_ivar_set(service, dnssd_iv_index, LONG2NUM(i));
+		client->is_registration = 1;
+		flags = dnssd_service_share(service, args->group, spec->flags);
+		e = DNSServiceRegister(&client->client, flags, spec->interface_index,
+													 spec->name, spec->type, spec->domain,
+													 NULL, spec->opaqueport, spec->txt_len, spec->txt_rec,
+													 dnssd_register_reply, (void *)client);
+		dnssd_service_start(service, e, "register", spec->name);
+	}
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.register_many(specs) do |results|
+ *      block
+ *    end => service_group
+ *
+ * Registers a service for each Hash in the Array _specs_, all over one
+ * connection to the daemon.  The keys are those of the arguments of
+ * DNSSD.register(): <code>:name</code>, <code>:type</code> and
+ * <code>:port</code> are required; <code>:domain</code>,
+ * <code>:text_record</code>, <code>:flags</code> and
+ * <code>:interface</code> are optional.
+ *
+ * Every spec is checked before anything is registered.  Once every
+ * registration has completed or failed the block (if given) is passed
+ * an Array holding, in the order of _specs_, a DNSSD::RegisterReply or
+ * the DNSSD::Error of each (see DNSSD::ServiceGroup#results).
+ *
+ *    group = DNSSD.register_many([
+ *      { :name => "tenant 1", :type => "_http._tcp", :port => 8081 },
+ *      { :name => "tenant 2", :type => "_http._tcp", :port => 8082 },
+ *    ]) do |results|
+ *      puts "#{results.grep(DNSSD::Error).size} failed"
+ *    end
+ *    ...
+ *    group.stop
+ */
+
+static VALUE
+dnssd_register_many(int argc, VALUE *argv, VALUE self)
+{
+	VALUE specs, block, group, results;
+	volatile VALUE keep, buf;
+	dnssd_group_args_t args;
+	long i;
+	int state = 0;
+
+	rb_scan_args(argc, argv, "1&", &specs, &block);
+	Check_Type(specs, T_ARRAY);
+
+	args.len = RARRAY_LEN(specs);
+	keep = rb_ary_new();
+	buf = rb_str_new(0, args.len * sizeof(dnssd_register_spec_t));
+	args.specs = (dnssd_register_spec_t *)RSTRING_PTR(buf);
+	for (i=0; i<args.len; i++)
+		dnssd_register_spec(&args.specs[i], RARRAY_PTR(specs)[i], keep);
+
+	args.group = group = dnssd_connection_new(cDNSSDServiceGroup);
+	rb_ivar_set(group, dnssd_iv_block, block);
+	results = rb_ary_new2(args.len);
+	if (args.len > 0) rb_ary_store(results, args.len - 1, Qnil);
+	rb_ivar_set(group, dnssd_iv_results, results);
+	rb_ivar_set(group, dnssd_iv_pending, LONG2NUM(args.len));
+
+	rb_protect(dnssd_group_register, (VALUE)&args, &state);
+	if (state) {
+		/* all or nothing */
+		dnssd_connection_stop(group);
+		rb_jump_tag(state);
+	}
+	return group;
+}
+
+/*
+ * call-seq:
+ *    service_group.results => array
+ *
+ * The outcome of each registration of _service_group_ so far, in the
+ * order of the specs passed to DNSSD.register_many(): a
+ * DNSSD::RegisterReply, the DNSSD::Error it failed with, or
+ * <code>nil</code> if it has not completed yet.
+ */
+
+static VALUE
+dnssd_group_results(VALUE self)
+{
+	return rb_ary_dup(rb_ivar_get(self, dnssd_iv_results));
+}
+
+/*
+ * call-seq:
+ *    service_group.complete? => true or false
+ *
+ * Returns <code>true</code> once every registration of _service_group_
+ * has completed or failed.
+ */
+
+static VALUE
+dnssd_group_is_complete(VALUE self)
+{
+	return NUM2LONG(rb_ivar_get(self, dnssd_iv_pending)) == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.connection => connection or nil
+ *
+ * The DNSSD::Connection shared by DNSSD.browse(), DNSSD.resolve() and
+ * DNSSD.register(), <code>nil</code> if each service opens its own.
+ * Each Ractor has its own.
+ */
+
+static VALUE
+dnssd_get_connection(VALUE self)
+{
+	return dnssd_loop_current()->connection;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.connection = connection or nil
+ *
+ * Makes DNSSD.browse(), DNSSD.resolve() and DNSSD.register() start every
+ * service on _connection_ instead of opening a connection to the daemon
+ * per service.  Set to <code>nil</code> to go back to a connection per service.
+ *
+ *    DNSSD.connection = DNSSD::Connection.new
+ */
+
+static VALUE
+dnssd_set_connection(VALUE self, VALUE connection)
+{
+	if (!NIL_P(connection) && !IsDNSSDConnection(connection))
+		rb_raise(rb_eTypeError, "need a DNSSD::Connection or nil");
+	dnssd_loop_current()->connection = connection;
+	return connection;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.share_subscriptions => true or false
+ *
+ * Whether DNSSD.browse() and DNSSD.resolve() share operations, see
+ * DNSSD.share_subscriptions=.
+ */
+
+static VALUE
+dnssd_get_share_subscriptions(VALUE self)
+{
+	return dnssd_loop_current()->share_default ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    DNSSD.share_subscriptions = true or false
+ *
+ * Makes a DNSSD.browse() or DNSSD.resolve() with the same arguments
+ * (flags and interface included) as one still running subscribe to it
+ * instead of asking the daemon again.  The new service's block is
+ * first passed the replies about the instances already found, then
+ * every reply as it arrives.  The operation stops with the last of its
+ * services.
+ *
+ *    DNSSD.share_subscriptions = true
+ *    a = DNSSD.browse('_http._tcp') { |reply| ... }
+ *    b = DNSSD.browse('_http._tcp') { |reply| ... } # no new browse
+ *
+ * The <code>:share</code> option overrides it for one call.  Services
+ * started on a DNSSD::Connection other than DNSSD.connection, or with
+ * the <code>:reactor</code> or <code>:buffer</code> option or a reply
+ * filter, are never shared.
+ *
+ * Like DNSSD.connection, the setting is the calling Ractor's.
+ */
+
+static VALUE
+dnssd_set_share_subscriptions(VALUE self, VALUE share)
+{
+	dnssd_loop_current()->share_default = RTEST(share);
+	return share;
 }
 
 void
@@ -495,11 +2915,30 @@ Init_DNSSD_Service(void)
 #endif
 	dnssd_id_call = rb_intern("call");
 	dnssd_id_to_str = rb_intern("to_str");
+	dnssd_id_keys = rb_intern("keys");
+	dnssd_id_cached = rb_intern("cached");
 	dnssd_iv_block = rb_intern("@block");
-	dnssd_iv_thread = rb_intern("@thread");
-	dnssd_iv_service = rb_intern("@service");
-
+	dnssd_iv_services = rb_intern("@services");
+	dnssd_iv_connection = rb_intern("@connection");
+	dnssd_iv_results = rb_intern("@results");
+	dnssd_iv_pending = rb_intern("@pending");
+	dnssd_iv_index = rb_intern("@index");
+	dnssd_iv_io = rb_intern("@io");
+	/* not instance variables, the share's state is not for ruby to see */
+	dnssd_id_subscribers = rb_intern("subscribers");
+	dnssd_id_known = rb_intern("known");
+	dnssd_id_source = rb_intern("source");
+	dnssd_id_share_key = rb_intern("share_key");
+	dnssd_id_for_fd = rb_intern("for_fd");
+	dnssd_id_autoclose_set = rb_intern("autoclose=");
+	dnssd_id_addrinfo = rb_intern("Addrinfo");
+
+	/* services run on the loop of the Ractor that started them, with its
+	 * DNSSD.connection and shares, any Ractor may start them */
+	rb_ext_ractor_safe(1);
 	cDNSSDService = rb_define_class_under(mDNSSD, "Service", rb_cObject);
+	/* services, connections and groups are only created by dnssd_service_alloc() */
+	rb_undef_alloc_func(cDNSSDService);
 
 	rb_define_singleton_method(cDNSSDService, "new", dnssd_service_new, -1);
 	rb_define_singleton_method(cDNSSDService, "fullname", dnssd_service_fullname, 3);
@@ -507,9 +2946,66 @@ Init_DNSSD_Service(void)
 	rb_define_method(cDNSSDService, "stop", dnssd_service_stop, 0);
 	rb_define_method(cDNSSDService, "stopped?", dnssd_service_is_stopped, 0);
 	rb_define_method(cDNSSDService, "inspect", dnssd_service_inspect, 0);
+	rb_define_method(cDNSSDService, "text_record=", dnssd_service_set_text_record, 1);
+	rb_define_method(cDNSSDService, "to_io", dnssd_service_to_io, 0);
+	rb_define_method(cDNSSDService, "process", dnssd_service_process, -1);
+	rb_define_method(cDNSSDService, "take", dnssd_service_take, -1);
+	rb_define_method(cDNSSDService, "each", dnssd_service_each, 0);
+	rb_define_method(cDNSSDService, "buffered", dnssd_service_buffered, 0);
+	rb_define_method(cDNSSDService, "overflows", dnssd_service_overflows, 0);
 	
   rb_define_module_function(mDNSSD, "browse", dnssd_browse, -1);
   rb_define_module_function(mDNSSD, "resolve", dnssd_resolve, -1);
   rb_define_module_function(mDNSSD, "register", dnssd_register, -1);
+	rb_define_module_function(mDNSSD, "query_record", dnssd_query_record, -1);
+	rb_define_module_function(mDNSSD, "resolve_addresses", dnssd_resolve_addresses, -1);
+	rb_define_module_function(mDNSSD, "browse_and_resolve", dnssd_browse_and_resolve, -1);
+	rb_define_module_function(mDNSSD, "resolve_sync", dnssd_resolve_sync, -1);
+	rb_define_module_function(mDNSSD, "browse_for", dnssd_browse_for, -1);
+
+	cDNSSDConnection = rb_define_class_under(mDNSSD, "Connection", cDNSSDService);
+	rb_define_singleton_method(cDNSSDConnection, "new", dnssd_connection_new, 0);
+	rb_define_method(cDNSSDConnection, "browse", dnssd_connection_browse, -1);
+	rb_define_method(cDNSSDConnection, "resolve", dnssd_connection_resolve, -1);
+	rb_define_method(cDNSSDConnection, "register", dnssd_connection_register, -1);
+	rb_define_method(cDNSSDConnection, "query_record", dnssd_connection_query_record, -1);
+	rb_define_method(cDNSSDConnection, "stop", dnssd_connection_stop, 0);
+
+	rb_define_module_function(mDNSSD, "connection", dnssd_get_connection, 0);
+	rb_define_module_function(mDNSSD, "connection=", dnssd_set_connection, 1);
+
+	rb_define_module_function(mDNSSD, "share_subscriptions", dnssd_get_share_subscriptions, 0);
+	rb_define_module_function(mDNSSD, "share_subscriptions=", dnssd_set_share_subscriptions, 1);
+
+	cDNSSDServiceGroup = rb_define_class_under(mDNSSD, "ServiceGroup", cDNSSDConnection);
+	rb_define_singleton_method(cDNSSDServiceGroup, "new", dnssd_service_new, -1);
+	rb_undef_method(cDNSSDServiceGroup, "browse");
+	rb_undef_method(cDNSSDServiceGroup, "resolve");
+	rb_undef_method(cDNSSDServiceGroup, "register");
+	rb_undef_method(cDNSSDServiceGroup, "query_record");
+	rb_define_method(cDNSSDServiceGroup, "results", dnssd_group_results, 0);
+	rb_define_method(cDNSSDServiceGroup, "complete?", dnssd_group_is_complete, 0);
+	rb_define_module_function(mDNSSD, "register_many", dnssd_register_many, -1);
+	rb_ext_ractor_safe(0);
 }
 
+/* Document-class: DNSSD::Connection
+ *
+ * A connection to the mDNS daemon shared by many services.
+ * Every service opens its own connection (a unix socket) to the daemon
+ * unless it is started on a DNSSD::Connection, sharing a connection saves
+ * a connect() and handshake per service and a file descriptor per service.
+ *
+ *    connection = DNSSD::Connection.new
+ *    connection.browse('_http._tcp') do |browse_reply|
+ *      connection.resolve(browse_reply.name, browse_reply.type, browse_reply.domain) do |resolve_reply|
+ *        ...
+ *      end
+ *    end
+ */
+
+/* Document-class: DNSSD::ServiceGroup
+ *
+ * The registrations made by one DNSSD.register_many() call.  They share
+ * one connection to the daemon, DNSSD::Connection#stop stops them all.
+ */
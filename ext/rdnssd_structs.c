@@ -5,27 +5,66 @@
  */
 #include "rdnssd.h"
 
-/* for if_indextoname() */
+/* for inet_ntop() */
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_RB_ENC_INTERNED_STR
+#include <ruby/encoding.h>
+#endif
 
 static VALUE cDNSSDFlags;
 static VALUE cDNSSDReply;
 static VALUE cDNSSDBrowseReply;
 static VALUE cDNSSDResolveReply;
 static VALUE cDNSSDRegisterReply;
+static VALUE cDNSSDRecordReply;
 	
-static ID dnssd_iv_flags;
-static ID dnssd_iv_interface;
-static ID dnssd_iv_fullname;
-static ID dnssd_iv_target;
-static ID dnssd_iv_port;
-static ID dnssd_iv_text_record;
-static ID dnssd_iv_name;
-static ID dnssd_iv_type;
-static ID dnssd_iv_domain;
-static ID dnssd_iv_service;
+/* the ruby objects of a reply, created on first use */
+enum {
+	DNSSD_FIELD_FLAGS,
+	DNSSD_FIELD_INTERFACE,
+	DNSSD_FIELD_NAME,
+	DNSSD_FIELD_TYPE,
+	DNSSD_FIELD_DOMAIN,
+	DNSSD_FIELD_FULLNAME,
+	DNSSD_FIELD_TARGET,
+	DNSSD_FIELD_DATA,	/* text record or rdata */
+	DNSSD_FIELD_LAZY_TEXT_RECORD,
+	DNSSD_MAX_FIELDS
+};
+
+/* native state of a DNSSD::Reply.  Only the raw fields of the reply are
+ * copied, the ruby objects are created when an accessor is first called. */
+typedef struct dnssd_reply_struct {
+	VALUE service;
+	DNSServiceFlags flags;
+	uint32_t interface;
+	/* browse and register */
+	const char *name;
+	const char *regtype;
+	const char *domain;
+	/* resolve and record, NULL for browse and register */
+	const char *fullname;
+	const char *target;
+	uint16_t port;	/* host byte order */
+	uint16_t rrtype;
+	uint16_t rrclass;
+	uint32_t ttl;
+	/* the text record of a resolve, the rdata of a record */
+	uint16_t bytes_len;
+	const char *bytes;
+	/* Qundef until created */
+	VALUE fields[DNSSD_MAX_FIELDS];
+	/* the strings above point into data */
+	size_t data_len;
+	char data[1];
+} dnssd_reply_struct_t;
 
 #define IsDNSSDFlags(obj) (rb_obj_is_kind_of(obj,cDNSSDFlags)==Qtrue)
 
@@ -49,8 +88,6 @@ static const DNSServiceFlags dnssd_flag[DNSSD_MAX_FLAGS] = {
 	kDNSServiceFlagsLongLivedQuery
 };
 
-static ID dnssd_flag_iv[DNSSD_MAX_FLAGS];
-
 static const char *dnssd_flag_name[DNSSD_MAX_FLAGS] = {
 	"more_coming",
 	"add",
@@ -69,7 +106,7 @@ dnssd_struct_inspect(VALUE self, volatile VALUE data)
 	VALUE buf = rb_str_buf_new(0);
 	rb_str_buf_cat2(buf, "#<");
 	rb_str_buf_cat2(buf, rb_obj_classname(self));
-	if (RSTRING(data)->len > 0) {
+	if (RSTRING_LEN(data) > 0) {
 		rb_str_buf_cat2(buf, " ");
 		rb_str_buf_append(buf, data);
 	}
@@ -96,19 +133,214 @@ dnssd_create_fullname(VALUE name, VALUE regtype, VALUE domain, int err_flag)
 	return rb_str_new2(buffer);
 }
 
+static void
+dnssd_reply_mark(void *ptr)
+{
+	dnssd_reply_struct_t *reply = (dnssd_reply_struct_t *)ptr;
+	int i;
+	if (!reply) return;
+	rb_gc_mark(reply->service);
+	for (i=0; i<DNSSD_MAX_FIELDS; i++) {
+		if (reply->fields[i] != Qundef) rb_gc_mark(reply->fields[i]);
+	}
+}
+
+static void
+dnssd_reply_free(void *ptr)
+{
+	xfree(ptr);
+}
+
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+static size_t
+dnssd_reply_memsize(const void *ptr)
+{
+	const dnssd_reply_struct_t *reply = (const dnssd_reply_struct_t *)ptr;
+	return reply ? sizeof(dnssd_reply_struct_t) + reply->data_len : 0;
+}
+
+static const rb_data_type_t dnssd_reply_data_type = {
+	"DNSSD::Reply",
+	{ dnssd_reply_mark, dnssd_reply_free, dnssd_reply_memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#define dnssd_reply_wrap(klass) TypedData_Wrap_Struct((klass), &dnssd_reply_data_type, 0)
+#define GetDNSSDReply(obj, var) \
+	TypedData_Get_Struct((obj), dnssd_reply_struct_t, &dnssd_reply_data_type, (var))
+#else
+/* ruby 1.8 and 1.9 */
+#define dnssd_reply_wrap(klass) \
+	Data_Wrap_Struct((klass), dnssd_reply_mark, dnssd_reply_free, 0)
+#define GetDNSSDReply(obj, var) Data_Get_Struct((obj), dnssd_reply_struct_t, (var))
+#endif
+
+/* Creates a reply of class _klass_ in _self_ with room for _len_ bytes
+ * of strings. */
+static dnssd_reply_struct_t *
+dnssd_reply_struct_new(volatile VALUE *self, VALUE klass, VALUE service,
+											 DNSServiceFlags flags, uint32_t interface, size_t len)
+{
+	dnssd_reply_struct_t *reply;
+	int i;
+	/* wrap first so the struct is never leaked */
+	*self = dnssd_reply_wrap(klass);
+	reply = (dnssd_reply_struct_t *)xmalloc(sizeof(dnssd_reply_struct_t) + len);
+	MEMZERO(reply, dnssd_reply_struct_t, 1);
+	reply->service = service;
+	reply->flags = flags;
+	reply->interface = interface;
+	for (i=0; i<DNSSD_MAX_FIELDS; i++) {
+		reply->fields[i] = Qundef;
+	}
+	reply->data_len = len;
+	DATA_PTR(*self) = reply;
+	return reply;
+}
+
+/* copies _len_ bytes of _src_ to *_p_, advancing it */
+static const char *
+dnssd_reply_struct_copy(char **p, const char *src, size_t len)
+{
+	char *dst = *p;
+	if (len > 0) memcpy(dst, src, len);
+	*p += len;
+	return dst;
+}
+
+#define dnssd_reply_struct_str(p, str) \
+	dnssd_reply_struct_copy((p), (str), strlen(str) + 1)
+
+static VALUE dnssd_flags_new(DNSServiceFlags flags);
+
+/*
+ * Service types, domains and host names are the same for most replies,
+ * and a browser sees the same instance names again and again.  The
+ * strings of replies are interned: replies share one frozen String per
+ * distinct name.  Where ruby has no table of its own (before 3.0) the
+ * interned strings are kept in dnssd_intern_table, which stops growing
+ * at DNSSD_MAX_INTERNED_STRINGS entries.
+ */
+#ifndef HAVE_RB_ENC_INTERNED_STR
+static st_table *dnssd_intern_table;
+/* keeps the interned strings from being collected */
+static VALUE dnssd_interned = Qnil;
+#define DNSSD_MAX_INTERNED_STRINGS 4096
+#endif
+
 static VALUE
-dnssd_get_fullname(VALUE self, int flag)
+dnssd_intern(const char *str)
 {
-	return dnssd_create_fullname(	rb_ivar_get(self, dnssd_iv_name),
-																rb_ivar_get(self, dnssd_iv_type),
-																rb_ivar_get(self, dnssd_iv_domain), flag	);
+#ifdef HAVE_RB_ENC_INTERNED_STR
+	/* binary, like the other strings of replies */
+	return rb_enc_interned_str(str, (long)strlen(str), rb_ascii8bit_encoding());
+#else
+	st_data_t obj;
+	VALUE self;
+
+	if (st_lookup(dnssd_intern_table, (st_data_t)str, &obj))
+		return (VALUE)obj;
+	self = rb_obj_freeze(rb_str_new2(str));
+	if (dnssd_intern_table->num_entries < DNSSD_MAX_INTERNED_STRINGS) {
+		/* the key is a copy, a ruby string's bytes may move */
+		size_t len = strlen(str) + 1;
+		char *key = ALLOC_N(char, len);
+		memcpy(key, str, len);
+		rb_ary_push(dnssd_interned, self);
+		st_insert(dnssd_intern_table, (st_data_t)key, (st_data_t)self);
+	}
+	return self;
+#endif
+}
+
+/* The full name of _reply_, DNSServiceConstructFullName() is only
+ * called for browse and register replies.  Qnil if it fails. */
+static VALUE
+dnssd_reply_fullname_str(const dnssd_reply_struct_t *reply)
+{
+	char buffer[kDNSServiceMaxDomainName];
+	if (reply->fullname) return dnssd_intern(reply->fullname);
+	if (DNSServiceConstructFullName(buffer, reply->name,
+																	reply->regtype, reply->domain))
+		return Qnil;
+	buffer[kDNSServiceMaxDomainName - 1] = '\000'; /* just in case */
+	return dnssd_intern(buffer);
+}
+
+/* Returns field _field_ of the reply _self_, creating it on first use. */
+static VALUE
+dnssd_reply_field(VALUE self, int field)
+{
+	dnssd_reply_struct_t *reply;
+	VALUE obj = Qnil;
+
+	GetDNSSDReply(self, reply);
+	if (reply->fields[field] != Qundef) return reply->fields[field];
+
+	switch (field) {
+	case DNSSD_FIELD_FLAGS:
+		obj = dnssd_flags_new(reply->flags);
+		break;
+	case DNSSD_FIELD_INTERFACE:
+		obj = dnssd_interface_name(reply->interface);
+		break;
+	/* a resolve reply only has them if set by dnssd_resolve_set_names() */
+	case DNSSD_FIELD_NAME:
+		if (reply->name) obj = dnssd_intern(reply->name);
+		break;
+	case DNSSD_FIELD_TYPE:
+		if (reply->regtype) obj = dnssd_intern(reply->regtype);
+		break;
+	case DNSSD_FIELD_DOMAIN:
+		if (reply->domain) obj = dnssd_intern(reply->domain);
+		break;
+	case DNSSD_FIELD_FULLNAME:
+		obj = dnssd_reply_fullname_str(reply);
+		/* not memoized, so each call raises */
+		if (NIL_P(obj)) return obj;
+		break;
+	case DNSSD_FIELD_TARGET:
+		obj = dnssd_intern(reply->target);
+		break;
+	case DNSSD_FIELD_DATA:
+		if (reply->rrtype) {
+			obj = rb_obj_freeze(rb_str_new(reply->bytes, reply->bytes_len));
+		} else {
+			obj = dnssd_tr_new((long)reply->bytes_len, reply->bytes);
+		}
+		break;
+	case DNSSD_FIELD_LAZY_TEXT_RECORD:
+		/* the bytes are those of the reply */
+		obj = dnssd_tr_lazy_new(self, (long)reply->bytes_len, reply->bytes);
+		break;
+	}
+	reply->fields[field] = obj;
+	return obj;
+}
+
+static VALUE
+dnssd_get_fullname(VALUE self, int err_flag)
+{
+	VALUE fullname = dnssd_reply_field(self, DNSSD_FIELD_FULLNAME);
+	if (NIL_P(fullname)) {
+		static const char msg[] = "could not construct full service name";
+		if (err_flag) rb_raise(rb_eArgError, msg);
+		/* else */
+		rb_warn(msg);
+		return dnssd_reply_field(self, DNSSD_FIELD_NAME);
+	}
+	return fullname;
 }
 
 /*
  * call-seq:
  *    reply.fullname => string
  *
- * The fullname of the resource the reply is associated with.
+ * The fullname of the resource the reply is associated with, in the form
+ * "<servicename>.<protocol>.<domain>.".
+ * (Any literal dots (".") are escaped with a backslash ("\."), and literal
+ * backslashes are escaped with a second backslash ("\\"), e.g. a web server
+ * named "Dr. Pepper" would have the fullname  "Dr\.\032Pepper._http._tcp.local.".)
  * See DNSSD::Service.fullname() for more information.
  */
 
@@ -118,71 +350,113 @@ dnssd_reply_fullname(VALUE self)
 	return dnssd_get_fullname(self, 1);
 }
 
-static void
-dnssd_add_names(volatile VALUE self, const char *name,
-								const char *regtype, const char *domain)
+/*
+ * call-seq:
+ *    reply.flags => flags
+ *
+ * Flags describing the reply.  See DNSSD::Flags for more information.
+ */
+
+static VALUE
+dnssd_reply_flags(VALUE self)
 {
-	rb_ivar_set(self, dnssd_iv_name, rb_str_new2(name));
-	rb_ivar_set(self, dnssd_iv_type, rb_str_new2(regtype));
-	rb_ivar_set(self, dnssd_iv_domain, rb_str_new2(domain));
+	return dnssd_reply_field(self, DNSSD_FIELD_FLAGS);
 }
 
-static void
-dnssd_init_flag_iv(void)
+/*
+ * call-seq:
+ *    reply.service => service
+ *
+ * The service associated with the reply.
+ * See DNSSD::Service for more information.
+ */
+
+static VALUE
+dnssd_reply_service(VALUE self)
 {
-	/* initialize flag instance variable ids. */
-	char buffer[32];
-	int i;
-	for (i=0; i<DNSSD_MAX_FLAGS; i++) {
-		snprintf(buffer, sizeof(buffer), "@%s", dnssd_flag_name[i]);
-		dnssd_flag_iv[i] = rb_intern(buffer);
-	}
+	dnssd_reply_struct_t *reply;
+	GetDNSSDReply(self, reply);
+	return reply->service;
 }
 
-static void
-dnssd_init_flags_methods(VALUE class)
+/*
+ * call-seq:
+ *    reply.interface => string or integer
+ *
+ * The name of the interface the reply was received on, or its index if
+ * it has no name.  Pass it to DNSSD.resolve() when resolving a browsed
+ * service.
+ */
+
+static VALUE
+dnssd_reply_interface(VALUE self)
 {
-	char buffer[128];
-	int i;
-	for (i=0; i<DNSSD_MAX_FLAGS; i++) {
-		volatile VALUE str;
-		size_t len = snprintf(buffer, sizeof(buffer),
-													"def %s?; @%s end",
-													dnssd_flag_name[i],
-													dnssd_flag_name[i]);
-		str = rb_str_new(buffer, (long)len);
-		rb_mod_module_eval(1, (VALUE *)&str, class);
-		/* attr_writer method for each flag */
-		rb_define_attr(class, dnssd_flag_name[i], 0, 1);
-	}
+	return dnssd_reply_field(self, DNSSD_FIELD_INTERFACE);
 }
 
+/*
+ * call-seq:
+ *    reply.name => string
+ *
+ * The service name discovered or registered.
+ * (If the application did not specify a name in DNSSD.register(),
+ * this indicates what name was automatically chosen.)
+ */
+
 static VALUE
-dnssd_flags_init(VALUE self, DNSServiceFlags flags)
+dnssd_reply_name(VALUE self)
 {
-	int i;
-	for (i=0; i<DNSSD_MAX_FLAGS; i++) {
-		/* check each flag using binary and, set to Qtrue of exists */
-		if (flags & dnssd_flag[i]) {
-			rb_ivar_set(self, dnssd_flag_iv[i], Qtrue);
-		} else {
-			rb_ivar_set(self, dnssd_flag_iv[i], Qfalse);
-		}
-	}
-	return self;
+	return dnssd_reply_field(self, DNSSD_FIELD_NAME);
+}
+
+/*
+ * call-seq:
+ *    reply.type => string
+ *
+ * The service type, as passed to DNSSD.browse() or DNSSD.register().
+ */
+
+static VALUE
+dnssd_reply_type(VALUE self)
+{
+	return dnssd_reply_field(self, DNSSD_FIELD_TYPE);
+}
+
+/*
+ * call-seq:
+ *    reply.domain => string
+ *
+ * The domain on which the service was discovered or registered.
+ * (If the application did not specify a domain, this indicates the
+ * default domain that was used.)
+ */
+
+static VALUE
+dnssd_reply_domain(VALUE self)
+{
+	return dnssd_reply_field(self, DNSSD_FIELD_DOMAIN);
 }
 
-static DNSServiceFlags 
+static ID dnssd_iv_flags;
+
+/* the interned flags by value, see dnssd_flags_new() */
+static st_table *dnssd_flags_table;
+/* keeps the interned flags from being collected */
+static VALUE dnssd_flags_interned = Qnil;
+/* at most this many distinct values are interned */
+#define DNSSD_MAX_INTERNED_FLAGS 256
+
+static DNSServiceFlags
 dnssd_get_flags(VALUE self)
 {
-	DNSServiceFlags flags = 0;
-	int i;
-	for (i=0; i<DNSSD_MAX_FLAGS; i++) {
-		if (RTEST(rb_ivar_get(self, dnssd_flag_iv[i]))) {
-			flags |= dnssd_flag[i];
-		}
-	}
-	return flags;
+	VALUE flags = rb_ivar_get(self, dnssd_iv_flags);
+	return NIL_P(flags) ? 0 : (DNSServiceFlags)NUM2ULONG(flags);
+}
+
+static void
+dnssd_set_flags(VALUE self, DNSServiceFlags flags)
+{
+	rb_ivar_set(self, dnssd_iv_flags, ULONG2NUM(flags));
 }
 
 DNSServiceFlags 
@@ -197,6 +471,78 @@ dnssd_to_flags(VALUE obj)
 	return flags;
 }
 
+/* sets or clears _flag_ in _self_ depending on _val_ */
+static VALUE
+dnssd_flags_set(VALUE self, DNSServiceFlags flag, VALUE val)
+{
+	DNSServiceFlags flags;
+	if (OBJ_FROZEN(self)) rb_error_frozen(rb_obj_classname(self));
+	flags = dnssd_get_flags(self);
+	dnssd_set_flags(self, RTEST(val) ? (flags | flag) : (flags & ~flag));
+	return val;
+}
+
+/* a flag? predicate and a flag= writer for each flag */
+#define DNSSD_FLAG_METHODS(name, flag) \
+static VALUE \
+dnssd_flags_##name##_p(VALUE self) \
+{ \
+	return (dnssd_get_flags(self) & (flag)) ? Qtrue : Qfalse; \
+} \
+static VALUE \
+dnssd_flags_##name##_set(VALUE self, VALUE val) \
+{ \
+	return dnssd_flags_set(self, (flag), val); \
+}
+
+DNSSD_FLAG_METHODS(more_coming, kDNSServiceFlagsMoreComing)
+DNSSD_FLAG_METHODS(add, kDNSServiceFlagsAdd)
+DNSSD_FLAG_METHODS(default, kDNSServiceFlagsDefault)
+DNSSD_FLAG_METHODS(no_auto_rename, kDNSServiceFlagsNoAutoRename)
+DNSSD_FLAG_METHODS(shared, kDNSServiceFlagsShared)
+DNSSD_FLAG_METHODS(unique, kDNSServiceFlagsUnique)
+DNSSD_FLAG_METHODS(browse_domains, kDNSServiceFlagsBrowseDomains)
+DNSSD_FLAG_METHODS(registration_domains, kDNSServiceFlagsRegistrationDomains)
+DNSSD_FLAG_METHODS(long_lived_query, kDNSServiceFlagsLongLivedQuery)
+
+/* in the order of dnssd_flag and dnssd_flag_name */
+static VALUE (*const dnssd_flag_p[DNSSD_MAX_FLAGS])(VALUE) = {
+	dnssd_flags_more_coming_p,
+	dnssd_flags_add_p,
+	dnssd_flags_default_p,
+	dnssd_flags_no_auto_rename_p,
+	dnssd_flags_shared_p,
+	dnssd_flags_unique_p,
+	dnssd_flags_browse_domains_p,
+	dnssd_flags_registration_domains_p,
+	dnssd_flags_long_lived_query_p
+};
+
+static VALUE (*const dnssd_flag_set[DNSSD_MAX_FLAGS])(VALUE, VALUE) = {
+	dnssd_flags_more_coming_set,
+	dnssd_flags_add_set,
+	dnssd_flags_default_set,
+	dnssd_flags_no_auto_rename_set,
+	dnssd_flags_shared_set,
+	dnssd_flags_unique_set,
+	dnssd_flags_browse_domains_set,
+	dnssd_flags_registration_domains_set,
+	dnssd_flags_long_lived_query_set
+};
+
+static void
+dnssd_init_flags_methods(VALUE class)
+{
+	char buffer[32];
+	int i;
+	for (i=0; i<DNSSD_MAX_FLAGS; i++) {
+		snprintf(buffer, sizeof(buffer), "%s?", dnssd_flag_name[i]);
+		rb_define_method(class, buffer, dnssd_flag_p[i], 0);
+		snprintf(buffer, sizeof(buffer), "%s=", dnssd_flag_name[i]);
+		rb_define_method(class, buffer, dnssd_flag_set[i], 1);
+	}
+}
+
 /*
  * call-seq:
  *   DNSSD::Flags.new()         => flags
@@ -228,13 +574,31 @@ dnssd_flags_initialize(int argc, VALUE *argv, VALUE self)
 	if (def_val != Qnil) {
 		flags = dnssd_to_flags(def_val);
 	}
-	return dnssd_flags_init(self, flags);
+	dnssd_set_flags(self, flags);
+	return self;
 }
 
+/* The frozen flags for _flags_.  Replies with the same flags share one
+ * object, so creating a reply normally creates no flags.  Other Ractors
+ * share it too, a reply's flags can be sent to one without a copy.
+ * The table is the main Ractor's, the others create their flags. */
 static VALUE
 dnssd_flags_new(DNSServiceFlags flags)
 {
-	return dnssd_flags_init(rb_obj_alloc(cDNSSDFlags), flags);
+	st_data_t obj;
+	VALUE self;
+	int interned = dnssd_loop_is_main();
+
+	if (interned && st_lookup(dnssd_flags_table, (st_data_t)flags, &obj))
+		return (VALUE)obj;
+	self = rb_obj_alloc(cDNSSDFlags);
+	dnssd_set_flags(self, flags);
+	rb_ractor_make_shareable(self);
+	if (interned && dnssd_flags_table->num_entries < DNSSD_MAX_INTERNED_FLAGS) {
+		rb_ary_push(dnssd_flags_interned, self);
+		st_insert(dnssd_flags_table, (st_data_t)flags, (st_data_t)self);
+	}
+	return self;
 }
 
 /*
@@ -255,16 +619,17 @@ static VALUE
 dnssd_flags_list(VALUE self)
 {
 	VALUE buf = rb_str_buf_new(0);
+	DNSServiceFlags flags = dnssd_get_flags(self);
 	int i;
 	for (i=0; i<DNSSD_MAX_FLAGS; i++) {
-		if (rb_ivar_get(self, dnssd_flag_iv[i])) {
+		if (flags & dnssd_flag[i]) {
 			rb_str_buf_cat2(buf, dnssd_flag_name[i]);
 			rb_str_buf_cat2(buf, ",");
 		}
 	}
 	/* get rid of trailing comma */
-	if (RSTRING(buf)->len > 0) {
-		RSTRING(buf)->len--;
+	if (RSTRING_LEN(buf) > 0) {
+		rb_str_set_len(buf, RSTRING_LEN(buf) - 1);
 	}
 	return buf;
 }
@@ -311,21 +676,10 @@ dnssd_flags_equal(VALUE self, VALUE obj)
 	return flags == obj_flags ? Qtrue : Qfalse;
 }
 
-static VALUE
-dnssd_interface_name(uint32_t interface)
-{
-	char buffer[IF_NAMESIZE];
-	if (if_indextoname(interface, buffer)) {
-		return rb_str_new2(buffer);
-	} else {
-		return ULONG2NUM(interface);
-	}
-}
-
 static VALUE
 dnssd_get_interface(VALUE self)
 {
-	return rb_String(rb_ivar_get(self, dnssd_iv_interface));
+	return rb_String(dnssd_reply_field(self, DNSSD_FIELD_INTERFACE));
 }
 
 /*
@@ -345,10 +699,17 @@ VALUE
 dnssd_register_new(VALUE service,	DNSServiceFlags flags, const char *name,
 										const char *regtype, const char *domain	)
 {
-	volatile VALUE self = rb_obj_alloc(cDNSSDRegisterReply);
-	rb_ivar_set(self, dnssd_iv_flags, dnssd_flags_new(flags));
-	rb_ivar_set(self, dnssd_iv_service, service);
-	dnssd_add_names(self, name, regtype, domain);
+	volatile VALUE self;
+	size_t name_len = strlen(name) + 1;
+	size_t regtype_len = strlen(regtype) + 1;
+	size_t domain_len = strlen(domain) + 1;
+	dnssd_reply_struct_t *reply =
+		dnssd_reply_struct_new(&self, cDNSSDRegisterReply, service, flags, 0,
+													 name_len + regtype_len + domain_len);
+	char *p = reply->data;
+	reply->name = dnssd_reply_struct_copy(&p, name, name_len);
+	reply->regtype = dnssd_reply_struct_copy(&p, regtype, regtype_len);
+	reply->domain = dnssd_reply_struct_copy(&p, domain, domain_len);
 	return self;
 }
 
@@ -372,14 +733,79 @@ VALUE
 dnssd_browse_new(VALUE service,	DNSServiceFlags flags, uint32_t interface,
 									const char *name, const char *regtype, const char *domain)
 {
-	volatile VALUE self = rb_obj_alloc(cDNSSDBrowseReply);
-	rb_ivar_set(self, dnssd_iv_flags, dnssd_flags_new(flags));
-	rb_ivar_set(self, dnssd_iv_interface, dnssd_interface_name(interface));
-	rb_ivar_set(self, dnssd_iv_service, service);
-	dnssd_add_names(self, name, regtype, domain);
+	volatile VALUE self;
+	size_t name_len = strlen(name) + 1;
+	size_t regtype_len = strlen(regtype) + 1;
+	size_t domain_len = strlen(domain) + 1;
+	dnssd_reply_struct_t *reply =
+		dnssd_reply_struct_new(&self, cDNSSDBrowseReply, service, flags, interface,
+													 name_len + regtype_len + domain_len);
+	char *p = reply->data;
+	reply->name = dnssd_reply_struct_copy(&p, name, name_len);
+	reply->regtype = dnssd_reply_struct_copy(&p, regtype, regtype_len);
+	reply->domain = dnssd_reply_struct_copy(&p, domain, domain_len);
 	return self;
 }
 
+/*
+ * call-seq:
+ *    resolve_reply.target => string
+ *
+ * The target hostname of the machine providing the service.
+ * This name can be passed to functions like Socket.gethostbyname()
+ * to identify the host's IP address.
+ */
+
+static VALUE
+dnssd_resolve_target(VALUE self)
+{
+	return dnssd_reply_field(self, DNSSD_FIELD_TARGET);
+}
+
+/*
+ * call-seq:
+ *    resolve_reply.port => integer
+ *
+ * The port on which connections are accepted for this service.
+ */
+
+static VALUE
+dnssd_resolve_port(VALUE self)
+{
+	dnssd_reply_struct_t *reply;
+	GetDNSSDReply(self, reply);
+	return UINT2NUM(reply->port);
+}
+
+/*
+ * call-seq:
+ *    resolve_reply.text_record => text_record
+ *
+ * The service's primary text record, see DNSSD::TextRecord for more
+ * information.
+ */
+
+static VALUE
+dnssd_resolve_text_record(VALUE self)
+{
+	return dnssd_reply_field(self, DNSSD_FIELD_DATA);
+}
+
+/*
+ * call-seq:
+ *    resolve_reply.lazy_text_record => lazy_text_record
+ *
+ * The service's primary text record as a DNSSD::LazyTextRecord, which
+ * shares the bytes of the reply and creates no String until a key is
+ * looked up.
+ */
+
+static VALUE
+dnssd_resolve_lazy_text_record(VALUE self)
+{
+	return dnssd_reply_field(self, DNSSD_FIELD_LAZY_TEXT_RECORD);
+}
+
 /*
  * call-seq:
  *    resolve_reply.inspect => string
@@ -390,15 +816,15 @@ static VALUE
 dnssd_resolve_inspect(VALUE self)
 {
 	volatile VALUE data = rb_str_buf_new(0);
-	rb_str_buf_append(data, rb_ivar_get(self, dnssd_iv_fullname));
+	rb_str_buf_append(data, dnssd_get_fullname(self, 0));
 	rb_str_buf_cat2(data, " interface:");
 	rb_str_buf_append(data, dnssd_get_interface(self));
 	rb_str_buf_cat2(data, " target:");
-	rb_str_buf_append(data, rb_ivar_get(self, dnssd_iv_target));
+	rb_str_buf_append(data, dnssd_resolve_target(self));
 	rb_str_buf_cat2(data, ":");
-	rb_str_buf_append(data, rb_inspect(rb_ivar_get(self, dnssd_iv_port)));
+	rb_str_buf_append(data, rb_inspect(dnssd_resolve_port(self)));
 	rb_str_buf_cat2(data, " ");
-	rb_str_buf_append(data, rb_inspect(rb_ivar_get(self, dnssd_iv_text_record)));
+	rb_str_buf_append(data, rb_inspect(dnssd_resolve_text_record(self)));
 	return dnssd_struct_inspect(self, data);
 }
 
@@ -407,15 +833,264 @@ dnssd_resolve_new(VALUE service, DNSServiceFlags flags, uint32_t interface,
 									const char *fullname, const char *host_target,
 									uint16_t opaqueport, uint16_t txt_len, const char *txt_rec)
 {
-	uint16_t port = ntohs(opaqueport);
-	volatile VALUE self = rb_obj_alloc(cDNSSDResolveReply);
-	rb_ivar_set(self, dnssd_iv_flags, dnssd_flags_new(flags));
-	rb_ivar_set(self, dnssd_iv_interface, dnssd_interface_name(interface));
-	rb_ivar_set(self, dnssd_iv_fullname, rb_str_new2(fullname));
-	rb_ivar_set(self, dnssd_iv_target, rb_str_new2(host_target));
-	rb_ivar_set(self, dnssd_iv_port, UINT2NUM(port));
-	rb_ivar_set(self, dnssd_iv_text_record, dnssd_tr_new((long)txt_len, txt_rec));
-	rb_ivar_set(self, dnssd_iv_service, service);
+	volatile VALUE self;
+	size_t fullname_len = strlen(fullname) + 1;
+	size_t target_len = strlen(host_target) + 1;
+	dnssd_reply_struct_t *reply =
+		dnssd_reply_struct_new(&self, cDNSSDResolveReply, service, flags, interface,
+													 fullname_len + target_len + txt_len);
+	char *p = reply->data;
+	reply->fullname = dnssd_reply_struct_copy(&p, fullname, fullname_len);
+	reply->target = dnssd_reply_struct_copy(&p, host_target, target_len);
+	reply->port = ntohs(opaqueport);
+	reply->bytes_len = txt_len;
+	reply->bytes = dnssd_reply_struct_copy(&p, txt_rec, txt_len);
+	return self;
+}
+
+void
+dnssd_resolve_set_names(VALUE self, const char *name, const char *regtype,
+												const char *domain)
+{
+	dnssd_reply_struct_t *reply;
+	GetDNSSDReply(self, reply);
+	reply->fields[DNSSD_FIELD_NAME] = dnssd_intern(name);
+	reply->fields[DNSSD_FIELD_TYPE] = dnssd_intern(regtype);
+	reply->fields[DNSSD_FIELD_DOMAIN] = dnssd_intern(domain);
+}
+
+static const struct {
+	const char *name;
+	uint16_t rrtype;
+} dnssd_rrtypes[] = {
+	{ "A", DNSSD_RR_A },
+	{ "NS", 2 },
+	{ "CNAME", 5 },
+	{ "PTR", 12 },
+	{ "HINFO", 13 },
+	{ "TXT", DNSSD_RR_TXT },
+	{ "AAAA", DNSSD_RR_AAAA },
+	{ "SRV", DNSSD_RR_SRV },
+	{ "ANY", 255 }
+};
+
+#define DNSSD_MAX_RRTYPES (sizeof(dnssd_rrtypes) / sizeof(dnssd_rrtypes[0]))
+
+uint16_t
+dnssd_to_rrtype(VALUE obj)
+{
+	const char *name;
+	size_t i;
+	if (SYMBOL_P(obj)) {
+		name = rb_id2name(SYM2ID(obj));
+	} else if (rb_respond_to(obj, rb_intern("to_str"))) {
+		name = StringValueCStr(obj);
+	} else {
+		return (uint16_t)NUM2UINT(obj);
+	}
+	for (i=0; i<DNSSD_MAX_RRTYPES; i++) {
+		if (strcasecmp(name, dnssd_rrtypes[i].name) == 0)
+			return dnssd_rrtypes[i].rrtype;
+	}
+	rb_raise(rb_eArgError, "unknown resource record type: %s", name);
+	return 0;
+}
+
+static const char *
+dnssd_rrtype_name(uint16_t rrtype)
+{
+	size_t i;
+	for (i=0; i<DNSSD_MAX_RRTYPES; i++) {
+		if (dnssd_rrtypes[i].rrtype == rrtype)
+			return dnssd_rrtypes[i].name;
+	}
+	return NULL;
+}
+
+/* Converts the uncompressed domain name in rdata at _p_ to a string,
+ * escaped like DNSSD::ResolveReply#target. */
+static VALUE
+dnssd_rdata_name(const unsigned char *p, const unsigned char *end)
+{
+	VALUE name = rb_str_buf_new(end - p);
+	while (p < end && *p) {
+		unsigned int i, len = *p++;
+		/* compression pointers are not used in the daemon's rdata */
+		if (len > 63 || p + len > end) break;
+		for (i=0; i<len; i++) {
+			unsigned char c = p[i];
+			if (c == '.' || c == '\\') {
+				rb_str_buf_cat(name, "\\", 1);
+				rb_str_buf_cat(name, (const char *)&c, 1);
+			} else if (c <= ' ') {
+				char buf[5];
+				snprintf(buf, sizeof(buf), "\\%03u", c);
+				rb_str_buf_cat2(name, buf);
+			} else {
+				rb_str_buf_cat(name, (const char *)&c, 1);
+			}
+		}
+		rb_str_buf_cat(name, ".", 1);
+		p += len;
+	}
+	if (RSTRING_LEN(name) == 0) rb_str_buf_cat(name, ".", 1);
+	return name;
+}
+
+/*
+ * call-seq:
+ *    record_reply.value => object
+ *
+ * The rdata of _record_reply_ decoded according to its type:
+ *
+ * A, AAAA:: the address as a String, e.g. "192.168.1.2" or "fe80::1"
+ * SRV:: <code>[priority, weight, port, target]</code>
+ * TXT:: a DNSSD::TextRecord
+ *
+ * Other types (or malformed rdata) return the raw rdata, see
+ * DNSSD::RecordReply#rdata.
+ */
+
+static VALUE
+dnssd_record_value(VALUE self)
+{
+	dnssd_reply_struct_t *reply;
+	const unsigned char *p;
+	long len;
+	char buf[INET6_ADDRSTRLEN];
+
+	GetDNSSDReply(self, reply);
+	p = (const unsigned char *)reply->bytes;
+	len = reply->bytes_len;
+	switch (reply->rrtype) {
+	case DNSSD_RR_A:
+		if (len == 4 && inet_ntop(AF_INET, p, buf, sizeof(buf)))
+			return rb_str_new2(buf);
+		break;
+	case DNSSD_RR_AAAA:
+		if (len == 16 && inet_ntop(AF_INET6, p, buf, sizeof(buf)))
+			return rb_str_new2(buf);
+		break;
+	case DNSSD_RR_SRV:
+		/* priority, weight and port are in network byte order */
+		if (len > 6)
+			return rb_ary_new3(4, UINT2NUM((p[0] << 8) | p[1]),
+												 UINT2NUM((p[2] << 8) | p[3]),
+												 UINT2NUM((p[4] << 8) | p[5]),
+												 dnssd_rdata_name(p + 6, p + len));
+		break;
+	case DNSSD_RR_TXT:
+		return dnssd_tr_new(len, (const char *)p);
+	}
+	return dnssd_reply_field(self, DNSSD_FIELD_DATA);
+}
+
+/*
+ * call-seq:
+ *    record_reply.rrtype => integer
+ *
+ * The record's type, e.g. DNSSD::RecordReply::AAAA.
+ */
+
+static VALUE
+dnssd_record_rrtype(VALUE self)
+{
+	dnssd_reply_struct_t *reply;
+	GetDNSSDReply(self, reply);
+	return UINT2NUM(reply->rrtype);
+}
+
+/*
+ * call-seq:
+ *    record_reply.rrclass => integer
+ *
+ * The record's class, usually DNSSD::RecordReply::IN.
+ */
+
+static VALUE
+dnssd_record_rrclass(VALUE self)
+{
+	dnssd_reply_struct_t *reply;
+	GetDNSSDReply(self, reply);
+	return UINT2NUM(reply->rrclass);
+}
+
+/*
+ * call-seq:
+ *    record_reply.rdata => string
+ *
+ * The record's raw rdata as a frozen binary String.
+ */
+
+static VALUE
+dnssd_record_rdata(VALUE self)
+{
+	return dnssd_reply_field(self, DNSSD_FIELD_DATA);
+}
+
+/*
+ * call-seq:
+ *    record_reply.ttl => integer
+ *
+ * The record's time to live in seconds.
+ */
+
+static VALUE
+dnssd_record_ttl(VALUE self)
+{
+	dnssd_reply_struct_t *reply;
+	GetDNSSDReply(self, reply);
+	return ULONG2NUM(reply->ttl);
+}
+
+/*
+ * call-seq:
+ *    record_reply.inspect => string
+ *
+ */
+
+static VALUE
+dnssd_record_inspect(VALUE self)
+{
+	volatile VALUE data = rb_str_buf_new(0);
+	dnssd_reply_struct_t *reply;
+	const char *rrtype_name;
+
+	GetDNSSDReply(self, reply);
+	rrtype_name = dnssd_rrtype_name(reply->rrtype);
+	rb_str_buf_append(data, dnssd_get_fullname(self, 0));
+	rb_str_buf_cat2(data, " interface:");
+	rb_str_buf_append(data, dnssd_get_interface(self));
+	rb_str_buf_cat2(data, " type:");
+	if (rrtype_name) {
+		rb_str_buf_cat2(data, rrtype_name);
+	} else {
+		rb_str_buf_append(data, rb_inspect(dnssd_record_rrtype(self)));
+	}
+	rb_str_buf_cat2(data, " ttl:");
+	rb_str_buf_append(data, rb_inspect(dnssd_record_ttl(self)));
+	rb_str_buf_cat2(data, " ");
+	rb_str_buf_append(data, rb_inspect(dnssd_record_value(self)));
+	return dnssd_struct_inspect(self, data);
+}
+
+VALUE
+dnssd_record_new(VALUE service, DNSServiceFlags flags, uint32_t interface,
+								 const char *fullname, uint16_t rrtype, uint16_t rrclass,
+								 uint16_t rdlen, const char *rdata, uint32_t ttl)
+{
+	volatile VALUE self;
+	size_t fullname_len = strlen(fullname) + 1;
+	dnssd_reply_struct_t *reply =
+		dnssd_reply_struct_new(&self, cDNSSDRecordReply, service, flags, interface,
+													 fullname_len + rdlen);
+	char *p = reply->data;
+	reply->fullname = dnssd_reply_struct_copy(&p, fullname, fullname_len);
+	reply->rrtype = rrtype;
+	reply->rrclass = rrclass;
+	reply->ttl = ttl;
+	reply->bytes_len = rdlen;
+	reply->bytes = dnssd_reply_struct_copy(&p, rdata, rdlen);
 	return self;
 }
 
@@ -431,6 +1106,14 @@ dnssd_reply_initialize(int argc, VALUE *argv, VALUE reply)
 	return Qnil;
 }
 
+/* replies are created by dnssd_reply_struct_new(), never allocated */
+static VALUE
+dnssd_reply_s_alloc(VALUE klass)
+{
+	dnssd_instantiation_error(rb_class2name(klass));
+	return Qnil;
+}
+
 void
 Init_DNSSD_Replies(void)
 {
@@ -440,21 +1123,21 @@ Init_DNSSD_Replies(void)
 #endif
 
 	dnssd_iv_flags = rb_intern("@flags");
-	dnssd_iv_interface = rb_intern("@interface");
-	dnssd_iv_fullname = rb_intern("@fullname");
-	dnssd_iv_target = rb_intern("@target");
-	dnssd_iv_port = rb_intern("@port");
-	dnssd_iv_text_record = rb_intern("@text_record");
-	dnssd_iv_name = rb_intern("@name");
-	dnssd_iv_type = rb_intern("@type");
-	dnssd_iv_domain = rb_intern("@domain");
-	dnssd_iv_service = rb_intern("@service");
-
-	dnssd_init_flag_iv();
+	dnssd_flags_table = st_init_numtable();
+#ifndef HAVE_RB_ENC_INTERNED_STR
+	dnssd_intern_table = st_init_strtable();
+	dnssd_interned = rb_ary_new();
+	rb_global_variable(&dnssd_interned);
+#endif
+	dnssd_flags_interned = rb_ary_new();
+	rb_global_variable(&dnssd_flags_interned);
 
+	/* flags and replies only use their own state (or the main Ractor's
+	 * tables from the main Ractor), any Ractor may call them */
+	rb_ext_ractor_safe(1);
 	cDNSSDFlags = rb_define_class_under(mDNSSD, "Flags", rb_cObject);
 	rb_define_method(cDNSSDFlags, "initialize", dnssd_flags_initialize, -1);
-	/* this creates all the attr_accessor and flag? methods */
+	/* this creates all the flag= and flag? methods */
 	dnssd_init_flags_methods(cDNSSDFlags);
 	rb_define_method(cDNSSDFlags, "inspect", dnssd_flags_inspect, 0);
 	rb_define_method(cDNSSDFlags, "to_i", dnssd_flags_to_i, 0);
@@ -463,59 +1146,57 @@ Init_DNSSD_Replies(void)
 	/* prototype: rb_define_attr(class, name, read, write) */
 	cDNSSDReply = rb_define_class_under(mDNSSD, "Reply", rb_cObject);
 	/* DNSSD::Reply objects can only be instantiated by DNSSD.browse(), DNSSD.register(), DNSSD.resolve(). */
+	rb_define_alloc_func(cDNSSDReply, dnssd_reply_s_alloc);
 	rb_define_method(cDNSSDReply, "initialize", dnssd_reply_initialize, -1);
-	/* Flags describing the reply.  See DNSSD::Flags for more information. */
-	rb_define_attr(cDNSSDReply, "flags", 1, 0);
-	/* The service associated with the reply.  See DNSSD::Service for more information. */
-	rb_define_attr(cDNSSDReply, "service", 1, 0);
+	rb_define_method(cDNSSDReply, "flags", dnssd_reply_flags, 0);
+	rb_define_method(cDNSSDReply, "service", dnssd_reply_service, 0);
 	rb_define_method(cDNSSDReply, "fullname", dnssd_reply_fullname, 0);
 
 	cDNSSDBrowseReply = rb_define_class_under(mDNSSD, "BrowseReply", cDNSSDReply);
-	/* The interface on which the service is advertised.
-	 * The interface should be passed to DNSSD.resolve() when resolving the service. */
-	rb_define_attr(cDNSSDBrowseReply, "interface", 1, 0);
-	/* The service name discovered. */
-	rb_define_attr(cDNSSDBrowseReply, "name", 1, 0);
-	/* The service type, as passed in to DNSSD.browse(). */
-	rb_define_attr(cDNSSDBrowseReply, "type", 1, 0);
-	/* The domain on which the service was discovered.
-	 * (If the application did not specify a domain in DNSSD.browse(),
-	 * this indicates the domain on which the service was discovered.) */
-	rb_define_attr(cDNSSDBrowseReply, "domain", 1, 0);
+	rb_define_method(cDNSSDBrowseReply, "interface", dnssd_reply_interface, 0);
+	rb_define_method(cDNSSDBrowseReply, "name", dnssd_reply_name, 0);
+	rb_define_method(cDNSSDBrowseReply, "type", dnssd_reply_type, 0);
+	rb_define_method(cDNSSDBrowseReply, "domain", dnssd_reply_domain, 0);
 	rb_define_method(cDNSSDBrowseReply, "inspect", dnssd_browse_inspect, 0);
 
 	cDNSSDResolveReply = rb_define_class_under(mDNSSD, "ResolveReply", cDNSSDReply);
-	/* The interface on which the service was resolved. */
-	rb_define_attr(cDNSSDResolveReply, "interface", 1, 0);
-	/* The full service domain name, in the form "<servicename>.<protocol>.<domain>.".
-	 * (Any literal dots (".") are escaped with a backslash ("\."), and literal
-	 * backslashes are escaped with a second backslash ("\\"), e.g. a web server
-	 * named "Dr. Pepper" would have the fullname  "Dr\.\032Pepper._http._tcp.local.".)
-	 * See DNSSD::Service.fullname() for more information. */
-	rb_define_attr(cDNSSDResolveReply, "fullname", 1, 0);
-	/* The target hostname of the machine providing the service.
-	 * This name can be passed to functions like Socket.gethostbyname()
-	 * to identify the host's IP address. */
-	rb_define_attr(cDNSSDResolveReply, "target", 1, 0);
-	/* The port on which connections are accepted for this service. */
-	rb_define_attr(cDNSSDResolveReply, "port", 1, 0);
-	/* The service's primary text record, see DNSSD::TextRecord for more information. */
-	rb_define_attr(cDNSSDResolveReply, "text_record", 1, 0);
+	rb_define_method(cDNSSDResolveReply, "interface", dnssd_reply_interface, 0);
+	/* nil unless resolved by DNSSD.browse_and_resolve() */
+	rb_define_method(cDNSSDResolveReply, "name", dnssd_reply_name, 0);
+	rb_define_method(cDNSSDResolveReply, "type", dnssd_reply_type, 0);
+	rb_define_method(cDNSSDResolveReply, "domain", dnssd_reply_domain, 0);
+	rb_define_method(cDNSSDResolveReply, "target", dnssd_resolve_target, 0);
+	rb_define_method(cDNSSDResolveReply, "port", dnssd_resolve_port, 0);
+	rb_define_method(cDNSSDResolveReply, "text_record", dnssd_resolve_text_record, 0);
+	rb_define_method(cDNSSDResolveReply, "lazy_text_record", dnssd_resolve_lazy_text_record, 0);
 	rb_define_method(cDNSSDResolveReply, "inspect", dnssd_resolve_inspect, 0);
 
 	cDNSSDRegisterReply = rb_define_class_under(mDNSSD, "RegisterReply", cDNSSDReply);
-	/* The service name registered.
-	 * (If the application did not specify a name in DNSSD.register(),
-	 * this indicates what name was automatically chosen.) */
-	rb_define_attr(cDNSSDRegisterReply, "name", 1, 0);
-	/* The type of service registered as it was passed to DNSSD.register(). */
-	rb_define_attr(cDNSSDRegisterReply, "type", 1, 0);
-	/* The domain on which the service was registered.
-	 * (If the application did not specify a domain in DNSSD.register(),
-	 * this indicates the default domain on which the service was registered.) */
-	rb_define_attr(cDNSSDRegisterReply, "domain", 1, 0);
+	rb_define_method(cDNSSDRegisterReply, "name", dnssd_reply_name, 0);
+	rb_define_method(cDNSSDRegisterReply, "type", dnssd_reply_type, 0);
+	rb_define_method(cDNSSDRegisterReply, "domain", dnssd_reply_domain, 0);
 	rb_define_method(cDNSSDRegisterReply, "inspect", dnssd_register_inspect, 0);
 
+	cDNSSDRecordReply = rb_define_class_under(mDNSSD, "RecordReply", cDNSSDReply);
+	rb_define_method(cDNSSDRecordReply, "interface", dnssd_reply_interface, 0);
+	rb_define_method(cDNSSDRecordReply, "rrtype", dnssd_record_rrtype, 0);
+	rb_define_method(cDNSSDRecordReply, "rrclass", dnssd_record_rrclass, 0);
+	rb_define_method(cDNSSDRecordReply, "rdata", dnssd_record_rdata, 0);
+	rb_define_method(cDNSSDRecordReply, "ttl", dnssd_record_ttl, 0);
+	rb_define_method(cDNSSDRecordReply, "value", dnssd_record_value, 0);
+	rb_define_method(cDNSSDRecordReply, "inspect", dnssd_record_inspect, 0);
+	rb_ext_ractor_safe(0);
+
+	/* resource record types for DNSSD.query_record() */
+	{
+		size_t i;
+		for (i=0; i<DNSSD_MAX_RRTYPES; i++)
+			rb_define_const(cDNSSDRecordReply, dnssd_rrtypes[i].name,
+											UINT2NUM(dnssd_rrtypes[i].rrtype));
+	}
+	/* The Internet resource record class. */
+	rb_define_const(cDNSSDRecordReply, "IN", UINT2NUM(DNSSD_RR_CLASS_IN));
+
 	/* flag constants */
 #if DNSSD_MAX_FLAGS != 9
 	#error The code below needs to be updated.
@@ -568,14 +1249,14 @@ Init_DNSSD_Replies(void)
 	rb_define_const(cDNSSDFlags, "BrowseDomains", ULONG2NUM(kDNSServiceFlagsBrowseDomains));
 	rb_define_const(cDNSSDFlags, "RegistrationDomains", ULONG2NUM(kDNSServiceFlagsRegistrationDomains));
 
-	/* Flag for creating a long-lived unicast query for the DNSDS.query_record()
-	 * (currently not part of the Ruby API). */
+	/* Flag for creating a long-lived unicast query for DNSSD.query_record(). */
 	rb_define_const(cDNSSDFlags, "LongLivedQuery", ULONG2NUM(kDNSServiceFlagsLongLivedQuery));
 }
 
 /* Document-class: DNSSD::Reply
  * 
- * DNSSD::Reply is the parent class of DNSSD::BrowseReply, DNSSD::RegisterReply, and DNSSD::ResolveReply.
+ * DNSSD::Reply is the parent class of DNSSD::BrowseReply, DNSSD::RegisterReply, DNSSD::ResolveReply
+ * and DNSSD::RecordReply.
  * It simply contains the behavior that is common to those classes, otherwise it is not
  * used by the DNSSD Ruby API.
  *
@@ -584,5 +1265,16 @@ Init_DNSSD_Replies(void)
 /* Document-class: DNSSD::Flags
  * 
  * Flags used in DNSSD Ruby API.
+ *
+ * The flags of a reply are frozen and shared by all replies with the
+ * same flags, use DNSSD::Flags.new(reply.flags) for a copy that can be
+ * changed.
  */
 
+
+/* Document-class: DNSSD::RecordReply
+ *
+ * A resource record found by DNSSD.query_record().  The raw rdata is in
+ * DNSSD::RecordReply#rdata, DNSSD::RecordReply#value decodes A, AAAA,
+ * SRV and TXT records.
+ */
@@ -0,0 +1,1326 @@
+/*
+ * Copyright (c) 2004 Chad Fowler, Charles Mills, Rich Kilmer
+ * Licenced under the same terms as Ruby.
+ * This software has absolutely no warranty.
+ */
+
+/*
+ * A stand-in for the daemon and its client library, built instead of
+ * linking libmdns with
+ *
+ *   ruby extconf.rb --enable-dnssd-stub
+ *
+ * It implements the parts of the dns_sd.h client API used by the
+ * extension against an in-memory registry, so that the extension can
+ * be tested and measured on a machine without mDNSResponder or Avahi.
+ *
+ * Each connection has a socketpair whose reading end is returned by
+ * DNSServiceRefSockFD().  The socket is readable while replies are
+ * queued on the connection and DNSServiceProcessResult() delivers one
+ * of them, setting kDNSServiceFlagsMoreComing if there are more.
+ *
+ * Services registered in the process can be browsed for and resolved,
+ * and their SRV, TXT and PTR records queried, as can records
+ * registered with DNSServiceRegisterRecord().  Every host name has the
+ * loopback addresses.  Nothing leaves the process.
+ *
+ * DNSSD::Stub scripts the daemon: announce() registers a burst of
+ * services at once and latency= delays every reply.
+ */
+
+#include "rdnssd.h"
+
+#ifdef DNSSD_STUB
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* for the addresses of DNSServiceGetAddrInfo() */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* the interface replies are received on, the loopback interface on linux */
+#define STUB_INTERFACE 1
+#define STUB_HOST "stub.local."
+#define STUB_TTL 120
+
+enum {
+	STUB_CONNECTION,
+	STUB_REGISTER,
+	STUB_ANNOUNCED, /* registered by DNSSD::Stub.announce */
+	STUB_BROWSE,
+	STUB_RESOLVE,
+	STUB_QUERY,
+	STUB_ADDRINFO
+};
+
+typedef struct stub_event {
+	struct stub_event *next;
+	DNSServiceRef target;
+	DNSRecordRef record;
+	DNSServiceFlags flags;
+	DNSServiceErrorType error;
+	uint32_t interface;
+	uint32_t ttl;
+	uint16_t port;	/* network byte order */
+	uint16_t rrtype;
+	uint16_t len;
+	struct timeval due;
+	char *str[3];	/* name, type and domain, or fullname and target */
+	char *data;	/* text record or rdata */
+	struct sockaddr_storage addr;
+} stub_event_t;
+
+struct _DNSServiceRef_t {
+	DNSServiceRef main;	/* owns the socket, the ref itself unless shared */
+	DNSServiceRef subs;	/* refs sharing the socket of a main ref */
+	DNSServiceRef next_sub;
+	DNSServiceRef next;	/* in stub_services or stub_ops */
+	DNSServiceRef next_main;	/* in stub_mains */
+	int op;
+	int listed;	/* in stub_services */
+	uint32_t key;	/* of the name, see stub_key() */
+	int fds[2];
+	stub_event_t *head, *tail;
+	union {
+		DNSServiceRegisterReply reg;
+		DNSServiceBrowseReply browse;
+		DNSServiceResolveReply resolve;
+		DNSServiceQueryRecordReply query;
+		DNSServiceGetAddrInfoReply addrinfo;
+	} callback;
+	void *context;
+	DNSServiceFlags flags;
+	uint32_t interface;
+	DNSServiceProtocol protocol;
+	uint16_t port;	/* network byte order */
+	uint16_t rrtype;
+	uint16_t txt_len;
+	char *name, *regtype, *domain, *host, *txt;
+};
+
+struct _DNSRecordRef_t {
+	DNSRecordRef next;
+	DNSServiceRef owner;
+	DNSServiceRegisterRecordReply callback;
+	void *context;
+	uint32_t interface;
+	uint32_t ttl;
+	uint16_t rrtype;
+	uint16_t len;
+	char *fullname, *data;
+};
+
+/* one lock for the registry and all connections, recursive so that a
+ * callback may deallocate its ref */
+static pthread_mutex_t stub_mutex;
+static pthread_once_t stub_once = PTHREAD_ONCE_INIT;
+static DNSServiceRef stub_mains = NULL;
+static DNSServiceRef stub_services = NULL;
+static DNSServiceRef stub_ops = NULL;
+static DNSRecordRef stub_records = NULL;
+
+/* replies held back by the latency, see stub_delay_thread() */
+static struct timeval stub_latency = { 0, 0 };
+static stub_event_t *stub_delayed = NULL;
+/* the link to append to, replies are sent in the order they were made */
+static stub_event_t **stub_delayed_tail = &stub_delayed;
+static pthread_cond_t stub_delay_cond = PTHREAD_COND_INITIALIZER;
+static int stub_delay_started = 0;
+
+static void
+stub_init(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&stub_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void
+stub_lock(void)
+{
+	pthread_once(&stub_once, stub_init);
+	pthread_mutex_lock(&stub_mutex);
+}
+
+static void
+stub_unlock(void)
+{
+	pthread_mutex_unlock(&stub_mutex);
+}
+
+static char *
+stub_strdup(const char *s, size_t len)
+{
+	char *copy = (char *)malloc(len + 1);
+	if (copy) {
+		memcpy(copy, s, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
+/* copies _s_ without a trailing dot, _def_ if _s_ is NULL or empty */
+static char *
+stub_strip(const char *s, const char *def)
+{
+	size_t len;
+	if (s == NULL || *s == '\0') s = def;
+	len = strlen(s);
+	if (len > 0 && s[len-1] == '.' && (len < 2 || s[len-2] != '\\')) len--;
+	return stub_strdup(s, len);
+}
+
+/* compares two names ignoring case and a trailing dot */
+static int
+stub_name_eq(const char *a, const char *b)
+{
+	size_t la = strlen(a), lb = strlen(b);
+	if (la > 0 && a[la-1] == '.') la--;
+	if (lb > 0 && b[lb-1] == '.') lb--;
+	return la == lb && strncasecmp(a, b, la) == 0;
+}
+
+/* a hash of _name_ ignoring case, to find services in the registry */
+static uint32_t
+stub_key(const char *name)
+{
+	uint32_t h = 2166136261U;
+	for (; *name; name++) h = (h ^ (unsigned char)tolower((unsigned char)*name)) * 16777619U;
+	return h;
+}
+
+/*
+ * Events
+ */
+
+static void
+stub_event_free(stub_event_t *event)
+{
+	int i;
+	for (i=0; i<3; i++) free(event->str[i]);
+	free(event->data);
+	free(event);
+}
+
+static stub_event_t *
+stub_event_new(DNSServiceRef target, DNSServiceFlags flags, DNSServiceErrorType error,
+		const char *s0, const char *s1, const char *s2)
+{
+	stub_event_t *event = (stub_event_t *)calloc(1, sizeof(stub_event_t));
+	if (event == NULL) return NULL;
+	event->target = target;
+	event->flags = flags;
+	event->error = error;
+	event->interface = target->interface ? target->interface : STUB_INTERFACE;
+	if ((s0 && !(event->str[0] = stub_strdup(s0, strlen(s0)))) ||
+			(s1 && !(event->str[1] = stub_strdup(s1, strlen(s1)))) ||
+			(s2 && !(event->str[2] = stub_strdup(s2, strlen(s2))))) {
+		stub_event_free(event);
+		return NULL;
+	}
+	return event;
+}
+
+static int
+stub_event_data(stub_event_t *event, const char *data, uint16_t len)
+{
+	event->data = (char *)malloc(len ? len : 1);
+	if (event->data == NULL) return 0;
+	memcpy(event->data, data, len);
+	event->len = len;
+	return 1;
+}
+
+/* The socket of a connection has one byte to read while its queue is
+ * not empty, it is written when the first event is queued and read
+ * when the last is taken. */
+static void
+stub_queue_push(DNSServiceRef main, stub_event_t *event)
+{
+	event->next = NULL;
+	if (main->tail) {
+		main->tail->next = event;
+	} else {
+		main->head = event;
+		while (write(main->fds[1], "", 1) < 0 && errno == EINTR);
+	}
+	main->tail = event;
+}
+
+static stub_event_t *
+stub_queue_shift(DNSServiceRef main)
+{
+	char byte;
+	stub_event_t *event = main->head;
+	if (event == NULL) return NULL;
+	main->head = event->next;
+	if (main->head == NULL) {
+		main->tail = NULL;
+		while (read(main->fds[0], &byte, 1) < 0 && errno == EINTR);
+	}
+	return event;
+}
+
+static struct timeval
+stub_now(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now;
+}
+
+static int
+stub_due(const struct timeval *due, const struct timeval *now)
+{
+	return due->tv_sec < now->tv_sec ||
+		(due->tv_sec == now->tv_sec && due->tv_usec <= now->tv_usec);
+}
+
+/* moves the delayed events that are due to their connections, returning
+ * the earliest of the others or NULL */
+static stub_event_t *
+stub_delay_release(void)
+{
+	struct timeval now = stub_now();
+	stub_event_t **link = &stub_delayed, *event, *next = NULL;
+	while ((event = *link) != NULL) {
+		if (stub_due(&event->due, &now)) {
+			*link = event->next;
+			stub_queue_push(event->target->main, event);
+		} else {
+			if (next == NULL || !stub_due(&next->due, &event->due)) next = event;
+			link = &event->next;
+		}
+	}
+	stub_delayed_tail = link;
+	return next;
+}
+
+static void *
+stub_delay_thread(void *arg)
+{
+	stub_event_t *next;
+	struct timespec ts;
+	stub_lock();
+	for (;;) {
+		next = stub_delay_release();
+		if (next) {
+			ts.tv_sec = next->due.tv_sec;
+			ts.tv_nsec = next->due.tv_usec * 1000;
+			pthread_cond_timedwait(&stub_delay_cond, &stub_mutex, &ts);
+		} else {
+			pthread_cond_wait(&stub_delay_cond, &stub_mutex);
+		}
+	}
+	return NULL;
+}
+
+/* hands _event_ to its connection, after the latency if there is one */
+static void
+stub_deliver(stub_event_t *event)
+{
+	pthread_t thread;
+	if (event == NULL) return;
+	if (!timerisset(&stub_latency)) {
+		stub_queue_push(event->target->main, event);
+		return;
+	}
+	if (!stub_delay_started) {
+		if (pthread_create(&thread, NULL, stub_delay_thread, NULL) != 0) {
+			/* deliver without the latency rather than not at all */
+			stub_queue_push(event->target->main, event);
+			return;
+		}
+		pthread_detach(thread);
+		stub_delay_started = 1;
+	}
+	event->due = stub_now();
+	timeradd(&event->due, &stub_latency, &event->due);
+	event->next = NULL;
+	*stub_delayed_tail = event;
+	stub_delayed_tail = &event->next;
+	pthread_cond_signal(&stub_delay_cond);
+}
+
+/* drops the events for _target_ (and _record_ if not NULL) not yet read */
+static void
+stub_purge(DNSServiceRef target, DNSRecordRef record)
+{
+	DNSServiceRef main = target->main;
+	stub_event_t **link, *event, *kept = NULL, *last = NULL;
+	int had = main->head != NULL;
+	char byte;
+
+	for (link = &stub_delayed; (event = *link) != NULL; ) {
+		if (event->target == target && (record == NULL || event->record == record)) {
+			*link = event->next;
+			stub_event_free(event);
+		} else {
+			link = &event->next;
+		}
+	}
+	stub_delayed_tail = link;
+	while ((event = main->head) != NULL) {
+		main->head = event->next;
+		if (event->target == target && (record == NULL || event->record == record)) {
+			stub_event_free(event);
+		} else {
+			event->next = NULL;
+			if (last) last->next = event; else kept = event;
+			last = event;
+		}
+	}
+	main->head = kept;
+	main->tail = last;
+	if (had && kept == NULL)
+		while (read(main->fds[0], &byte, 1) < 0 && errno == EINTR);
+}
+
+/*
+ * Answers
+ */
+
+/* writes _fullname_ as a sequence of DNS labels to _buf_, returning its
+ * length or 0 if it does not fit */
+static uint16_t
+stub_encode_name(const char *fullname, unsigned char *buf, size_t size)
+{
+	size_t len = 0, label = 0;
+	const char *p = fullname;
+	int c;
+	if (size < 2) return 0;
+	buf[len++] = 0;
+	while (*p) {
+		if (*p == '.') {
+			if (buf[label] == 0) break;
+			label = len;
+			if (len >= size - 1) return 0;
+			buf[len++] = 0;
+			p++;
+			continue;
+		}
+		c = (unsigned char)*p++;
+		if (c == '\\' && *p) {
+			if (p[0] >= '0' && p[0] <= '9' && p[1] >= '0' && p[1] <= '9' &&
+					p[2] >= '0' && p[2] <= '9') {
+				c = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+				p += 3;
+			} else {
+				c = (unsigned char)*p++;
+			}
+		}
+		if (len >= size - 1 || buf[label] == 63) return 0;
+		buf[len++] = (unsigned char)c;
+		buf[label]++;
+	}
+	if (buf[label] != 0) {
+		if (len >= size) return 0;
+		buf[len++] = 0;
+	}
+	return (uint16_t)len;
+}
+
+static int
+stub_matches(DNSServiceRef op, DNSServiceRef service)
+{
+	if (op->interface && service->interface && op->interface != service->interface)
+		return 0;
+	return stub_name_eq(op->regtype, service->regtype) &&
+		stub_name_eq(op->domain, service->domain);
+}
+
+static void
+stub_fullname(DNSServiceRef service, char *fullname)
+{
+	if (DNSServiceConstructFullName(fullname, service->name, service->regtype,
+				service->domain) != 0)
+		fullname[0] = '\0';
+}
+
+/* the answer to _op_ about _service_ being added or removed, if any */
+static void
+stub_answer(DNSServiceRef op, DNSServiceRef service, int add)
+{
+	char fullname[kDNSServiceMaxDomainName];
+	unsigned char rdata[6 + kDNSServiceMaxDomainName];
+	DNSServiceFlags flags = add ? kDNSServiceFlagsAdd : 0;
+	stub_event_t *event = NULL;
+	uint16_t len;
+
+	switch (op->op) {
+	case STUB_BROWSE:
+		if (!stub_matches(op, service)) return;
+		event = stub_event_new(op, flags, 0, service->name, service->regtype, service->domain);
+		break;
+	case STUB_RESOLVE:
+		if (!add || !stub_matches(op, service) || strcasecmp(op->name, service->name) != 0)
+			return;
+		stub_fullname(service, fullname);
+		event = stub_event_new(op, 0, 0, fullname, service->host, NULL);
+		if (event == NULL) return;
+		event->port = service->port;
+		if (!stub_event_data(event, service->txt, service->txt_len)) {
+			stub_event_free(event);
+			return;
+		}
+		break;
+	case STUB_QUERY:
+		stub_fullname(service, fullname);
+		if (op->rrtype == DNSSD_RR_PTR) {
+			snprintf((char *)rdata, sizeof(rdata), "%s.%s", service->regtype, service->domain);
+			if (!stub_name_eq(op->name, (char *)rdata)) return;
+			len = stub_encode_name(fullname, rdata, sizeof(rdata));
+		} else if (!stub_name_eq(op->name, fullname)) {
+			return;
+		} else if (op->rrtype == DNSSD_RR_SRV) {
+			memset(rdata, 0, 4); /* priority and weight */
+			memcpy(rdata + 4, &service->port, 2);
+			len = stub_encode_name(service->host, rdata + 6, sizeof(rdata) - 6);
+			if (len) len += 6;
+		} else if (op->rrtype == DNSSD_RR_TXT) {
+			event = stub_event_new(op, flags, 0, op->name, NULL, NULL);
+			if (event == NULL) return;
+			event->rrtype = op->rrtype;
+			event->ttl = STUB_TTL;
+			if (!stub_event_data(event, service->txt, service->txt_len)) {
+				stub_event_free(event);
+				return;
+			}
+			break;
+		} else {
+			return;
+		}
+		if (len == 0) return;
+		event = stub_event_new(op, flags, 0, op->name, NULL, NULL);
+		if (event == NULL) return;
+		event->rrtype = op->rrtype;
+		event->ttl = STUB_TTL;
+		if (!stub_event_data(event, (char *)rdata, len)) {
+			stub_event_free(event);
+			return;
+		}
+		break;
+	default:
+		return;
+	}
+	stub_deliver(event);
+}
+
+static void
+stub_answer_record(DNSServiceRef op, DNSRecordRef record, int add)
+{
+	stub_event_t *event;
+	if (op->op != STUB_QUERY || op->rrtype != record->rrtype ||
+			!stub_name_eq(op->name, record->fullname))
+		return;
+	event = stub_event_new(op, add ? kDNSServiceFlagsAdd : 0, 0, op->name, NULL, NULL);
+	if (event == NULL) return;
+	event->rrtype = record->rrtype;
+	event->ttl = record->ttl;
+	if (!stub_event_data(event, record->data, record->len)) {
+		stub_event_free(event);
+		return;
+	}
+	stub_deliver(event);
+}
+
+/* the loopback address answering _op_ for _family_ */
+static void
+stub_answer_address(DNSServiceRef op, int family)
+{
+	stub_event_t *event;
+	if (op->op == STUB_QUERY) {
+		static const unsigned char v4[4] = { 127, 0, 0, 1 };
+		static const unsigned char v6[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+		event = stub_event_new(op, kDNSServiceFlagsAdd, 0, op->name, NULL, NULL);
+		if (event == NULL) return;
+		event->rrtype = op->rrtype;
+		event->ttl = STUB_TTL;
+		if (!(family == AF_INET ?
+					stub_event_data(event, (const char *)v4, 4) :
+					stub_event_data(event, (const char *)v6, 16))) {
+			stub_event_free(event);
+			return;
+		}
+	} else {
+		event = stub_event_new(op, kDNSServiceFlagsAdd, 0, op->name, NULL, NULL);
+		if (event == NULL) return;
+		event->ttl = STUB_TTL;
+		if (family == AF_INET) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)&event->addr;
+			sin->sin_family = AF_INET;
+			sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		} else {
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&event->addr;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_addr = in6addr_loopback;
+		}
+	}
+	stub_deliver(event);
+}
+
+/* tells the operations about _service_ being added or removed */
+static void
+stub_notify(DNSServiceRef service, int add)
+{
+	DNSServiceRef op;
+	for (op = stub_ops; op; op = op->next) stub_answer(op, service, add);
+}
+
+/*
+ * Refs
+ */
+
+static DNSServiceRef
+stub_ref_new(DNSServiceRef *sdRef, DNSServiceFlags flags, int op)
+{
+	DNSServiceRef ref = (DNSServiceRef)calloc(1, sizeof(struct _DNSServiceRef_t));
+	if (ref == NULL) return NULL;
+	ref->op = op;
+	ref->fds[0] = ref->fds[1] = -1;
+	if (op == STUB_ANNOUNCED) return ref;
+
+	if ((flags & kDNSServiceFlagsShareConnection) && sdRef && *sdRef) {
+		DNSServiceRef main = (*sdRef)->main;
+		ref->main = main;
+		ref->next_sub = main->subs;
+		main->subs = ref;
+	} else {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, ref->fds) < 0) {
+			free(ref);
+			return NULL;
+		}
+		fcntl(ref->fds[0], F_SETFD, FD_CLOEXEC);
+		fcntl(ref->fds[1], F_SETFD, FD_CLOEXEC);
+		fcntl(ref->fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(ref->fds[1], F_SETFL, O_NONBLOCK);
+		ref->main = ref;
+		ref->next_main = stub_mains;
+		stub_mains = ref;
+	}
+	return ref;
+}
+
+static void
+stub_unlink(DNSServiceRef *list, DNSServiceRef ref)
+{
+	for (; *list; list = &(*list)->next) {
+		if (*list == ref) {
+			*list = ref->next;
+			return;
+		}
+	}
+}
+
+static void
+stub_record_free(DNSRecordRef record)
+{
+	DNSServiceRef op;
+	DNSRecordRef *link;
+	for (link = &stub_records; *link; link = &(*link)->next) {
+		if (*link == record) {
+			*link = record->next;
+			break;
+		}
+	}
+	for (op = stub_ops; op; op = op->next) stub_answer_record(op, record, 0);
+	free(record->fullname);
+	free(record->data);
+	free(record);
+}
+
+/* ends the operation of _ref_, freeing everything but _ref_ itself */
+static void
+stub_release(DNSServiceRef ref)
+{
+	DNSRecordRef record, next;
+	switch (ref->op) {
+	case STUB_REGISTER:
+	case STUB_ANNOUNCED:
+		if (ref->listed) {
+			stub_unlink(&stub_services, ref);
+			ref->listed = 0;
+			stub_notify(ref, 0);
+		}
+		break;
+	case STUB_CONNECTION:
+		for (record = stub_records; record; record = next) {
+			next = record->next;
+			if (record->owner == ref) stub_record_free(record);
+		}
+		break;
+	default:
+		stub_unlink(&stub_ops, ref);
+	}
+	if (ref->main) stub_purge(ref, NULL);
+	free(ref->name);
+	free(ref->regtype);
+	free(ref->domain);
+	free(ref->host);
+	free(ref->txt);
+}
+
+/* starts the operation _ref_, NULL if out of memory */
+static DNSServiceErrorType
+stub_start(DNSServiceRef *sdRef, DNSServiceRef ref)
+{
+	DNSServiceRef service;
+	DNSRecordRef record;
+	if (ref == NULL) return kDNSServiceErr_NoMemory;
+	ref->next = stub_ops;
+	stub_ops = ref;
+	*sdRef = ref;
+	for (service = stub_services; service; service = service->next)
+		stub_answer(ref, service, 1);
+	for (record = stub_records; record; record = record->next)
+		stub_answer_record(ref, record, 1);
+	return kDNSServiceErr_NoError;
+}
+
+static void
+stub_free(DNSServiceRef ref)
+{
+	stub_release(ref);
+	free(ref);
+}
+
+int
+DNSServiceRefSockFD(DNSServiceRef sdRef)
+{
+	return sdRef->main ? sdRef->main->fds[0] : -1;
+}
+
+DNSServiceErrorType
+DNSServiceProcessResult(DNSServiceRef sdRef)
+{
+	DNSServiceRef main = sdRef->main, ref;
+	stub_event_t *event;
+	struct pollfd pfd;
+
+	stub_lock();
+	/* blocks like the real one until a reply arrives */
+	while (main->head == NULL) {
+		stub_unlock();
+		pfd.fd = main->fds[0];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return kDNSServiceErr_Unknown;
+		stub_lock();
+	}
+	event = stub_queue_shift(main);
+	if (main->head) event->flags |= kDNSServiceFlagsMoreComing;
+	ref = event->target;
+
+	/* the callback may deallocate _ref_, the event is ours */
+	switch (ref->op) {
+	case STUB_CONNECTION:
+		event->record->callback(ref, event->record, event->flags, event->error,
+				event->record->context);
+		break;
+	case STUB_REGISTER:
+		ref->callback.reg(ref, event->flags, event->error,
+				event->str[0], event->str[1], event->str[2], ref->context);
+		break;
+	case STUB_BROWSE:
+		ref->callback.browse(ref, event->flags, event->interface, event->error,
+				event->str[0], event->str[1], event->str[2], ref->context);
+		break;
+	case STUB_RESOLVE:
+		ref->callback.resolve(ref, event->flags, event->interface, event->error,
+				event->str[0], event->str[1], event->port, event->len, event->data,
+				ref->context);
+		break;
+	case STUB_QUERY:
+		ref->callback.query(ref, event->flags, event->interface, event->error,
+				event->str[0], event->rrtype, DNSSD_RR_CLASS_IN, event->len, event->data,
+				event->ttl, ref->context);
+		break;
+	case STUB_ADDRINFO:
+		ref->callback.addrinfo(ref, event->flags, event->interface, event->error,
+				event->str[0], (struct sockaddr *)&event->addr, event->ttl, ref->context);
+		break;
+	}
+	stub_event_free(event);
+	stub_unlock();
+	return kDNSServiceErr_NoError;
+}
+
+void
+DNSServiceRefDeallocate(DNSServiceRef sdRef)
+{
+	DNSServiceRef *link, sub;
+	if (sdRef == NULL) return;
+	stub_lock();
+	if (sdRef->main == sdRef) {
+		for (link = &stub_mains; *link; link = &(*link)->next_main) {
+			if (*link == sdRef) {
+				*link = sdRef->next_main;
+				break;
+			}
+		}
+		while ((sub = sdRef->subs) != NULL) {
+			sdRef->subs = sub->next_sub;
+			stub_free(sub);
+		}
+		stub_release(sdRef);
+		close(sdRef->fds[0]);
+		close(sdRef->fds[1]);
+		free(sdRef);
+	} else {
+		if (sdRef->main) {
+			for (link = &sdRef->main->subs; *link; link = &(*link)->next_sub) {
+				if (*link == sdRef) {
+					*link = sdRef->next_sub;
+					break;
+				}
+			}
+		}
+		stub_free(sdRef);
+	}
+	stub_unlock();
+}
+
+DNSServiceErrorType
+DNSServiceCreateConnection(DNSServiceRef *sdRef)
+{
+	DNSServiceRef ref;
+	stub_lock();
+	ref = stub_ref_new(NULL, 0, STUB_CONNECTION);
+	stub_unlock();
+	if (ref == NULL) return kDNSServiceErr_NoMemory;
+	*sdRef = ref;
+	return kDNSServiceErr_NoError;
+}
+
+static DNSServiceRef
+stub_service_find(const char *name, const char *regtype, const char *domain)
+{
+	DNSServiceRef service;
+	uint32_t key = stub_key(name);
+	for (service = stub_services; service; service = service->next) {
+		if (service->key == key && strcasecmp(service->name, name) == 0 &&
+				stub_name_eq(service->regtype, regtype) &&
+				stub_name_eq(service->domain, domain))
+			return service;
+	}
+	return NULL;
+}
+
+/* adds _service_ to the registry, renaming it on a conflict if
+ * _autorename_ */
+static DNSServiceErrorType
+stub_service_add(DNSServiceRef service, int autorename)
+{
+	char name[256];
+	int n;
+	if (stub_service_find(service->name, service->regtype, service->domain)) {
+		if (!autorename) return kDNSServiceErr_NameConflict;
+		for (n=2; ; n++) {
+			snprintf(name, sizeof(name), "%.*s (%d)", 200, service->name, n);
+			if (!stub_service_find(name, service->regtype, service->domain)) break;
+		}
+		free(service->name);
+		if (!(service->name = stub_strdup(name, strlen(name))))
+			return kDNSServiceErr_NoMemory;
+	}
+	service->key = stub_key(service->name);
+	service->next = stub_services;
+	stub_services = service;
+	service->listed = 1;
+	stub_notify(service, 1);
+	return kDNSServiceErr_NoError;
+}
+
+static int
+stub_service_init(DNSServiceRef ref, uint32_t interfaceIndex, const char *name,
+		const char *regtype, const char *domain, const char *host, uint16_t port,
+		uint16_t txtLen, const void *txtRecord)
+{
+	ref->interface = interfaceIndex;
+	ref->port = port;
+	ref->name = stub_strdup(name ? name : "", name ? strlen(name) : 0);
+	ref->regtype = stub_strip(regtype, "");
+	ref->domain = stub_strip(domain, "local");
+	ref->host = (host && *host) ? stub_strdup(host, strlen(host)) : stub_strdup(STUB_HOST, strlen(STUB_HOST));
+	/* an empty text record is one empty string */
+	if (txtLen == 0) txtRecord = "";
+	ref->txt_len = txtLen ? txtLen : 1;
+	ref->txt = (char *)malloc(ref->txt_len);
+	if (ref->txt) memcpy(ref->txt, txtRecord, ref->txt_len);
+	return ref->name && ref->regtype && ref->domain && ref->host && ref->txt;
+}
+
+DNSServiceErrorType
+DNSServiceRegister(DNSServiceRef *sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+		const char *name, const char *regtype, const char *domain, const char *host,
+		uint16_t port, uint16_t txtLen, const void *txtRecord,
+		DNSServiceRegisterReply callBack, void *context)
+{
+	DNSServiceRef ref;
+	DNSServiceErrorType e;
+	char fullname[kDNSServiceMaxDomainName];
+
+	if (regtype == NULL || *regtype == '\0') return kDNSServiceErr_BadParam;
+	stub_lock();
+	ref = stub_ref_new(sdRef, flags, STUB_REGISTER);
+	if (ref == NULL) {
+		stub_unlock();
+		return kDNSServiceErr_NoMemory;
+	}
+	ref->callback.reg = callBack;
+	ref->context = context;
+	/* the daemon names services after the computer */
+	if (!stub_service_init(ref, interfaceIndex, (name && *name) ? name : "stub",
+				regtype, domain, host, port, txtLen, txtRecord) ||
+			DNSServiceConstructFullName(fullname, ref->name, ref->regtype, ref->domain) != 0) {
+		e = kDNSServiceErr_BadParam;
+	} else {
+		e = stub_service_add(ref, !(flags & kDNSServiceFlagsNoAutoRename));
+	}
+	if (e) {
+		/* as the real daemon does, a conflict is reported to the callback */
+		if (e == kDNSServiceErr_NameConflict && callBack) {
+			stub_deliver(stub_event_new(ref, 0, e,
+					ref->name, ref->regtype, ref->domain));
+			*sdRef = ref;
+			stub_unlock();
+			return kDNSServiceErr_NoError;
+		}
+		DNSServiceRefDeallocate(ref);
+		stub_unlock();
+		return e;
+	}
+	*sdRef = ref;
+	if (callBack)
+		stub_deliver(stub_event_new(ref, kDNSServiceFlagsAdd, 0,
+				ref->name, ref->regtype, ref->domain));
+	stub_unlock();
+	return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType
+DNSServiceBrowse(DNSServiceRef *sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+		const char *regtype, const char *domain, DNSServiceBrowseReply callBack, void *context)
+{
+	DNSServiceRef ref;
+	DNSServiceErrorType e;
+	if (regtype == NULL || *regtype == '\0' || callBack == NULL) return kDNSServiceErr_BadParam;
+	stub_lock();
+	ref = stub_ref_new(sdRef, flags, STUB_BROWSE);
+	if (ref) {
+		ref->interface = interfaceIndex;
+		ref->callback.browse = callBack;
+		ref->context = context;
+		ref->regtype = stub_strip(regtype, "");
+		ref->domain = stub_strip(domain, "local");
+		if (!ref->regtype || !ref->domain) {
+			DNSServiceRefDeallocate(ref);
+			ref = NULL;
+		}
+	}
+	e = stub_start(sdRef, ref);
+	stub_unlock();
+	return e;
+}
+
+DNSServiceErrorType
+DNSServiceResolve(DNSServiceRef *sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+		const char *name, const char *regtype, const char *domain,
+		DNSServiceResolveReply callBack, void *context)
+{
+	DNSServiceRef ref;
+	DNSServiceErrorType e;
+	if (name == NULL || regtype == NULL || callBack == NULL) return kDNSServiceErr_BadParam;
+	stub_lock();
+	ref = stub_ref_new(sdRef, flags, STUB_RESOLVE);
+	if (ref) {
+		ref->interface = interfaceIndex;
+		ref->callback.resolve = callBack;
+		ref->context = context;
+		ref->name = stub_strdup(name, strlen(name));
+		ref->regtype = stub_strip(regtype, "");
+		ref->domain = stub_strip(domain, "local");
+		if (!ref->name || !ref->regtype || !ref->domain) {
+			DNSServiceRefDeallocate(ref);
+			ref = NULL;
+		}
+	}
+	e = stub_start(sdRef, ref);
+	stub_unlock();
+	return e;
+}
+
+DNSServiceErrorType
+DNSServiceQueryRecord(DNSServiceRef *sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+		const char *fullname, uint16_t rrtype, uint16_t rrclass,
+		DNSServiceQueryRecordReply callBack, void *context)
+{
+	DNSServiceRef ref;
+	DNSServiceErrorType e;
+	if (fullname == NULL || callBack == NULL) return kDNSServiceErr_BadParam;
+	stub_lock();
+	ref = stub_ref_new(sdRef, flags, STUB_QUERY);
+	if (ref) {
+		ref->interface = interfaceIndex;
+		ref->callback.query = callBack;
+		ref->context = context;
+		ref->rrtype = rrtype;
+		if (!(ref->name = stub_strdup(fullname, strlen(fullname)))) {
+			DNSServiceRefDeallocate(ref);
+			ref = NULL;
+		}
+	}
+	e = stub_start(sdRef, ref);
+	if (e == kDNSServiceErr_NoError && rrclass == DNSSD_RR_CLASS_IN) {
+		if (rrtype == DNSSD_RR_A) stub_answer_address(ref, AF_INET);
+		if (rrtype == DNSSD_RR_AAAA) stub_answer_address(ref, AF_INET6);
+	}
+	stub_unlock();
+	return e;
+}
+
+DNSServiceErrorType
+DNSServiceGetAddrInfo(DNSServiceRef *sdRef, DNSServiceFlags flags, uint32_t interfaceIndex,
+		DNSServiceProtocol protocol, const char *hostname,
+		DNSServiceGetAddrInfoReply callBack, void *context)
+{
+	DNSServiceRef ref;
+	DNSServiceErrorType e;
+	if (hostname == NULL || callBack == NULL) return kDNSServiceErr_BadParam;
+	stub_lock();
+	ref = stub_ref_new(sdRef, flags, STUB_ADDRINFO);
+	if (ref) {
+		ref->interface = interfaceIndex;
+		ref->callback.addrinfo = callBack;
+		ref->context = context;
+		ref->protocol = protocol;
+		if (!(ref->name = stub_strdup(hostname, strlen(hostname)))) {
+			DNSServiceRefDeallocate(ref);
+			ref = NULL;
+		}
+	}
+	e = stub_start(sdRef, ref);
+	if (e == kDNSServiceErr_NoError) {
+		/* zero asks for both */
+		if (protocol == 0 || (protocol & kDNSServiceProtocol_IPv4))
+			stub_answer_address(ref, AF_INET);
+		if (protocol == 0 || (protocol & kDNSServiceProtocol_IPv6))
+			stub_answer_address(ref, AF_INET6);
+	}
+	stub_unlock();
+	return e;
+}
+
+DNSServiceErrorType
+DNSServiceRegisterRecord(DNSServiceRef sdRef, DNSRecordRef *RecordRef, DNSServiceFlags flags,
+		uint32_t interfaceIndex, const char *fullname, uint16_t rrtype, uint16_t rrclass,
+		uint16_t rdlen, const void *rdata, uint32_t ttl,
+		DNSServiceRegisterRecordReply callBack, void *context)
+{
+	DNSRecordRef record;
+	DNSServiceRef op;
+	stub_event_t *event;
+
+	if (sdRef == NULL || sdRef->op != STUB_CONNECTION) return kDNSServiceErr_BadReference;
+	if (fullname == NULL || callBack == NULL) return kDNSServiceErr_BadParam;
+	record = (DNSRecordRef)calloc(1, sizeof(struct _DNSRecordRef_t));
+	if (record == NULL) return kDNSServiceErr_NoMemory;
+	record->fullname = stub_strdup(fullname, strlen(fullname));
+	record->data = (char *)malloc(rdlen ? rdlen : 1);
+	if (record->fullname == NULL || record->data == NULL) {
+		free(record->fullname);
+		free(record->data);
+		free(record);
+		return kDNSServiceErr_NoMemory;
+	}
+	memcpy(record->data, rdata, rdlen);
+	record->len = rdlen;
+	record->owner = sdRef;
+	record->callback = callBack;
+	record->context = context;
+	record->interface = interfaceIndex;
+	record->rrtype = rrtype;
+	record->ttl = ttl;
+
+	stub_lock();
+	record->next = stub_records;
+	stub_records = record;
+	*RecordRef = record;
+	for (op = stub_ops; op; op = op->next) stub_answer_record(op, record, 1);
+	event = stub_event_new(sdRef, kDNSServiceFlagsAdd, 0, NULL, NULL, NULL);
+	if (event) event->record = record;
+	stub_deliver(event);
+	stub_unlock();
+	return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType
+DNSServiceUpdateRecord(DNSServiceRef sdRef, DNSRecordRef RecordRef, DNSServiceFlags flags,
+		uint16_t rdlen, const void *rdata, uint32_t ttl)
+{
+	DNSServiceRef op;
+	char *data = (char *)malloc(rdlen ? rdlen : 1);
+	if (data == NULL) return kDNSServiceErr_NoMemory;
+	memcpy(data, rdata, rdlen);
+
+	stub_lock();
+	if (RecordRef) {
+		for (op = stub_ops; op; op = op->next) stub_answer_record(op, RecordRef, 0);
+		free(RecordRef->data);
+		RecordRef->data = data;
+		RecordRef->len = rdlen;
+		RecordRef->ttl = ttl;
+		for (op = stub_ops; op; op = op->next) stub_answer_record(op, RecordRef, 1);
+	} else if (sdRef && sdRef->op == STUB_REGISTER && sdRef->listed) {
+		/* the primary text record, resolves in progress see the change */
+		free(sdRef->txt);
+		sdRef->txt = data;
+		sdRef->txt_len = rdlen;
+		for (op = stub_ops; op; op = op->next) {
+			if (op->op == STUB_RESOLVE || (op->op == STUB_QUERY && op->rrtype == DNSSD_RR_TXT))
+				stub_answer(op, sdRef, 1);
+		}
+	} else {
+		free(data);
+		stub_unlock();
+		return kDNSServiceErr_BadReference;
+	}
+	stub_unlock();
+	return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType
+DNSServiceRemoveRecord(DNSServiceRef sdRef, DNSRecordRef RecordRef, DNSServiceFlags flags)
+{
+	if (sdRef == NULL || RecordRef == NULL || RecordRef->owner != sdRef)
+		return kDNSServiceErr_BadReference;
+	stub_lock();
+	stub_purge(sdRef, RecordRef);
+	stub_record_free(RecordRef);
+	stub_unlock();
+	return kDNSServiceErr_NoError;
+}
+
+/* escapes dots and backslashes in the instance name, as the library does */
+int
+DNSServiceConstructFullName(char *fullName, const char *service, const char *regtype,
+		const char *domain)
+{
+	char *p = fullName, *end = fullName + kDNSServiceMaxDomainName - 1;
+	const char *s;
+	size_t len;
+
+	if (regtype == NULL || domain == NULL) return -1;
+	if (service) {
+		for (s = service; *s; s++) {
+			unsigned char c = (unsigned char)*s;
+			if (c == '.' || c == '\\') {
+				if (p + 2 > end) return -1;
+				*p++ = '\\';
+				*p++ = c;
+			} else if (c <= ' ' || c == 0x7f) {
+				if (p + 4 > end) return -1;
+				*p++ = '\\';
+				*p++ = '0' + c / 100;
+				*p++ = '0' + c / 10 % 10;
+				*p++ = '0' + c % 10;
+			} else {
+				if (p + 1 > end) return -1;
+				*p++ = c;
+			}
+		}
+		if (p + 1 > end) return -1;
+		*p++ = '.';
+	}
+	for (s = regtype; s; s = (s == regtype ? domain : NULL)) {
+		len = strlen(s);
+		if (p + len + 1 > end) return -1;
+		memcpy(p, s, len);
+		p += len;
+		if (len == 0 || s[len-1] != '.') *p++ = '.';
+	}
+	*p = '\0';
+	return 0;
+}
+
+/*
+ * Document-module: DNSSD::Stub
+ *
+ * Scripts the stand-in daemon the extension is built against with
+ * <tt>ruby extconf.rb --enable-dnssd-stub</tt>.  Not defined otherwise.
+ *
+ *   DNSSD::Stub.latency = 0.05
+ *   DNSSD::Stub.announce("_http._tcp", 1000)
+ *   DNSSD.browse("_http._tcp") { |reply| ... }
+ */
+
+static VALUE mDNSSDStub;
+
+/*
+ * call-seq:
+ *    DNSSD::Stub.latency => seconds
+ *
+ * The time every reply is held back.
+ */
+
+static VALUE
+dnssd_stub_latency(VALUE self)
+{
+	return rb_float_new(stub_latency.tv_sec + stub_latency.tv_usec / 1e6);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::Stub.latency = seconds
+ *
+ * Holds back every reply sent from now on by _seconds_.
+ */
+
+static VALUE
+dnssd_stub_set_latency(VALUE self, VALUE seconds)
+{
+	double s = NUM2DBL(seconds);
+	if (s < 0) rb_raise(rb_eArgError, "negative latency");
+	stub_lock();
+	stub_latency.tv_sec = (long)s;
+	stub_latency.tv_usec = (long)((s - (long)s) * 1e6);
+	stub_unlock();
+	return seconds;
+}
+
+static VALUE
+dnssd_stub_option(VALUE options, const char *name)
+{
+	if (NIL_P(options)) return Qnil;
+	return rb_hash_aref(options, ID2SYM(rb_intern(name)));
+}
+
+/*
+ * call-seq:
+ *    DNSSD::Stub.announce(type, count=1, options={}) => count
+ *
+ * Registers _count_ services of _type_ named "stub 1", "stub 2"...
+ * at once.  Browses for _type_ get them in one burst.
+ *
+ * options may contain :name (the prefix of the names), :domain,
+ * :host, :port and :text_record.
+ */
+
+static VALUE
+dnssd_stub_announce(int argc, VALUE *argv, VALUE self)
+{
+	VALUE type, count, options, v, text_record = Qnil;
+	const char *regtype, *prefix = "stub", *domain = NULL, *host = NULL;
+	uint16_t port = 0;
+	long i, n;
+	char name[256];
+	DNSServiceRef ref;
+	DNSServiceErrorType e = kDNSServiceErr_NoError;
+
+	rb_scan_args(argc, argv, "12", &type, &count, &options);
+	regtype = StringValueCStr(type);
+	n = NIL_P(count) ? 1 : NUM2LONG(count);
+	if (!NIL_P(options)) Check_Type(options, T_HASH);
+	if (!NIL_P(v = dnssd_stub_option(options, "name"))) prefix = StringValueCStr(v);
+	if (!NIL_P(v = dnssd_stub_option(options, "domain"))) domain = StringValueCStr(v);
+	if (!NIL_P(v = dnssd_stub_option(options, "host"))) host = StringValueCStr(v);
+	if (!NIL_P(v = dnssd_stub_option(options, "port"))) port = htons((uint16_t)NUM2UINT(v));
+	if (!NIL_P(v = dnssd_stub_option(options, "text_record")))
+		text_record = dnssd_tr_to_encoded_str(v);
+
+	stub_lock();
+	for (i=1; i<=n && !e; i++) {
+		snprintf(name, sizeof(name), "%.200s %ld", prefix, i);
+		ref = stub_ref_new(NULL, 0, STUB_ANNOUNCED);
+		if (ref == NULL ||
+				!stub_service_init(ref, 0, name, regtype, domain, host, port,
+					NIL_P(text_record) ? 0 : (uint16_t)RSTRING_LEN(text_record),
+					NIL_P(text_record) ? NULL : RSTRING_PTR(text_record))) {
+			e = kDNSServiceErr_NoMemory;
+		} else {
+			e = stub_service_add(ref, 1);
+		}
+		if (e && ref) stub_free(ref);
+	}
+	stub_unlock();
+	dnssd_check_error_code(e);
+	return LONG2NUM(n);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::Stub.withdraw(type=nil) => count
+ *
+ * Removes the services of _type_ (all if nil) registered by
+ * DNSSD::Stub.announce, returns how many there were.
+ */
+
+static VALUE
+dnssd_stub_withdraw(int argc, VALUE *argv, VALUE self)
+{
+	VALUE type;
+	const char *regtype = NULL;
+	DNSServiceRef *link, service;
+	long n = 0;
+
+	rb_scan_args(argc, argv, "01", &type);
+	if (!NIL_P(type)) regtype = StringValueCStr(type);
+	stub_lock();
+	for (link = &stub_services; (service = *link) != NULL; ) {
+		if (service->op == STUB_ANNOUNCED &&
+				(regtype == NULL || stub_name_eq(service->regtype, regtype))) {
+			stub_free(service); /* unlinks it */
+			n++;
+		} else {
+			link = &service->next;
+		}
+	}
+	stub_unlock();
+	return LONG2NUM(n);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::Stub.pending => count
+ *
+ * The number of replies sent but not yet read.
+ */
+
+static VALUE
+dnssd_stub_pending(VALUE self)
+{
+	long n = 0;
+	stub_event_t *event;
+	DNSServiceRef ref;
+	stub_lock();
+	for (event = stub_delayed; event; event = event->next) n++;
+	for (ref = stub_mains; ref; ref = ref->next_main) {
+		for (event = ref->head; event; event = event->next) n++;
+	}
+	stub_unlock();
+	return LONG2NUM(n);
+}
+
+void
+Init_DNSSD_Stub(void)
+{
+	mDNSSDStub = rb_define_module_under(mDNSSD, "Stub");
+	rb_define_singleton_method(mDNSSDStub, "latency", dnssd_stub_latency, 0);
+	rb_define_singleton_method(mDNSSDStub, "latency=", dnssd_stub_set_latency, 1);
+	rb_define_singleton_method(mDNSSDStub, "announce", dnssd_stub_announce, -1);
+	rb_define_singleton_method(mDNSSDStub, "withdraw", dnssd_stub_withdraw, -1);
+	rb_define_singleton_method(mDNSSDStub, "pending", dnssd_stub_pending, 0);
+}
+
+#endif /* DNSSD_STUB */
@@ -4,10 +4,11 @@
  * This software has absolutely no warrenty.
  */
 #include "rdnssd.h"
-#include <intern.h>
-#include <string.h> /* for strchr() */
+#include <string.h> /* for strchr(), memchr() */
 
 static VALUE cDNSSDTextRecord;
+/* the cached encoding of a text record, not visible from ruby */
+static ID dnssd_id_encoded;
 
 static void
 dnssd_tr_decode_error(void)
@@ -15,34 +16,86 @@ dnssd_tr_decode_error(void)
 	rb_raise(rb_eArgError, "buffer contains invalid text record");
 }
 
-static void
-dnssd_tr_decode_buffer(VALUE self, long buf_len, const char *buf_ptr)
+/* one key, value pair of an encoded text record */
+typedef struct {
+	uint16_t offset;	/* of the key */
+	uint8_t key_len;
+	int16_t value_len;	/* -1 if there is no '=' */
+} dnssd_tr_entry_t;
+
+/* Fills _entry_ with the key, value pair of _len_ bytes at _p_, an offset
+ * of _offset_ into the text record.  Returns 0 if the pair has no key,
+ * or if _strict_ and its key is not printable ASCII, as DNS-SD requires. */
+static int
+dnssd_tr_entry(const char *p, long len, long offset, int strict,
+							 dnssd_tr_entry_t *entry)
+{
+	const char *eq = (const char *)memchr(p, '=', len);
+	long i, key_len = eq ? eq - p : len;
+	if (key_len == 0) return 0;
+	if (strict) {
+		for (i=0; i<key_len; i++) {
+			if ((unsigned char)p[i] < 0x20 || (unsigned char)p[i] > 0x7e) return 0;
+		}
+	}
+	entry->offset = (uint16_t)offset;
+	entry->key_len = (uint8_t)key_len;
+	entry->value_len = (int16_t)(eq ? len - key_len - 1 : -1);
+	return 1;
+}
+
+/* Indexes the key, value pairs of the text record _buf_ into _entries_,
+ * or just counts them if _entries_ is NULL.  Never reads past _buf_len_.
+ * Returns the number of pairs, -1 if the text record is invalid. */
+static long
+dnssd_tr_index(const char *buf, long buf_len, int strict, dnssd_tr_entry_t *entries)
 {
-	/* iterate through text record, inserting key, value pairs into hash */
-	long i = 0;
-	while(i < buf_len) {
-		VALUE key, value;
-		const char *p;
-		long key_len, len = (long)(uint8_t)buf_ptr[i++];
-		if (i >= buf_len || i + len > buf_len)
-			dnssd_tr_decode_error();
-
-		p = strchr(buf_ptr + i, '=');
-		if (p == NULL) {
-			key_len = len;
-			key = rb_str_new(buf_ptr + i, key_len);
-			value = Qnil;
-		} else {
-			key_len = p - (buf_ptr + i);
-			if (key_len >= len)
-				dnssd_tr_decode_error();
-			key = rb_str_new(buf_ptr + i, key_len);
-			key_len++; /* step over '=' */
-			value = rb_str_new(buf_ptr + i + key_len, len - key_len);
+	dnssd_tr_entry_t entry;
+	long i = 0, count = 0;
+	while (i < buf_len) {
+		long len = (long)(uint8_t)buf[i++];
+		if (i + len > buf_len) return -1;
+		/* empty strings are allowed, e.g. the empty text record "\000" */
+		if (len > 0 && dnssd_tr_entry(buf + i, len, i, strict, &entry)) {
+			if (entries) entries[count] = entry;
+			count++;
 		}
-		rb_hash_aset(self, key, value);
 		i += len;
 	}
+	return count;
+}
+
+static VALUE
+dnssd_tr_entry_key(const char *buf, const dnssd_tr_entry_t *entry)
+{
+	return rb_str_new(buf + entry->offset, entry->key_len);
+}
+
+static VALUE
+dnssd_tr_entry_value(const char *buf, const dnssd_tr_entry_t *entry)
+{
+	if (entry->value_len < 0) return Qnil;
+	return rb_str_new(buf + entry->offset + entry->key_len + 1, entry->value_len);
+}
+
+static void
+dnssd_tr_decode_buffer(VALUE self, long buf_len, const char *buf_ptr)
+{
+	/* index the text record, then insert the key, value pairs into hash */
+	volatile VALUE tmp;
+	dnssd_tr_entry_t *entries;
+	long i, count = dnssd_tr_index(buf_ptr, buf_len, 0, NULL);
+	if (count < 0)
+		dnssd_tr_decode_error();
+	if (count == 0) return;
+	/* a string, so that it is collected if rb_hash_aset() raises */
+	tmp = rb_str_new(0, count * sizeof(dnssd_tr_entry_t));
+	entries = (dnssd_tr_entry_t *)RSTRING_PTR(tmp);
+	dnssd_tr_index(buf_ptr, buf_len, 0, entries);
+	for (i=0; i<count; i++) {
+		rb_hash_aset(self, dnssd_tr_entry_key(buf_ptr, &entries[i]),
+								 dnssd_tr_entry_value(buf_ptr, &entries[i]));
+	}
 }
 
 static void
@@ -50,9 +103,9 @@ dnssd_tr_decode_str(VALUE self, VALUE str)
 {
 	str = StringValue(str);
 	/* text records cannot be longer than 65535 (0xFFFF) */
-	if (RSTRING(str)->len > UINT16_MAX)
+	if (RSTRING_LEN(str) > UINT16_MAX)
 		rb_raise(rb_eArgError, "string is to large to encode");
-	dnssd_tr_decode_buffer (self, RSTRING(str)->len, RSTRING(str)->ptr);
+	dnssd_tr_decode_buffer (self, RSTRING_LEN(str), RSTRING_PTR(str));
 }
 
 /*
@@ -122,39 +175,67 @@ dnssd_tr_valid_key(const char *key_cstr, long len)
 		rb_raise(rb_eRuntimeError, "empty key given");
 }
 
-static long
-dnssd_tr_convert_pairs(volatile VALUE ary)
-{
-	long i, tot_len = 0;
-	VALUE *ptr = RARRAY(ary)->ptr;
-	/* iterate over key, value pairs checking if each one is valid */
-	for(i=0; i<RARRAY(ary)->len; i++) {
-		VALUE key = RARRAY(ptr[i])->ptr[0];
-		VALUE value = RARRAY(ptr[i])->ptr[1];
-		/* checks if key is a valid C String (null terminated)
-		 * note: StringValueCStr takes a pointer to key by &key
-		 * this may cause key to be reassigned. */
-		const char *key_cstr = StringValueCStr(key);
-		long len = RSTRING(key)->len;
-		dnssd_tr_valid_key(key_cstr, len);
+/* state of the passes over the pairs of a text record in dnssd_tr_encode() */
+typedef struct {
+	char *ptr;	/* the buffer being filled, NULL when sizing */
+	long cap;	/* size of the buffer */
+	const char *cached;	/* compared against instead if not NULL */
+	long len;	/* bytes so far */
+	long cached_len;
+	int match;
+} dnssd_tr_encoding_t;
 
-		if (!NIL_P(value)) {
-			value = StringValue(value);
-			len += 1 + RSTRING(value)->len;
-		}
-		/* len == sum(key length, 1 for '=' if value != nil, value length) */
-		if (len > UINT8_MAX)
+/* adds _len_ bytes at _src_ to the encoding, or compares them */
+static void
+dnssd_tr_encoding_cat(dnssd_tr_encoding_t *enc, const void *src, long len)
+{
+	if (enc->cached) {
+		if (enc->len + len > enc->cached_len ||
+				memcmp(enc->cached + enc->len, src, len) != 0)
+			enc->match = 0;
+	} else if (enc->ptr) {
+		/* the pairs may have grown since they were sized */
+		if (enc->len + len <= enc->cap)
+			memcpy(enc->ptr + enc->len, src, len);
+	}
+	enc->len += len;
+}
+
+/* encodes, sizes or compares one key, value pair */
+static int
+dnssd_tr_encode_i(VALUE key, VALUE value, VALUE arg)
+{
+	dnssd_tr_encoding_t *enc = (dnssd_tr_encoding_t *)arg;
+	uint8_t len;
+
+	StringValue(key);
+	if (!NIL_P(value)) StringValue(value);
+	if (enc->ptr == NULL && enc->cached == NULL) {
+		/* sizing, check the pair is valid */
+		const char *key_cstr = StringValueCStr(key);
+		long pair_len = RSTRING_LEN(key);
+		dnssd_tr_valid_key(key_cstr, pair_len);
+		if (!NIL_P(value)) pair_len += 1 + RSTRING_LEN(value);
+		/* pair_len == sum(key length, 1 for '=' if value != nil, value length) */
+		if (pair_len > UINT8_MAX)
 			rb_raise(rb_eRuntimeError, "key, value pair at '%s' is too large to encode", key_cstr);
-	
 		/* now that we know no errors are going to occur */
-		if (RSTRING(key)->len > 14)
+		if (RSTRING_LEN(key) > 14)
 			rb_warn("key '%s' is greator than 14 bytes, may not be compatible with all clients", key_cstr);
-		/* key and value may have been reassigned by StringValue macros */
-		RARRAY(ptr[i])->ptr[0] = key;
-		RARRAY(ptr[i])->ptr[1] = value;
-		tot_len += len + 1; /* plus 1 to hold key, value pair length */
 	}
-	return tot_len;
+
+	if (NIL_P(value)) {
+		len = (uint8_t)RSTRING_LEN(key);
+		dnssd_tr_encoding_cat(enc, &len, 1);
+		dnssd_tr_encoding_cat(enc, RSTRING_PTR(key), RSTRING_LEN(key));
+	} else {
+		len = (uint8_t)(RSTRING_LEN(key) + RSTRING_LEN(value) + 1);
+		dnssd_tr_encoding_cat(enc, &len, 1);
+		dnssd_tr_encoding_cat(enc, RSTRING_PTR(key), RSTRING_LEN(key));
+		dnssd_tr_encoding_cat(enc, "=", 1);
+		dnssd_tr_encoding_cat(enc, RSTRING_PTR(value), RSTRING_LEN(value));
+	}
+	return (enc->cached && !enc->match) ? ST_STOP : ST_CONTINUE;
 }
 
 /*
@@ -185,44 +266,459 @@ dnssd_tr_convert_pairs(volatile VALUE ary)
  *    s = text_record.encode      #=> "\nLast=Green\0101rst=Sam\023email=sam@green.org"
  *    DNSSD::TextRecord.decode(s) #=> {"Last"=>"Green", "1rst"=>"Sam", "email"=>"sam@green.org"}
  *
+ * The encoded string is frozen and kept: encoding _text_record_ again
+ * returns the same string until its contents change.
  */
 
 static VALUE
 dnssd_tr_encode(VALUE self)
 {
-	long i;
+	dnssd_tr_encoding_t enc;
 	VALUE buf;
-	/* Declare ary volatile to prevent it from being reclaimed when:
-	 * buf is allocated later, key/values are converted to strings */
-	volatile VALUE ary = rb_funcall2(self, rb_intern("to_a"), 0, 0);
-	/* array of key, value pairs */
-	VALUE *ptr = RARRAY(ary)->ptr;
-	
-	buf = rb_str_buf_new(dnssd_tr_convert_pairs(ary));
-	for(i=0; i<RARRAY(ary)->len; i++) {
-		uint8_t len;
-		VALUE key = RARRAY(ptr[i])->ptr[0];
-		VALUE value = RARRAY(ptr[i])->ptr[1];
-		if (!NIL_P(value)) {
-			len = (uint8_t)(RSTRING(key)->len + RSTRING(value)->len + 1);
-			rb_str_buf_cat(buf, &len, 1);
-			rb_str_buf_append(buf, key);
-			rb_str_buf_cat(buf, "=", 1);
-			rb_str_buf_append(buf, value);	
-		} else {
-			len = (uint8_t)RSTRING(key)->len;
-			rb_str_buf_cat(buf, &len, 1);
-			rb_str_buf_append(buf, key);
+	/* only text records keep their encoding */
+	int cache = rb_obj_is_kind_of(self, cDNSSDTextRecord) == Qtrue && !OBJ_FROZEN(self);
+
+	MEMZERO(&enc, dnssd_tr_encoding_t, 1);
+	if (cache) {
+		/* the pairs (or the strings in them) may have been changed since,
+		 * so check the encoding still matches */
+		VALUE cached = rb_attr_get(self, dnssd_id_encoded);
+		if (!NIL_P(cached)) {
+			enc.cached = RSTRING_PTR(cached);
+			enc.cached_len = RSTRING_LEN(cached);
+			enc.match = 1;
+			rb_hash_foreach(self, dnssd_tr_encode_i, (VALUE)&enc);
+			if (enc.match && enc.len == enc.cached_len) return cached;
+			MEMZERO(&enc, dnssd_tr_encoding_t, 1);
+		}
+	}
+
+	/* size the buffer, then fill it */
+	rb_hash_foreach(self, dnssd_tr_encode_i, (VALUE)&enc);
+	buf = rb_str_new(0, enc.len);
+	enc.ptr = RSTRING_PTR(buf);
+	enc.cap = enc.len;
+	enc.len = 0;
+	rb_hash_foreach(self, dnssd_tr_encode_i, (VALUE)&enc);
+	if (enc.len != enc.cap) {
+		/* a key or value was changed while encoding */
+		rb_raise(rb_eRuntimeError, "text record changed while encoding");
+	}
+
+	if (cache) {
+		rb_obj_freeze(buf);
+		rb_ivar_set(self, dnssd_id_encoded, buf);
+	}
+	return buf;
+}
+
+/*
+ * DNSSD::LazyTextRecord keeps the encoded text record and an index of
+ * its key, value pairs.  Keys and values are only created when looked up.
+ */
+
+typedef struct {
+	VALUE owner;	/* the String or reply holding the bytes */
+	const char *bytes;	/* NULL if they are those of the String owner */
+	long len;
+	long count;
+	dnssd_tr_entry_t *entries;
+} dnssd_tr_lazy_t;
+
+static void
+dnssd_tr_lazy_mark(void *ptr)
+{
+	dnssd_tr_lazy_t *lazy = (dnssd_tr_lazy_t *)ptr;
+	rb_gc_mark(lazy->owner);
+}
+
+static void
+dnssd_tr_lazy_free(void *ptr)
+{
+	dnssd_tr_lazy_t *lazy = (dnssd_tr_lazy_t *)ptr;
+	xfree(lazy->entries);
+	xfree(lazy);
+}
+
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+static size_t
+dnssd_tr_lazy_memsize(const void *ptr)
+{
+	const dnssd_tr_lazy_t *lazy = (const dnssd_tr_lazy_t *)ptr;
+	return sizeof(dnssd_tr_lazy_t) + lazy->count * sizeof(dnssd_tr_entry_t);
+}
+
+#ifdef HAVE_RUBY_RACTOR_H
+/* a frozen one is shareable, see dnssd_tr_lazy_freeze() */
+#define DNSSD_TR_LAZY_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE)
+#else
+#define DNSSD_TR_LAZY_FLAGS RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+
+static const rb_data_type_t dnssd_tr_lazy_data_type = {
+	"DNSSD::LazyTextRecord",
+	{ dnssd_tr_lazy_mark, dnssd_tr_lazy_free, dnssd_tr_lazy_memsize, },
+	0, 0, DNSSD_TR_LAZY_FLAGS
+};
+
+#define dnssd_tr_lazy_wrap(klass, lazy) \
+	TypedData_Wrap_Struct((klass), &dnssd_tr_lazy_data_type, (lazy))
+#define GetDNSSDLazyTextRecord(obj, var) \
+	TypedData_Get_Struct((obj), dnssd_tr_lazy_t, &dnssd_tr_lazy_data_type, (var))
+#else
+/* ruby 1.8 and 1.9 */
+#define dnssd_tr_lazy_wrap(klass, lazy) \
+	Data_Wrap_Struct((klass), dnssd_tr_lazy_mark, dnssd_tr_lazy_free, (lazy))
+#define GetDNSSDLazyTextRecord(obj, var) Data_Get_Struct((obj), dnssd_tr_lazy_t, (var))
+#endif
+
+static VALUE cDNSSDLazyTextRecord;
+static ID dnssd_id_has_key_p;
+
+static const char *
+dnssd_tr_lazy_bytes(const dnssd_tr_lazy_t *lazy)
+{
+	return lazy->bytes ? lazy->bytes : RSTRING_PTR(lazy->owner);
+}
+
+static VALUE
+dnssd_tr_lazy_s_alloc(VALUE klass)
+{
+	dnssd_tr_lazy_t *lazy;
+	volatile VALUE self = dnssd_tr_lazy_wrap(klass, 0);
+	lazy = ALLOC(dnssd_tr_lazy_t);
+	MEMZERO(lazy, dnssd_tr_lazy_t, 1);
+	lazy->owner = Qnil;
+	lazy->bytes = "";
+	DATA_PTR(self) = lazy;
+	return self;
+}
+
+/* indexes the _len_ bytes at _bytes_ (NULL for the bytes of String
+ * _owner_) into the lazy text record _self_ */
+static VALUE
+dnssd_tr_lazy_init(VALUE self, VALUE owner, long len, const char *bytes)
+{
+	dnssd_tr_lazy_t *lazy;
+	dnssd_tr_entry_t *entries;
+	long count;
+
+	GetDNSSDLazyTextRecord(self, lazy);
+	count = dnssd_tr_index(bytes ? bytes : RSTRING_PTR(owner), len, 1, NULL);
+	if (count < 0)
+		dnssd_tr_decode_error();
+	entries = ALLOC_N(dnssd_tr_entry_t, count > 0 ? count : 1);
+	dnssd_tr_index(bytes ? bytes : RSTRING_PTR(owner), len, 1, entries);
+
+	xfree(lazy->entries);
+	lazy->owner = owner;
+	lazy->bytes = bytes;
+	lazy->len = len;
+	lazy->count = count;
+	lazy->entries = entries;
+	return self;
+}
+
+VALUE
+dnssd_tr_lazy_new(VALUE owner, long len, const char *buf)
+{
+	volatile VALUE self = dnssd_tr_lazy_s_alloc(cDNSSDLazyTextRecord);
+	return dnssd_tr_lazy_init(self, owner, len, buf);
+}
+
+/*
+ * call-seq:
+ *    DNSSD::LazyTextRecord.new(binary_string) => lazy_text_record
+ *
+ * Creates a read only view of the text record encoded in _binary_string_,
+ * see DNSSD::TextRecord.encode().  Unlike DNSSD::TextRecord.decode() no
+ * String is created until a key is looked up.
+ */
+
+static VALUE
+dnssd_tr_lazy_initialize(VALUE self, VALUE str)
+{
+	if (OBJ_FROZEN(self)) rb_error_frozen(rb_obj_classname(self));
+	StringValue(str);
+	if (RSTRING_LEN(str) > UINT16_MAX)
+		rb_raise(rb_eArgError, "string is to large to encode");
+	/* a frozen string shares its bytes with the argument */
+	return dnssd_tr_lazy_init(self, rb_str_new_frozen(str), RSTRING_LEN(str), NULL);
+}
+
+/* keys are compared case insensitively, as DNS-SD requires */
+static int
+dnssd_tr_key_equal(const char *a, const char *b, long len)
+{
+	long i;
+	for (i=0; i<len; i++) {
+		unsigned char ca = (unsigned char)a[i], cb = (unsigned char)b[i];
+		if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+		if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+		if (ca != cb) return 0;
+	}
+	return 1;
+}
+
+/* the first of the first _upto_ pairs with key _key_, NULL if none */
+static const dnssd_tr_entry_t *
+dnssd_tr_lazy_find(const dnssd_tr_lazy_t *lazy, const char *key,
+									 long key_len, long upto)
+{
+	const char *buf = dnssd_tr_lazy_bytes(lazy);
+	long i;
+	for (i=0; i<upto; i++) {
+		const dnssd_tr_entry_t *entry = &lazy->entries[i];
+		if (entry->key_len == key_len &&
+				dnssd_tr_key_equal(buf + entry->offset, key, key_len))
+			return entry;
+	}
+	return NULL;
+}
+
+/* whether pair _i_ is the first with its key */
+static int
+dnssd_tr_lazy_first(const dnssd_tr_lazy_t *lazy, long i)
+{
+	const dnssd_tr_entry_t *entry = &lazy->entries[i];
+	return dnssd_tr_lazy_find(lazy, dnssd_tr_lazy_bytes(lazy) + entry->offset,
+														entry->key_len, i) == NULL;
+}
+
+static const dnssd_tr_entry_t *
+dnssd_tr_lazy_lookup(VALUE self, VALUE key)
+{
+	dnssd_tr_lazy_t *lazy;
+	GetDNSSDLazyTextRecord(self, lazy);
+	if (SYMBOL_P(key)) key = rb_str_new2(rb_id2name(SYM2ID(key)));
+	StringValue(key);
+	return dnssd_tr_lazy_find(lazy, RSTRING_PTR(key), RSTRING_LEN(key), lazy->count);
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record[key] => string or nil
+ *
+ * The value of the first pair with key _key_ (a String or Symbol),
+ * ignoring case.  +nil+ if the key has no value or is not present,
+ * see DNSSD::LazyTextRecord#has_key?.
+ */
+
+static VALUE
+dnssd_tr_lazy_aref(VALUE self, VALUE key)
+{
+	dnssd_tr_lazy_t *lazy;
+	const dnssd_tr_entry_t *entry = dnssd_tr_lazy_lookup(self, key);
+	GetDNSSDLazyTextRecord(self, lazy);
+	return entry ? dnssd_tr_entry_value(dnssd_tr_lazy_bytes(lazy), entry) : Qnil;
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.has_key?(key) => true or false
+ *
+ * Whether there is a pair with key _key_, ignoring case.
+ */
+
+static VALUE
+dnssd_tr_lazy_has_key(VALUE self, VALUE key)
+{
+	return dnssd_tr_lazy_lookup(self, key) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.each {|key, value| block } => lazy_text_record
+ *
+ * Yields the key, value pairs in the order they were encoded.
+ * Only the first of pairs with the same key is yielded.
+ */
+
+static VALUE
+dnssd_tr_lazy_each(VALUE self)
+{
+	dnssd_tr_lazy_t *lazy;
+	long i;
+#ifdef RETURN_ENUMERATOR
+	RETURN_ENUMERATOR(self, 0, 0);
+#endif
+	GetDNSSDLazyTextRecord(self, lazy);
+	for (i=0; i<lazy->count; i++) {
+		if (dnssd_tr_lazy_first(lazy, i)) {
+			const char *buf = dnssd_tr_lazy_bytes(lazy);
+			VALUE key = dnssd_tr_entry_key(buf, &lazy->entries[i]);
+			rb_yield(rb_assoc_new(key, dnssd_tr_entry_value(buf, &lazy->entries[i])));
+		}
+	}
+	return self;
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.keys => array
+ *
+ * The keys, see DNSSD::LazyTextRecord#each.
+ */
+
+static VALUE
+dnssd_tr_lazy_keys(VALUE self)
+{
+	dnssd_tr_lazy_t *lazy;
+	VALUE keys = rb_ary_new();
+	long i;
+	GetDNSSDLazyTextRecord(self, lazy);
+	for (i=0; i<lazy->count; i++) {
+		if (dnssd_tr_lazy_first(lazy, i))
+			rb_ary_push(keys, dnssd_tr_entry_key(dnssd_tr_lazy_bytes(lazy), &lazy->entries[i]));
+	}
+	return keys;
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.size => integer
+ *
+ * The number of keys, see DNSSD::LazyTextRecord#each.
+ */
+
+static VALUE
+dnssd_tr_lazy_size(VALUE self)
+{
+	dnssd_tr_lazy_t *lazy;
+	long i, size = 0;
+	GetDNSSDLazyTextRecord(self, lazy);
+	for (i=0; i<lazy->count; i++) {
+		if (dnssd_tr_lazy_first(lazy, i)) size++;
+	}
+	return LONG2NUM(size);
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.to_hash => text_record
+ *
+ * A DNSSD::TextRecord of the pairs, see DNSSD::LazyTextRecord#each.
+ */
+
+static VALUE
+dnssd_tr_lazy_to_hash(VALUE self)
+{
+	dnssd_tr_lazy_t *lazy;
+	volatile VALUE hash = rb_obj_alloc(cDNSSDTextRecord);
+	long i;
+	GetDNSSDLazyTextRecord(self, lazy);
+	for (i=0; i<lazy->count; i++) {
+		if (dnssd_tr_lazy_first(lazy, i)) {
+			VALUE key = dnssd_tr_entry_key(dnssd_tr_lazy_bytes(lazy), &lazy->entries[i]);
+			rb_hash_aset(hash, key,
+									 dnssd_tr_entry_value(dnssd_tr_lazy_bytes(lazy), &lazy->entries[i]));
 		}
 	}
+	return hash;
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.encode => an_encoded_string
+ *
+ * The encoded text record, as received.
+ */
+
+static VALUE
+dnssd_tr_lazy_encode(VALUE self)
+{
+	dnssd_tr_lazy_t *lazy;
+	GetDNSSDLazyTextRecord(self, lazy);
+	if (lazy->bytes == NULL) return lazy->owner;
+	return rb_str_new(lazy->bytes, lazy->len);
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.freeze => lazy_text_record
+ *
+ * Freezes _lazy_text_record_.  One of a DNSSD::ResolveReply gets a copy
+ * of the encoded text record, as the reply it reads it from is not
+ * shareable, so Ractor.make_shareable() can be used on it:
+ *
+ *    worker.send(Ractor.make_shareable(resolve_reply.lazy_text_record))
+ */
+
+static VALUE
+dnssd_tr_lazy_freeze(VALUE self)
+{
+	dnssd_tr_lazy_t *lazy;
+	GetDNSSDLazyTextRecord(self, lazy);
+	if (!OBJ_FROZEN(self) && lazy->bytes != NULL) {
+		/* the entries are offsets, they index the copy as well */
+		lazy->owner = rb_obj_freeze(rb_str_new(lazy->bytes, lazy->len));
+		lazy->bytes = NULL;
+	}
+	return rb_obj_freeze(self);
+}
+
+/*
+ * call-seq:
+ *    lazy_text_record.inspect => string
+ *
+ */
+
+static VALUE
+dnssd_tr_lazy_inspect(VALUE self)
+{
+	VALUE buf = rb_str_buf_new(0);
+	rb_str_buf_cat2(buf, "#<");
+	rb_str_buf_cat2(buf, rb_obj_classname(self));
+	rb_str_buf_cat2(buf, " ");
+	rb_str_buf_append(buf, rb_inspect(dnssd_tr_lazy_to_hash(self)));
+	rb_str_buf_cat2(buf, ">");
 	return buf;
 }
 
+/*
+ * call-seq:
+ *    DNSSD::TextRecord.parse_strings(strings) => hash
+ *
+ * Decodes the key, value pairs of the text record strings _strings_
+ * (an Array of String, one pair each) following the DNS-SD conventions:
+ * keys are downcased, only the first pair with a key is kept and pairs
+ * without a key, or with a key that is not printable ASCII, are dropped.
+ */
+
+static VALUE
+dnssd_tr_s_parse_strings(VALUE klass, VALUE strings)
+{
+	VALUE hash = rb_hash_new();
+	long i, j;
+
+	strings = rb_Array(strings);
+	for (i=0; i<RARRAY_LEN(strings); i++) {
+		VALUE str = StringValue(RARRAY_PTR(strings)[i]);
+		dnssd_tr_entry_t entry;
+		VALUE key;
+		char *p;
+
+		if (RSTRING_LEN(str) == 0 || RSTRING_LEN(str) > UINT8_MAX ||
+				!dnssd_tr_entry(RSTRING_PTR(str), RSTRING_LEN(str), 0, 1, &entry))
+			continue;
+		key = dnssd_tr_entry_key(RSTRING_PTR(str), &entry);
+		p = RSTRING_PTR(key);
+		for (j=0; j<entry.key_len; j++) {
+			if (p[j] >= 'A' && p[j] <= 'Z') p[j] += 'a' - 'A';
+		}
+		if (RTEST(rb_funcall2(hash, dnssd_id_has_key_p, 1, &key))) continue;
+		rb_hash_aset(hash, key, dnssd_tr_entry_value(RSTRING_PTR(str), &entry));
+	}
+	return hash;
+}
+
 VALUE
 dnssd_tr_to_encoded_str(VALUE v)
 {
 	if (rb_obj_is_kind_of(v, rb_cHash) == Qtrue)
 		return dnssd_tr_encode(v);
+	if (rb_obj_is_kind_of(v, cDNSSDLazyTextRecord) == Qtrue)
+		return dnssd_tr_lazy_encode(v);
 	/* allow the user to use arbitrary strings as text records */
 	return StringValue(v);
 }
@@ -242,11 +738,44 @@ Init_DNSSD_TextRecord(void)
 #ifdef mDNSSD_RDOC_HACK
 	mDNSSD = rb_define_module("DNSSD");
 #endif
+	/* text records only use their own state, any Ractor may call them */
+	rb_ext_ractor_safe(1);
 	cDNSSDTextRecord = rb_define_class_under(mDNSSD, "TextRecord", rb_cHash);
 	
 	rb_define_singleton_method(cDNSSDTextRecord, "decode", dnssd_tr_decode, 1);
 
 	rb_define_method(cDNSSDTextRecord, "initialize", dnssd_tr_initialize, -1);
 	rb_define_method(cDNSSDTextRecord, "encode", dnssd_tr_encode, 0);
+	rb_define_singleton_method(cDNSSDTextRecord, "parse_strings", dnssd_tr_s_parse_strings, 1);
+
+	dnssd_id_has_key_p = rb_intern("has_key?");
+	dnssd_id_encoded = rb_intern("encoded");
+
+	cDNSSDLazyTextRecord = rb_define_class_under(mDNSSD, "LazyTextRecord", rb_cObject);
+	rb_include_module(cDNSSDLazyTextRecord, rb_mEnumerable);
+	rb_define_alloc_func(cDNSSDLazyTextRecord, dnssd_tr_lazy_s_alloc);
+	rb_define_method(cDNSSDLazyTextRecord, "initialize", dnssd_tr_lazy_initialize, 1);
+	rb_define_method(cDNSSDLazyTextRecord, "[]", dnssd_tr_lazy_aref, 1);
+	rb_define_method(cDNSSDLazyTextRecord, "has_key?", dnssd_tr_lazy_has_key, 1);
+	rb_define_method(cDNSSDLazyTextRecord, "key?", dnssd_tr_lazy_has_key, 1);
+	rb_define_method(cDNSSDLazyTextRecord, "include?", dnssd_tr_lazy_has_key, 1);
+	rb_define_method(cDNSSDLazyTextRecord, "each", dnssd_tr_lazy_each, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "each_pair", dnssd_tr_lazy_each, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "keys", dnssd_tr_lazy_keys, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "size", dnssd_tr_lazy_size, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "length", dnssd_tr_lazy_size, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "to_hash", dnssd_tr_lazy_to_hash, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "encode", dnssd_tr_lazy_encode, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "inspect", dnssd_tr_lazy_inspect, 0);
+	rb_define_method(cDNSSDLazyTextRecord, "freeze", dnssd_tr_lazy_freeze, 0);
+	rb_ext_ractor_safe(0);
 }
 
+/*
+ * Document-class: DNSSD::LazyTextRecord
+ *
+ * A read only text record that keeps the encoded pairs, see
+ * DNSSD::ResolveReply#lazy_text_record.  Lookups ignore the case of keys
+ * and find the first pair with a key, as DNS-SD requires.
+ */
+
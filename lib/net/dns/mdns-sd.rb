@@ -218,11 +218,17 @@ module Net
         #   and can include whitespace.
         # - Discard all keys but the first.
         # - Discard a string that aren't formatting accorded to these rules.
+        #
+        # Uses DNSSD::TextRecord.parse_strings when the DNSSD extension is loaded.
         def self.parse_strings(strings)
+          if defined?(::DNSSD::TextRecord) && ::DNSSD::TextRecord.respond_to?(:parse_strings)
+            return ::DNSSD::TextRecord.parse_strings(strings)
+          end
+
           h = {}
 
           strings.each do |kv|
-            if kv.match( /^([\x20-\x3c\x3f-\x7e]+)(?:=(.*))?$/ )
+            if kv.match( /\A([\x20-\x3c\x3e-\x7e]+)(?:=(.*))?\z/m )
               key = $1.downcase
               value = $2
               next if h.has_key? key
@@ -838,6 +838,23 @@ module Net
           end
         end
 
+        # Announce changed records of a running +service+, once, with the
+        # cache-flush bit set so they replace the old ones in peers' caches.
+        def service_update(service, update_answers)
+          @mutex.synchronize do
+            debug( "update service #{service.to_s}" )
+
+            umsg = Message.new(0)
+            umsg.rd = 0
+            umsg.qr = 1
+            umsg.aa = 1
+            update_answers.each do |a|
+              umsg.add_answer(*(a + [true]))
+            end
+            send(umsg)
+          end
+        end
+
       end # Responder
 
       # An mDNS query implementation.
@@ -1043,6 +1060,15 @@ module Net
           @txt[key.to_str] = value.to_str
         end
 
+        # Replace the key/value pairs of the TXT record of a started service.
+        # The record is swapped and announced once (as a cache flush), the
+        # service is not stopped and re-announced.
+        def text_record=(txt)
+          @txt = txt || {}
+          @rrtxt = txt_rr
+          Responder.instance.service_update(self, [[@instance, @srvttl, @rrtxt]])
+        end
+
         def to_s
           "MDNS::Service: #{@instance} is #{@target}:#{@port}>"
         end
@@ -1088,9 +1114,7 @@ module Net
 
           @rrsrv = IN::SRV.new(@priority, @weight, @port, @target)
 
-          strings = @txt.map { |k,v| k + '=' + v }
-
-          @rrtxt = IN::TXT.new(*strings)
+          @rrtxt = txt_rr
 
           # class << self
           #   undef_method 'ttl='
@@ -1118,6 +1142,13 @@ module Net
           self
         end
 
+        private
+
+        def txt_rr
+          strings = @txt.map { |k,v| k + '=' + v }
+          IN::TXT.new(*strings)
+        end
+
       end
     end
 
@@ -0,0 +1,70 @@
+#!/usr/bin/env ruby
+# Measures the extension against the stand-in daemon, build it with
+#   cd ext && ruby extconf.rb --enable-dnssd-stub && make
+$:.unshift '../../lib'
+$:.unshift '../../ext'
+
+require 'optparse'
+require 'thread'
+require 'dnssd'
+
+Thread.abort_on_exception = true
+
+unless defined? DNSSD::Stub
+  abort "rdnssd was not built with --enable-dnssd-stub"
+end
+
+options = {}
+
+ARGV.options do |opts|
+  opts.on('-nnumber_of_services', '--number=number_of_services',
+					'Number of services announced in one burst') { |v| options[:number] = v }
+  opts.on('-rnumber_of_resolves', '--resolves=number_of_resolves',
+					'Number of resolves') { |v| options[:resolves] = v }
+  opts.on('-lseconds', '--latency=seconds',
+					'Time every reply is held back by the daemon') { |v| options[:latency] = v }
+  opts.parse!
+end
+
+# time until all replies to a burst of _number_ services are delivered
+def bench_browse(number, type)
+  queue = Queue.new
+  browser = DNSSD.browse(type) { |reply| queue << reply }
+  start = Time.now
+  DNSSD::Stub.announce(type, number)
+  number.times { queue.pop }
+  elapsed = Time.now - start
+  browser.stop
+  DNSSD::Stub.withdraw(type)
+  elapsed
+end
+
+# the time each resolve of an announced service takes, one after the other
+def bench_resolve(number, type)
+  DNSSD::Stub.announce(type, 1, :text_record => {"path" => "/"})
+  queue = Queue.new
+  times = (1..number).map do
+    start = Time.now
+    resolver = DNSSD.resolve("stub 1", type, "local") { |reply| queue << reply }
+    queue.pop
+    resolver.stop
+    Time.now - start
+  end
+  DNSSD::Stub.withdraw(type)
+  times.sort
+end
+
+if __FILE__ == $0 then
+  number = (options[:number] || 10000).to_i
+  resolves = (options[:resolves] || 1000).to_i
+  DNSSD::Stub.latency = (options[:latency] || 0).to_f
+  type = "_bench._tcp"
+
+  elapsed = bench_browse(number, type)
+  printf("browse: %d replies in %.3fs, %.0f replies/s\n", number, elapsed, number / elapsed)
+
+  times = bench_resolve(resolves, type)
+  printf("resolve: %d in %.3fs, median %.1fus, 99%% %.1fus\n", resolves,
+         times.inject(0) { |sum, t| sum + t },
+         times[times.size / 2] * 1e6, times[(times.size * 99) / 100] * 1e6)
+end
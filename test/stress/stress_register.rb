@@ -16,6 +16,8 @@ ARGV.options do |opts|
 					'Type of service (e.g. _http._tcp)') { |options[:type]| }
   opts.on('-pport','--port=port',
 					'Base port on which to advertise (will increase by 1 for every advertisement)') { |options[:port]| }
+  opts.on('-m', '--many',
+					'Register all services with one DNSSD.register_many call') { |options[:many]| }
   opts.parse!
 end
 
@@ -33,12 +35,29 @@ def register_stress(number, type)
   registrars
 end
 
+def register_many_stress(number, type)
+  specs = (1..number).map do |num|
+    { :name => "ruby stress #{num}", :type => type, :domain => "local",
+      :port => 8080 + num,
+      :text_record => { "1st" => "First#{num}", "last" => "Last#{num}" } }
+  end
+  group = DNSSD.register_many(specs) do |results|
+    failed = results.grep(DNSSD::Error)
+    puts "#{results.size - failed.size} registered, #{failed.size} failed"
+  end
+  [group]
+end
+
 if __FILE__ == $0 then
   number = options[:number] || 300
   number = number.to_i
   type = options[:type] || "_http._tcp"
   port = options[:port] || 8080
-  registrars = register_stress(number, type)
+  if options[:many]
+    registrars = register_many_stress(number, type)
+  else
+    registrars = register_stress(number, type)
+  end
   puts "#{number} services registered...press enter to terminate"
   gets
   registrars.each do |reg|
@@ -0,0 +1,29 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+registrars = (1..20).map do |num|
+  DNSSD.register("chad ruby #{num}", "_http._tcp", nil, 8080 + num) do |register_reply|
+    puts "Registration: #{register_reply.inspect}"
+  end
+end
+sleep 2
+
+pipeline = DNSSD.browse_and_resolve("_http._tcp", :limit => 4) do |resolve_reply|
+  puts "Resolve: #{resolve_reply.name} #{resolve_reply.inspect}"
+end
+
+$stdin.gets
+
+pipeline.stop
+registrars.each { |registrar| registrar.stop }
@@ -0,0 +1,37 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+registrars = (1..20).map do |num|
+  name = num.even? ? "chad ruby #{num}" : "other ruby #{num}"
+  text_record = DNSSD::TextRecord.new
+  text_record["role"] = num % 3 == 0 ? "ci" : "dev"
+  DNSSD.register(name, "_http._tcp", nil, 8080 + num, text_record) do |register_reply|
+    puts "Registration: #{register_reply.inspect}"
+  end
+end
+sleep 2
+
+browser = DNSSD.browse("_http._tcp", :prefix => "chad ruby", :only => :add) do |browse_reply|
+  puts "Browse: #{browse_reply.inspect}"
+  DNSSD.resolve(browse_reply.name, browse_reply.type, browse_reply.domain,
+                :text => {"role" => "ci"}) do |resolve_reply|
+    puts "Resolve: #{resolve_reply.inspect}"
+    resolve_reply.service.stop
+  end
+end
+
+$stdin.gets
+
+browser.stop
+registrars.each { |registrar| registrar.stop }
@@ -0,0 +1,34 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+connection = DNSSD::Connection.new
+
+registrar = connection.register("chad ruby", "_http._tcp", nil, 8080) do |register_reply|
+  puts "Registration: #{register_reply.inspect}"
+end
+sleep 4
+browse_service = connection.browse('_http._tcp') do |browse_reply|
+  puts "Browse: #{browse_reply.inspect}"
+  connection.resolve(browse_reply.name, browse_reply.type, browse_reply.domain) do |resolve_reply|
+    puts "Resolve: #{resolve_reply.inspect}"
+    resolve_reply.service.stop
+  end
+end
+
+$stdin.gets
+
+registrar.stop
+browse_service.stop
+connection.stop
+puts connection.inspect
@@ -0,0 +1,29 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+host = ARGV.shift || "#{`hostname -s`.chomp}.local."
+
+services = [:A, :AAAA].map do |rrtype|
+  DNSSD.query_record(host, rrtype) do |record_reply|
+    puts record_reply.inspect
+  end
+end
+ptr = DNSSD.query_record("_http._tcp.local.", :PTR) do |record_reply|
+  puts record_reply.inspect
+end
+services << ptr
+
+$stdin.gets
+
+services.each { |service| service.stop }
@@ -0,0 +1,57 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+abort "needs ruby 3.0 or later" unless defined? Ractor
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+# takes the text records apart while the main Ractor browses and resolves
+indexer = Ractor.new do
+  index = Hash.new { |h, k| h[k] = [] }
+  while (msg = Ractor.receive) != :done
+    fullname, text_record = msg
+    text_record.each { |key, value| index[key] << fullname }
+  end
+  index
+end
+
+registrars = (1..10).map do |num|
+  text_record = DNSSD::TextRecord.new
+  text_record["path"] = "/#{num}"
+  DNSSD.register("chad ruby #{num}", "_http._tcp", nil, 8080 + num, text_record) do |register_reply|
+    puts "Registration: #{register_reply.inspect}"
+  end
+end
+
+# browses on an event loop of its own while the main Ractor resolves
+counter = Ractor.new do
+  names = Thread::Queue.new
+  browser = DNSSD.browse("_http._tcp") { |browse_reply| names << browse_reply.name }
+  found = (1..10).map { names.pop }
+  browser.stop
+  found
+end
+
+browser = DNSSD.browse_and_resolve("_http._tcp") do |resolve_reply|
+  puts "Resolve: #{resolve_reply.inspect}"
+  indexer.send([resolve_reply.fullname,
+                Ractor.make_shareable(resolve_reply.lazy_text_record)])
+end
+
+puts "Browsed in a Ractor: #{counter.take.sort.inspect}"
+
+$stdin.gets
+
+browser.stop
+registrars.each { |registrar| registrar.stop }
+indexer.send(:done)
+puts "Index: #{indexer.take.inspect}"
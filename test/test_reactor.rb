@@ -0,0 +1,30 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+# the services below are run by this loop, not by threads
+
+registrar = DNSSD.register("chad ruby", "_http._tcp", nil, 8080, nil, :reactor => true) do |register_reply|
+  puts "Registration: #{register_reply.inspect}"
+end
+browser = DNSSD.browse('_http._tcp', :reactor => true) do |browse_reply|
+  puts "Browse: #{browse_reply.inspect}"
+end
+
+services = [registrar, browser]
+deadline = Time.now + 10
+while Time.now < deadline
+  ready, = IO.select(services.map { |service| service.to_io }, nil, nil, 1)
+  next unless ready
+  services.each do |service|
+    service.process(:max => 16) if ready.include?(service.to_io)
+  end
+end
+puts "#{Thread.list.size} thread(s)"
+
+services.each { |service| service.stop }
@@ -0,0 +1,35 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+set = DNSSD::RecordSet.new do |record|
+  puts "Record: #{record.inspect} #{record.error}"
+end
+
+host = set.add("ruby-record-set.local.", :A, [10, 0, 0, 1].pack("C4"), 120)
+set.add_many((2..20).map do |i|
+  ["ruby-record-set-#{i}.local.", :A, [10, 0, 0, i].pack("C4"), 120]
+end)
+sleep 4
+
+query = DNSSD.query_record("ruby-record-set.local.", :A) do |record_reply|
+  puts "Query: #{record_reply.inspect}"
+end
+sleep 2
+set.update(host, [10, 0, 0, 100].pack("C4"))
+
+$stdin.gets
+
+query.stop
+set.remove(host)
+set.stop
@@ -25,6 +25,11 @@ browse_service = DNSSD.browse('_http._tcp') do |browse_reply|
   puts "Browse: #{browse_reply.inspect}"
 end
 
+sleep 4
+# updated in place, without re-registering
+registrar.text_record = { "load" => "0.5" }
+puts "Text record updated"
+
 $stdin.gets
 
 registrar.stop
@@ -0,0 +1,28 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+require 'socket'
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+registrar = DNSSD.register("chad ruby", "_http._tcp", nil, 8080) do |register_reply|
+  puts "Registration: #{register_reply.inspect}"
+end
+sleep 2
+
+lookup = DNSSD.resolve_addresses("chad ruby", "_http._tcp", "local") do |addrinfo|
+  puts "Address: #{addrinfo.inspect}"
+end
+
+$stdin.gets
+
+lookup.stop
+registrar.stop
@@ -0,0 +1,38 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+registrar = DNSSD.register("chad ruby cache", "_http._tcp", nil, 8080) do |register_reply|
+  puts "Registration: #{register_reply.inspect}"
+end
+sleep 2
+
+DNSSD::ResolveCache.ttl = true
+
+3.times do
+  start = Time.now
+  resolve_reply = DNSSD.resolve_sync("chad ruby cache", "_http._tcp", "local")
+  puts "Resolve (#{Time.now - start}s): #{resolve_reply.inspect}"
+end
+puts "hits #{DNSSD::ResolveCache.hits}, misses #{DNSSD::ResolveCache.misses}"
+
+browser = DNSSD.browse("_http._tcp") do |browse_reply|
+  puts "Browse: #{browse_reply.inspect}"
+end
+
+$stdin.gets
+
+registrar.stop
+sleep 2
+puts "cached after stop: #{DNSSD.resolve_sync("chad ruby cache", "_http._tcp", "local", :timeout => 1).inspect}"
+browser.stop
@@ -0,0 +1,37 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+DNSSD.share_subscriptions = true
+
+registrar = DNSSD.register("chad ruby", "_http._tcp", nil, 8080) do |register_reply|
+  puts "Registration: #{register_reply.inspect}"
+end
+
+first = DNSSD.browse("_http._tcp") do |browse_reply|
+  puts "First: #{browse_reply.inspect}"
+end
+
+sleep 2
+
+# no new browse, the instances found so far are passed to the block first
+second = DNSSD.browse("_http._tcp") do |browse_reply|
+  puts "Second: #{browse_reply.inspect}"
+end
+
+$stdin.gets
+
+first.stop
+registrar.stop # only the second browse sees it go
+sleep 1
+second.stop
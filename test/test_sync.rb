@@ -0,0 +1,24 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+registrar = DNSSD.register("chad ruby", "_http._tcp", nil, 8080) do |register_reply|
+  puts "Registration: #{register_reply.inspect}"
+end
+sleep 2
+
+replies = DNSSD.browse_for('_http._tcp', :timeout => 2)
+puts "Browsed #{replies.size} replies in 2 seconds, #{Thread.list.size} thread(s)"
+replies.each do |browse_reply|
+  puts "Browse: #{browse_reply.inspect}"
+  resolve_reply = DNSSD.resolve_sync(browse_reply.name, browse_reply.type,
+                                     browse_reply.domain, :timeout => 3)
+  puts "Resolve: #{resolve_reply.inspect}"
+end
+
+registrar.stop
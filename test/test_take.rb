@@ -0,0 +1,36 @@
+begin
+  require 'dnssd'
+rescue LoadError => error
+  #This is just in case you did not install, but want to test
+  $:.unshift '../lib'
+  $:.unshift '../ext'
+  require 'dnssd'
+end
+
+Thread.abort_on_exception = true
+
+print "Press <return> to start (and <return to end): "
+$stdin.gets
+
+registrars = (1..20).map do |num|
+  DNSSD.register("chad ruby #{num}", "_http._tcp", nil, 8080 + num) do |register_reply|
+    puts "Registration: #{register_reply.inspect}"
+  end
+end
+
+browser = DNSSD.browse("_http._tcp", :buffer => 8, :overflow => :coalesce)
+
+consumer = Thread.new do
+  browser.each do |browse_reply|
+    puts "Browse: #{browse_reply.inspect}"
+    sleep 0.5 # a slow consumer
+  end
+end
+
+$stdin.gets
+
+registrars.each { |registrar| registrar.stop }
+sleep 2
+puts "#{browser.buffered} buffered, overflows: #{browser.overflows.inspect}"
+browser.stop
+consumer.join
@@ -33,6 +33,37 @@ class Test_DNSSD < Test::Unit::TestCase
 		# the same as decode.
 		tr_new = TextRecord.new(enc_str)
 		assert_equal(tr_new, tr)
+
+		# the encoding is kept until the record changes
+		assert_same(tr.encode, tr.encode)
+		tr["key"] << "s"
+		assert_equal(TextRecord.decode(tr.encode), {"key"=>"values"})
+
+		# pairs are bounded by their length, even without a NUL
+		assert_equal({"abc"=>nil, "x"=>"y"}, TextRecord.decode("\003abc\003x=y"))
+		assert_equal({}, TextRecord.decode("\000"))
+		assert_raise(ArgumentError) do
+			TextRecord.decode("\010ab")
+		end
+	end
+
+	def test_lazy_text_record
+		enc_str = "\010Last=Sam\004flag\010LAST=Jim"
+		tr = LazyTextRecord.new(enc_str)
+		assert_equal("Sam", tr["last"])
+		assert_equal("Sam", tr[:LAST])
+		assert(tr.has_key?("Flag"))
+		assert_nil(tr["flag"])
+		assert(!tr.has_key?("missing"))
+		assert_equal(["Last", "flag"], tr.keys)
+		assert_equal({"Last"=>"Sam", "flag"=>nil}, tr.to_hash)
+		assert_equal(enc_str, tr.encode)
+		assert_raise(ArgumentError) do
+			LazyTextRecord.new("\010ab")
+		end
+
+		assert_equal({"last"=>"Sam", "flag"=>nil},
+								 TextRecord.parse_strings(["Last=Sam", "flag", "LAST=Jim", "=empty"]))
 	end
 
 	def test_flags
@@ -48,6 +79,12 @@ class Test_DNSSD < Test::Unit::TestCase
 		
 		assert_same(true, f.add = true)
 		assert(f.add?)
+
+		# a copy can be changed without changing the original
+		g = Flags.new(f)
+		g.add = false
+		assert(f.add?)
+		assert(!g.add?)
 	end
 
 	def test_browse